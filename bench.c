@@ -0,0 +1,294 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Times intercepted calls in tight loops, from 1 to max_threads threads, and
+ * prints their latency percentiles as tab-separated values:
+ *
+ *   mode op threads calls mean_ns p50_ns p90_ns p99_ns p999_ns max_ns
+ *
+ * Run it once as is and once with libPreloadLogger.so in LD_PRELOAD, from a
+ * scratch directory that HOME points to, and compare the two runs. Only the
+ * measured call is timed, the setup and cleanup calls around it are not. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ITERATIONS      20000
+#define BENCH_FORK_ITERATIONS 200
+#define BENCH_PATH_LEN        64
+
+typedef struct _BenchThread {
+  pthread_t          thread;
+  long               iterations;
+  int64_t           *samples;
+  char               path[BENCH_PATH_LEN];
+  char               other[BENCH_PATH_LEN];
+} BenchThread;
+
+typedef int64_t (*BenchOp) (BenchThread *t, long i);
+
+typedef struct _BenchCase {
+  const char        *name;
+  BenchOp            op;
+  long               iterations;
+} BenchCase;
+
+static pthread_barrier_t barrier;
+static BenchOp current_op;
+
+static int64_t bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define BENCH_TIME(call) ({ int64_t _start = bench_now (); call; bench_now () - _start; })
+
+static int64_t bench_open (BenchThread *t, long i)
+{
+  int fd;
+  int64_t ns = BENCH_TIME (fd = open (t->path, O_CREAT | O_WRONLY, 0600));
+  close (fd);
+  return ns;
+}
+
+static int64_t bench_openat (BenchThread *t, long i)
+{
+  int fd;
+  int64_t ns = BENCH_TIME (fd = openat (AT_FDCWD, t->path, O_RDONLY));
+  close (fd);
+  return ns;
+}
+
+static int64_t bench_close (BenchThread *t, long i)
+{
+  int fd = open (t->path, O_CREAT | O_WRONLY, 0600);
+  return BENCH_TIME (close (fd));
+}
+
+static int64_t bench_fopen (BenchThread *t, long i)
+{
+  FILE *fp;
+  int64_t ns = BENCH_TIME (fp = fopen (t->path, "r"));
+  if (fp)
+    fclose (fp);
+  return ns;
+}
+
+static int64_t bench_fclose (BenchThread *t, long i)
+{
+  FILE *fp = fopen (t->path, "r");
+  if (!fp)
+    return 0;
+  return BENCH_TIME (fclose (fp));
+}
+
+static int64_t bench_dup2 (BenchThread *t, long i)
+{
+  int fd = open (t->path, O_CREAT | O_WRONLY, 0600);
+  int copy = fcntl (fd, F_DUPFD, 512);
+  int64_t ns = BENCH_TIME (dup2 (fd, copy));
+  close (copy);
+  close (fd);
+  return ns;
+}
+
+static int64_t bench_opendir (BenchThread *t, long i)
+{
+  DIR *dir;
+  int64_t ns = BENCH_TIME (dir = opendir ("."));
+  if (dir)
+    closedir (dir);
+  return ns;
+}
+
+static int64_t bench_rename (BenchThread *t, long i)
+{
+  // Flip the file back and forth between its two names
+  if (i % 2)
+    return BENCH_TIME (rename (t->other, t->path));
+  return BENCH_TIME (rename (t->path, t->other));
+}
+
+static int64_t bench_unlink (BenchThread *t, long i)
+{
+  close (open (t->other, O_CREAT | O_WRONLY, 0600));
+  return BENCH_TIME (unlink (t->other));
+}
+
+static int64_t bench_socket (BenchThread *t, long i)
+{
+  int fd;
+  int64_t ns = BENCH_TIME (fd = socket (AF_UNIX, SOCK_STREAM, 0));
+  close (fd);
+  return ns;
+}
+
+static int64_t bench_fork (BenchThread *t, long i)
+{
+  pid_t pid;
+  int64_t ns = BENCH_TIME (pid = fork ());
+  if (pid == 0)
+    _exit (0);
+  if (pid > 0)
+    waitpid (pid, NULL, 0);
+  return ns;
+}
+
+static const BenchCase cases[] = {
+  { "open",     bench_open,     BENCH_ITERATIONS },
+  { "openat",   bench_openat,   BENCH_ITERATIONS },
+  { "close",    bench_close,    BENCH_ITERATIONS },
+  { "fopen",    bench_fopen,    BENCH_ITERATIONS },
+  { "fclose",   bench_fclose,   BENCH_ITERATIONS },
+  { "dup2",     bench_dup2,     BENCH_ITERATIONS },
+  { "opendir",  bench_opendir,  BENCH_ITERATIONS },
+  { "rename",   bench_rename,   BENCH_ITERATIONS },
+  { "unlink",   bench_unlink,   BENCH_ITERATIONS },
+  { "socket",   bench_socket,   BENCH_ITERATIONS },
+  { "fork",     bench_fork,     BENCH_FORK_ITERATIONS },
+  { NULL, NULL, 0 }
+};
+
+static void *bench_thread (void *data)
+{
+  BenchThread *t = data;
+  long i;
+
+  pthread_barrier_wait (&barrier);
+  for (i = 0; i < t->iterations; ++i)
+    t->samples[i] = current_op (t, i);
+
+  return NULL;
+}
+
+static int bench_compare (const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static int64_t bench_percentile (const int64_t *sorted, long n, double p)
+{
+  long i = (long) (p * (n - 1));
+  return sorted[i];
+}
+
+static int bench_run (const char *mode, const BenchCase *c, int n_threads, BenchThread *threads)
+{
+  long n = c->iterations * n_threads, i;
+  int64_t *all = malloc (n * sizeof (int64_t));
+  double total = 0;
+  int t;
+
+  if (!all)
+    return 1;
+
+  current_op = c->op;
+  pthread_barrier_init (&barrier, NULL, n_threads);
+
+  for (t = 0; t < n_threads; ++t) {
+    threads[t].iterations = c->iterations;
+    threads[t].samples = all + t * c->iterations;
+    close (open (threads[t].path, O_CREAT | O_WRONLY, 0600));
+    unlink (threads[t].other);
+  }
+
+  for (t = 1; t < n_threads; ++t)
+    pthread_create (&threads[t].thread, NULL, bench_thread, &threads[t]);
+  bench_thread (&threads[0]);
+  for (t = 1; t < n_threads; ++t)
+    pthread_join (threads[t].thread, NULL);
+
+  pthread_barrier_destroy (&barrier);
+
+  qsort (all, n, sizeof (int64_t), bench_compare);
+  for (i = 0; i < n; ++i)
+    total += all[i];
+
+  printf ("%s\t%s\t%d\t%ld\t%.0f\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+          mode, c->name, n_threads, n, total / n,
+          (long long) bench_percentile (all, n, 0.5),
+          (long long) bench_percentile (all, n, 0.9),
+          (long long) bench_percentile (all, n, 0.99),
+          (long long) bench_percentile (all, n, 0.999),
+          (long long) all[n - 1]);
+  fflush (stdout);
+
+  free (all);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *mode = argc > 1 ? argv[1] : (getenv ("LD_PRELOAD") ? "preload" : "baseline");
+  int max_threads = argc > 2 ? atoi (argv[2]) : sysconf (_SC_NPROCESSORS_ONLN);
+  int n_threads, t, failed = 0;
+  const BenchCase *c;
+
+  if (max_threads < 1)
+    max_threads = 1;
+
+  // Events are only logged for user processes, measure with logging on
+  if (geteuid () == 0 && (setgid (65534) || setuid (65534))) {
+    fprintf (stderr, "could not drop privileges\n");
+    return 1;
+  }
+  if (geteuid () < 1000)
+    fprintf (stderr, "warning: events are not logged for uid %d\n", geteuid ());
+
+  BenchThread *threads = calloc (max_threads, sizeof (BenchThread));
+  if (!threads)
+    return 1;
+
+  for (t = 0; t < max_threads; ++t) {
+    snprintf (threads[t].path, BENCH_PATH_LEN, "bench-%d", t);
+    snprintf (threads[t].other, BENCH_PATH_LEN, "bench-%d.renamed", t);
+  }
+
+  printf ("mode\top\tthreads\tcalls\tmean_ns\tp50_ns\tp90_ns\tp99_ns\tp999_ns\tmax_ns\n");
+
+  // 1, 2, 4... threads, and max_threads last
+  for (c = cases; c->name; ++c) {
+    for (n_threads = 1; ; n_threads = n_threads * 2 < max_threads ? n_threads * 2 : max_threads) {
+      failed |= bench_run (mode, c, n_threads, threads);
+      if (n_threads == max_threads)
+        break;
+    }
+  }
+
+  for (t = 0; t < max_threads; ++t) {
+    unlink (threads[t].path);
+    unlink (threads[t].other);
+  }
+  free (threads);
+
+  return failed;
+}
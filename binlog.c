@@ -0,0 +1,717 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "binlog.h"
+
+/* Both ends of a binary log keep the same dictionary of recent strings, and
+ * update it in the same order, so that ids mean the same thing to both. The
+ * encoder finds strings through a chained hash table, the decoder only goes by
+ * id. See binlog.h for how strings come and go. */
+
+#define PRELOG_BINLOG_BUCKETS      16384 /* a power of two */
+#define PRELOG_BINLOG_MAX_SUBJECTS 8
+#define PRELOG_BINLOG_NUMBER_MAX   18    /* digits, so that numbers fit in 63 bits */
+#define PRELOG_BINLOG_VARINT_MAX   10
+#define PRELOG_BINLOG_FRAME_MAX    4     /* kind and a length below 2^21 */
+
+const char *const prelog_binlog_interpretations[] = {
+  CREAT_SCI, OPEN_SCI, OPENAT_SCI, OPEN64_SCI, OPENAT64_SCI, CLOSE_SCI,
+  FOPEN_SCI, POPEN_SCI, FREOPEN_SCI, FDOPEN_SCI, FCLOSE_SCI, PCLOSE_SCI,
+  FORK_SCI, DUP_SCI, DUP2_SCI, DUP3_SCI, LINK_SCI, LINKAT_SCI, SYMLINK_SCI,
+  SYMLINKAT_SCI, UNLINK_SCI, RMDIR_SCI, REMOVE_SCI, SOCKET_SCI,
+  SOCKETPAIR_SCI, MKFIFO_SCI, MKFIFOAT_SCI, PIPE_SCI, PIPE2_SCI, OPENDIR_SCI,
+  FDOPENDIR_SCI, CLOSEDIR_SCI, MKDIR_SCI, MKDIRAT_SCI, RENAME_SCI,
+  RENAMEAT_SCI, RENAMEAT2_SCI, SHM_OPEN_SCI, SHM_UNLINK_SCI,
+  NULL /* new interpretations go right above, never in between */
+};
+
+typedef struct _PrelogBinlogString {
+  char              *data;      /* NULL for a free id */
+  size_t             len;
+  uint64_t           hash;
+  uint32_t           next;      /* id + 1 of the next string in the bucket */
+  int                referenced;
+} PrelogBinlogString;
+
+struct _PrelogBinlog {
+  uint32_t          *buckets;   /* id + 1 of the first string, or 0 */
+  PrelogBinlogString *strings;
+  size_t             count;     /* ids handed out so far */
+  size_t             capacity;
+  size_t             live;
+  size_t             bytes;     /* held by live strings */
+  size_t             hand;      /* the clock hand, an id */
+  uint32_t          *free_ids;
+  size_t             n_free;
+  char              *scratch;   /* templates get built here */
+  PrelogTime         previous;
+  int                has_previous;
+};
+
+typedef struct _PrelogSpan {
+  const char        *data;
+  size_t             len;
+} PrelogSpan;
+
+typedef struct _PrelogParsedEvent {
+  PrelogSpan         interpretation;
+  size_t             n_subjects;
+  PrelogSpan         fields[PRELOG_BINLOG_MAX_SUBJECTS][3]; /* uri, text, origin */
+} PrelogParsedEvent;
+
+PrelogBinlog *prelog_binlog_new (void)
+{
+  PrelogBinlog *b = calloc (1, sizeof (PrelogBinlog));
+  if (!b)
+    return NULL;
+
+  b->buckets = calloc (PRELOG_BINLOG_BUCKETS, sizeof (uint32_t));
+  b->free_ids = malloc (PRELOG_BINLOG_MAX_STRINGS * sizeof (uint32_t));
+  b->scratch = malloc (PRELOG_RECORD_MAX);
+  if (!b->buckets || !b->free_ids || !b->scratch) {
+    prelog_binlog_free (b);
+    return NULL;
+  }
+
+  return b;
+}
+
+void prelog_binlog_free (PrelogBinlog *b)
+{
+  size_t i;
+
+  if (!b)
+    return;
+
+  for (i = 0; i < b->count; ++i)
+    free (b->strings[i].data);
+  free (b->buckets);
+  free (b->strings);
+  free (b->free_ids);
+  free (b->scratch);
+  free (b);
+}
+
+static uint64_t prelog_binlog_hash (const char *data, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    h = (h ^ (unsigned char) data[i]) * 1099511628211ULL;
+  return h;
+}
+
+static uint32_t *prelog_binlog_bucket (PrelogBinlog *b, uint64_t hash)
+{
+  return &b->buckets[hash & (PRELOG_BINLOG_BUCKETS - 1)];
+}
+
+// Returns the id of a live string, or -1
+static long prelog_binlog_find (PrelogBinlog *b, const char *data, size_t len, uint64_t hash)
+{
+  uint32_t next = *prelog_binlog_bucket (b, hash);
+  while (next) {
+    PrelogBinlogString *s = &b->strings[next - 1];
+    if (s->hash == hash && s->len == len && !memcmp (s->data, data, len))
+      return next - 1;
+    next = s->next;
+  }
+  return -1;
+}
+
+static void prelog_binlog_evict (PrelogBinlog *b, size_t id)
+{
+  PrelogBinlogString *s = &b->strings[id];
+  uint32_t *link = prelog_binlog_bucket (b, s->hash);
+
+  while (*link != id + 1)
+    link = &b->strings[*link - 1].next;
+  *link = s->next;
+
+  b->bytes -= s->len;
+  b->live--;
+  free (s->data);
+  s->data = NULL;
+}
+
+// The first live string the clock hand finds unreferenced, clearing the
+// references it passes; there must be a live string
+static size_t prelog_binlog_victim (PrelogBinlog *b)
+{
+  for (;;) {
+    size_t id = b->hand;
+    b->hand = (b->hand + 1) % b->count;
+    if (!b->strings[id].data)
+      continue;
+    if (!b->strings[id].referenced)
+      return id;
+    b->strings[id].referenced = 0;
+  }
+}
+
+/* Adds a string to the dictionary, evicting old ones to make room, and
+ * returns its id, or -1 without touching the dictionary when memory is short.
+ * The encoder and the decoder must call it for the same strings in the same
+ * order. */
+static long prelog_binlog_add (PrelogBinlog *b, const char *data, size_t len, uint64_t hash)
+{
+  PrelogBinlogString *s;
+  size_t id;
+  char *copy = malloc (len ? len : 1);
+
+  if (!copy)
+    return -1;
+
+  if (!b->n_free && b->count < PRELOG_BINLOG_MAX_STRINGS && b->count == b->capacity) {
+    size_t capacity = b->capacity ? b->capacity * 2 : 256;
+    PrelogBinlogString *strings = realloc (b->strings, capacity * sizeof (PrelogBinlogString));
+    if (!strings) {
+      free (copy);
+      return -1;
+    }
+    b->strings = strings;
+    b->capacity = capacity;
+  }
+
+  if (b->n_free) {
+    id = b->free_ids[--b->n_free];
+  } else if (b->count < PRELOG_BINLOG_MAX_STRINGS) {
+    id = b->count++;
+    b->strings[id].data = NULL;
+  } else {
+    id = prelog_binlog_victim (b);
+    prelog_binlog_evict (b, id);
+  }
+
+  while (b->live && b->bytes + len > PRELOG_BINLOG_BYTES_MAX) {
+    size_t victim = prelog_binlog_victim (b);
+    prelog_binlog_evict (b, victim);
+    b->free_ids[b->n_free++] = victim;
+  }
+
+  memcpy (copy, data, len);
+  s = &b->strings[id];
+  s->data = copy;
+  s->len = len;
+  s->hash = hash;
+  s->referenced = 0;
+  s->next = *prelog_binlog_bucket (b, hash);
+  *prelog_binlog_bucket (b, hash) = id + 1;
+  b->bytes += len;
+  b->live++;
+  return id;
+}
+
+static size_t prelog_binlog_put_varint (char *out, uint64_t value)
+{
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (char) (value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (char) value;
+  return n;
+}
+
+static size_t prelog_binlog_put_bytes (char *out, uint64_t tag, const char *data, size_t len)
+{
+  size_t n = prelog_binlog_put_varint (out, tag);
+  n += prelog_binlog_put_varint (out + n, len);
+  memcpy (out + n, data, len);
+  return n + len;
+}
+
+static size_t prelog_binlog_put_string (PrelogBinlog *b, char *out, const char *data, size_t len)
+{
+  if (len > PRELOG_BINLOG_INTERN_MAX)
+    return prelog_binlog_put_bytes (out, 1, data, len);
+
+  uint64_t hash = prelog_binlog_hash (data, len);
+  long id = prelog_binlog_find (b, data, len, hash);
+  if (id >= 0) {
+    b->strings[id].referenced = 1;
+    return prelog_binlog_put_varint (out, 2 + (uint64_t) id);
+  }
+
+  if (prelog_binlog_add (b, data, len, hash) >= 0)
+    return prelog_binlog_put_bytes (out, 0, data, len);
+
+  return prelog_binlog_put_bytes (out, 1, data, len);
+}
+
+// Puts the kind and length of a record in front of its payload, which was
+// encoded PRELOG_BINLOG_FRAME_MAX bytes into out
+static size_t prelog_binlog_frame (char *out, int kind, size_t payload_len)
+{
+  char frame[PRELOG_BINLOG_FRAME_MAX];
+  size_t n = 0;
+
+  frame[n++] = (char) kind;
+  n += prelog_binlog_put_varint (frame + n, payload_len);
+  memmove (out + n, out + PRELOG_BINLOG_FRAME_MAX, payload_len);
+  memcpy (out, frame, n);
+  return n + payload_len;
+}
+
+static size_t prelog_binlog_put_time (PrelogBinlog *b, char *out, PrelogTime timestamp)
+{
+  int64_t delta = (int64_t) ((uint64_t) timestamp - (uint64_t) b->previous);
+  b->previous = timestamp;
+  return prelog_binlog_put_varint (out, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+}
+
+static int prelog_binlog_is_digit (char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+// Length of the run of digits at text, and whether it can be a number
+static size_t prelog_binlog_digits (const char *text, size_t len, int *number)
+{
+  size_t run = 0;
+  while (run < len && prelog_binlog_is_digit (text[run]))
+    run++;
+  *number = run <= PRELOG_BINLOG_NUMBER_MAX && (run == 1 || text[0] != '0');
+  return run;
+}
+
+static size_t prelog_binlog_put_text (PrelogBinlog *b, char *out, PrelogSpan text)
+{
+  size_t i = 0, len = 0, n;
+  int number;
+
+  while (i < text.len) {
+    if (!prelog_binlog_is_digit (text.data[i])) {
+      b->scratch[len++] = text.data[i++];
+      continue;
+    }
+    size_t run = prelog_binlog_digits (text.data + i, text.len - i, &number);
+    if (number) {
+      b->scratch[len++] = PRELOG_BINLOG_NUMBER;
+    } else {
+      memcpy (b->scratch + len, text.data + i, run);
+      len += run;
+    }
+    i += run;
+  }
+
+  n = prelog_binlog_put_string (b, out, b->scratch, len);
+
+  for (i = 0; i < text.len; ) {
+    if (!prelog_binlog_is_digit (text.data[i])) {
+      i++;
+      continue;
+    }
+    size_t run = prelog_binlog_digits (text.data + i, text.len - i, &number);
+    if (number) {
+      uint64_t value = 0;
+      size_t j;
+      for (j = 0; j < run; ++j)
+        value = value * 10 + (text.data[i + j] - '0');
+      n += prelog_binlog_put_varint (out + n, value);
+    }
+    i += run;
+  }
+
+  return n;
+}
+
+static int prelog_binlog_parse_subject (const char *start, const char *end, PrelogSpan *fields)
+{
+  const char *bar = memchr (start, '|', end - start);
+  if (!bar)
+    return -1;
+  fields[0].data = start;
+  fields[0].len = bar - start;
+
+  start = bar + 1;
+  bar = memchr (start, '|', end - start);
+  if (!bar || memchr (start, PRELOG_BINLOG_NUMBER, bar - start))
+    return -1;
+  fields[1].data = start;
+  fields[1].len = bar - start;
+
+  fields[2].data = bar + 1;
+  fields[2].len = end - (bar + 1);
+  return 0;
+}
+
+// Splits a record the way prelog_event_serialize lays it out, or returns -1
+// if printing the parts back would not give the same bytes
+static int prelog_binlog_parse (const char *body, size_t len, PrelogParsedEvent *e)
+{
+  if (!len || body[len - 1] != '\n')
+    return -1;
+
+  const char *end = body + len - 1;
+  const char *p = body;
+  while (*p != '|' && *p != '\n')
+    p++;
+
+  e->interpretation.data = body;
+  e->interpretation.len = p - body;
+  e->n_subjects = 0;
+
+  if (*p == '|') {
+    e->n_subjects = 1;
+    return prelog_binlog_parse_subject (p + 1, end, e->fields[0]);
+  }
+
+  for (p++; p <= end; ) {
+    const char *line_end = memchr (p, '\n', end + 1 - p);
+    if (*p != ' ' || e->n_subjects == PRELOG_BINLOG_MAX_SUBJECTS ||
+        prelog_binlog_parse_subject (p + 1, line_end, e->fields[e->n_subjects]) < 0)
+      return -1;
+    e->n_subjects++;
+    p = line_end + 1;
+  }
+
+  return e->n_subjects == 1 ? -1 : 0;
+}
+
+// Worst case size of an event record
+static size_t prelog_binlog_event_max (const PrelogParsedEvent *e)
+{
+  size_t max = PRELOG_BINLOG_FRAME_MAX + 3 * PRELOG_BINLOG_VARINT_MAX + e->interpretation.len, i, j;
+
+  for (i = 0; i < e->n_subjects; ++i) {
+    for (j = 0; j < 3; ++j)
+      max += 2 * PRELOG_BINLOG_VARINT_MAX + e->fields[i][j].len;
+    // Each number grows from one digit to a marker and a varint at worst
+    max += (e->fields[i][1].len + 1) / 2 * (PRELOG_BINLOG_VARINT_MAX - 1);
+  }
+
+  return max;
+}
+
+size_t prelog_binlog_encode_header (PrelogBinlog *b, char *out, size_t room,
+                                    pid_t pid, const char *actor, const char *cmdline)
+{
+  size_t actor_len = strlen (actor), cmdline_len = strlen (cmdline);
+  if (room < PRELOG_BINLOG_FRAME_MAX + 5 * PRELOG_BINLOG_VARINT_MAX + actor_len + cmdline_len)
+    return 0;
+
+  size_t n = PRELOG_BINLOG_FRAME_MAX;
+  n += prelog_binlog_put_varint (out + n, (uint64_t) pid);
+  n += prelog_binlog_put_string (b, out + n, actor, actor_len);
+  n += prelog_binlog_put_string (b, out + n, cmdline, cmdline_len);
+  return prelog_binlog_frame (out, PRELOG_BINLOG_HEADER, n - PRELOG_BINLOG_FRAME_MAX);
+}
+
+// Needs room for PRELOG_BINLOG_RAW_MAX (len) bytes at least, and falls back
+// to a raw record when the event might not fit
+size_t prelog_binlog_encode_record (PrelogBinlog *b, char *out, size_t room,
+                                    PrelogTime timestamp, const char *body, size_t len)
+{
+  PrelogParsedEvent e;
+  size_t n = PRELOG_BINLOG_FRAME_MAX, i, j;
+
+  if (room < PRELOG_BINLOG_RAW_MAX (len))
+    return 0;
+
+  if (prelog_binlog_parse (body, len, &e) < 0 || prelog_binlog_event_max (&e) > room) {
+    n += prelog_binlog_put_time (b, out + n, timestamp);
+    n += prelog_binlog_put_bytes (out + n, 1, body, len);
+    return prelog_binlog_frame (out, PRELOG_BINLOG_RAW, n - PRELOG_BINLOG_FRAME_MAX);
+  }
+
+  n += prelog_binlog_put_time (b, out + n, timestamp);
+
+  for (i = 0; prelog_binlog_interpretations[i]; ++i) {
+    if (strlen (prelog_binlog_interpretations[i]) == e.interpretation.len &&
+        !memcmp (prelog_binlog_interpretations[i], e.interpretation.data, e.interpretation.len))
+      break;
+  }
+  if (prelog_binlog_interpretations[i]) {
+    n += prelog_binlog_put_varint (out + n, 1 + i);
+  } else {
+    n += prelog_binlog_put_varint (out + n, 0);
+    n += prelog_binlog_put_string (b, out + n, e.interpretation.data, e.interpretation.len);
+  }
+
+  n += prelog_binlog_put_varint (out + n, e.n_subjects);
+  for (i = 0; i < e.n_subjects; ++i) {
+    for (j = 0; j < 3; ++j) {
+      if (j == 1)
+        n += prelog_binlog_put_text (b, out + n, e.fields[i][j]);
+      else
+        n += prelog_binlog_put_string (b, out + n, e.fields[i][j].data, e.fields[i][j].len);
+    }
+  }
+
+  return prelog_binlog_frame (out, PRELOG_BINLOG_EVENT, n - PRELOG_BINLOG_FRAME_MAX);
+}
+
+/* Decoding. Only whole records get decoded, so readers running out of input
+ * means the record is malformed. */
+
+typedef struct _PrelogReader {
+  const unsigned char *p;
+  const unsigned char *end;
+  int                  corrupt;
+} PrelogReader;
+
+typedef struct _PrelogTextOut {
+  char              *data;
+  size_t             size;
+  size_t             len;
+} PrelogTextOut;
+
+static int prelog_binlog_get_varint (PrelogReader *r, uint64_t *value)
+{
+  int shift;
+  *value = 0;
+  for (shift = 0; shift < 64; shift += 7) {
+    if (r->p == r->end)
+      return 0;
+    unsigned char c = *r->p++;
+    *value |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return 1;
+  }
+  r->corrupt = 1;
+  return 0;
+}
+
+static int prelog_binlog_get_string (PrelogBinlog *b, PrelogReader *r, PrelogSpan *s)
+{
+  uint64_t tag, len;
+
+  if (!prelog_binlog_get_varint (r, &tag))
+    return 0;
+
+  if (tag >= 2) {
+    if (tag - 2 >= b->count || !b->strings[tag - 2].data) {
+      r->corrupt = 1;
+      return 0;
+    }
+    b->strings[tag - 2].referenced = 1;
+    s->data = b->strings[tag - 2].data;
+    s->len = b->strings[tag - 2].len;
+    return 1;
+  }
+
+  if (!prelog_binlog_get_varint (r, &len))
+    return 0;
+  if (len > (uint64_t) (r->end - r->p) || (tag == 0 && len > PRELOG_BINLOG_INTERN_MAX)) {
+    r->corrupt = 1;
+    return 0;
+  }
+
+  s->data = (const char *) r->p;
+  s->len = len;
+  r->p += len;
+
+  if (tag == 0) {
+    long id = prelog_binlog_add (b, s->data, len, prelog_binlog_hash (s->data, len));
+    if (id < 0) {
+      r->corrupt = 1;
+      return 0;
+    }
+    s->data = b->strings[id].data;
+  }
+  return 1;
+}
+
+static void prelog_text_putn (PrelogTextOut *w, const char *data, size_t len)
+{
+  if (w->len + len <= w->size)
+    memcpy (w->data + w->len, data, len);
+  w->len += len;
+}
+
+static void prelog_text_putc (PrelogTextOut *w, char c)
+{
+  prelog_text_putn (w, &c, 1);
+}
+
+static void prelog_text_putu (PrelogTextOut *w, uint64_t value)
+{
+  char digits[24];
+  int i = sizeof (digits);
+  do {
+    digits[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  prelog_text_putn (w, digits + i, sizeof (digits) - i);
+}
+
+static int prelog_binlog_get_time (PrelogBinlog *b, PrelogReader *r, PrelogTextOut *w)
+{
+  uint64_t zigzag;
+  char stamp[PRELOG_STAMP_MAX];
+
+  if (!prelog_binlog_get_varint (r, &zigzag))
+    return 0;
+
+  PrelogTime previous = b->previous;
+  int64_t delta = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+  b->previous = (PrelogTime) ((uint64_t) b->previous + (uint64_t) delta);
+
+  prelog_text_putn (w, stamp, prelog_timestamp_serialize (stamp, sizeof (stamp), b->previous,
+                                                          b->has_previous ? &previous : NULL));
+  prelog_text_putc (w, '|');
+  b->has_previous = 1;
+  return 1;
+}
+
+static int prelog_binlog_get_text (PrelogBinlog *b, PrelogReader *r, PrelogTextOut *w)
+{
+  PrelogSpan template;
+  size_t i;
+
+  if (!prelog_binlog_get_string (b, r, &template))
+    return 0;
+
+  // Numbers are no strings, so the template stays where it is
+  for (i = 0; i < template.len; ++i) {
+    if (template.data[i] == PRELOG_BINLOG_NUMBER) {
+      uint64_t value;
+      if (!prelog_binlog_get_varint (r, &value))
+        return 0;
+      prelog_text_putu (w, value);
+    } else {
+      prelog_text_putc (w, template.data[i]);
+    }
+  }
+  return 1;
+}
+
+static int prelog_binlog_get_event (PrelogBinlog *b, PrelogReader *r, PrelogTextOut *w)
+{
+  uint64_t interpretation, n_subjects, i;
+  PrelogSpan s;
+
+  if (!prelog_binlog_get_time (b, r, w) || !prelog_binlog_get_varint (r, &interpretation))
+    return 0;
+
+  if (interpretation == 0) {
+    if (!prelog_binlog_get_string (b, r, &s))
+      return 0;
+    prelog_text_putn (w, s.data, s.len);
+  } else {
+    size_t count = 0;
+    while (prelog_binlog_interpretations[count])
+      count++;
+    if (interpretation > count) {
+      r->corrupt = 1;
+      return 0;
+    }
+    prelog_text_putn (w, prelog_binlog_interpretations[interpretation - 1],
+                        strlen (prelog_binlog_interpretations[interpretation - 1]));
+  }
+
+  if (!prelog_binlog_get_varint (r, &n_subjects))
+    return 0;
+  prelog_text_putc (w, n_subjects == 1 ? '|' : '\n');
+
+  for (i = 0; i < n_subjects; ++i) {
+    if (n_subjects != 1)
+      prelog_text_putc (w, ' ');
+    if (!prelog_binlog_get_string (b, r, &s))
+      return 0;
+    prelog_text_putn (w, s.data, s.len);
+    prelog_text_putc (w, '|');
+    if (!prelog_binlog_get_text (b, r, w))
+      return 0;
+    prelog_text_putc (w, '|');
+    if (!prelog_binlog_get_string (b, r, &s))
+      return 0;
+    prelog_text_putn (w, s.data, s.len);
+    prelog_text_putc (w, '\n');
+
+    // Corrupt counts would otherwise spin for a long time
+    if (w->len > w->size)
+      return 0;
+  }
+
+  return 1;
+}
+
+static int prelog_binlog_get_header (PrelogBinlog *b, PrelogReader *r, PrelogTextOut *w)
+{
+  uint64_t pid;
+  PrelogSpan actor, cmdline;
+
+  // Spans into the table only last until the next string is read
+  if (!prelog_binlog_get_varint (r, &pid) || !prelog_binlog_get_string (b, r, &actor))
+    return 0;
+  prelog_text_putc (w, '@');
+  prelog_text_putn (w, actor.data, actor.len);
+  prelog_text_putc (w, '|');
+  prelog_text_putu (w, pid);
+  prelog_text_putc (w, '|');
+
+  if (!prelog_binlog_get_string (b, r, &cmdline))
+    return 0;
+  prelog_text_putn (w, cmdline.data, cmdline.len);
+  prelog_text_putc (w, '\n');
+
+  b->has_previous = 0;
+  return 1;
+}
+
+/* Writes the text form of the record at data to out, and returns how many
+ * bytes of data it took, 0 if data ends before the record does, or -1 if the
+ * record is corrupt or its text does not fit in size bytes. Decoding the
+ * same bytes twice is not possible, as the dictionary moves forward. */
+ssize_t prelog_binlog_decode_record (PrelogBinlog *b, const char *data, size_t len,
+                                     char *out, size_t size, size_t *out_len)
+{
+  PrelogReader r = { (const unsigned char *) data, (const unsigned char *) data + len, 0 };
+  PrelogTextOut w = { out, size, 0 };
+  uint64_t payload_len;
+  int done = 0;
+
+  if (!len)
+    return 0;
+
+  int kind = *r.p++;
+  if (!prelog_binlog_get_varint (&r, &payload_len))
+    return r.corrupt ? -1 : 0;
+  if (payload_len > (uint64_t) (r.end - r.p))
+    return 0;
+  r.end = r.p + payload_len;
+
+  switch (kind) {
+    case PRELOG_BINLOG_HEADER:
+      done = prelog_binlog_get_header (b, &r, &w);
+      break;
+    case PRELOG_BINLOG_EVENT:
+      done = prelog_binlog_get_event (b, &r, &w);
+      break;
+    case PRELOG_BINLOG_RAW: {
+      PrelogSpan body;
+      done = prelog_binlog_get_time (b, &r, &w) && prelog_binlog_get_string (b, &r, &body);
+      if (done)
+        prelog_text_putn (&w, body.data, body.len);
+      break;
+    }
+  }
+
+  if (!done || r.p != r.end || w.len > size)
+    return -1;
+
+  *out_len = w.len;
+  return (const char *) r.end - data;
+}
@@ -0,0 +1,99 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef	_BINLOG_H
+#define	_BINLOG_H	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "logger.h"
+
+/* Opt-in binary log format, chosen with PRELOG_FORMAT=binary for the files
+ * processes write themselves. It carries exactly the same information as the
+ * text format, and preload-logger-convert turns it back into text.
+ *
+ * Layout, after the gzip layer:
+ *
+ *   file     := "PRLB" version:u8 record*           (version is 2)
+ *   record   := kind:u8 len:varint payload           (len bytes of payload)
+ *   header   := kind 0x01, pid:varint actor:string cmdline:string
+ *   event    := kind 0x02, time interp subjects:varint subject*
+ *   raw      := kind 0x03, time body:string
+ *   subject  := uri:string text origin:string
+ *   text     := template:string number:varint*
+ *   time     := zigzag varint of the nanoseconds since the previous record's
+ *               time, or since the epoch for the first record of the file
+ *   interp   := varint: 0 followed by a string, or 1 + the index of the
+ *               interpretation in prelog_binlog_interpretations[]
+ *   string   := varint: 0 followed by len:varint and len bytes, which define
+ *               a string of the dictionary, 1 followed by len:varint and len
+ *               bytes, which do not, or 2 + the id of a dictionary string
+ *
+ * varints are unsigned LEB128. Templates are texts with every run of decimal
+ * digits that reads back the same as a number (no leading zero, at most 18
+ * digits) replaced by PRELOG_BINLOG_NUMBER, and that many numbers follow.
+ * Records that do not parse as a serialized event, such as truncated ones,
+ * are kept whole as raw records. Header records reset the time base the
+ * converter uses, like a header line does in text logs.
+ *
+ * The dictionary holds recent paths and other strings of at most
+ * PRELOG_BINLOG_INTERN_MAX bytes, so that each is written out once for as
+ * long as it stays in use. Writer and reader update it the same way:
+ *
+ *  - a string that gets defined takes the id freed last, or else the next
+ *    unused id, or else, with PRELOG_BINLOG_MAX_STRINGS ids in use, the id
+ *    of the string evicted for it;
+ *  - then strings get evicted, and their ids freed, until the dictionary
+ *    holds at most PRELOG_BINLOG_BYTES_MAX bytes again;
+ *  - evictions follow a clock: the hand moves along the ids, skips free ones,
+ *    unmarks marked strings and evicts the first unmarked one. Strings get
+ *    marked each time a record refers to them by id. */
+
+#define PRELOG_BINLOG_MAGIC     "PRLB\002"
+#define PRELOG_BINLOG_MAGIC_LEN 5
+#define PRELOG_BINLOG_NUMBER    '\001'
+#define PRELOG_FORMAT_ENV       "PRELOG_FORMAT" /* set to "binary" for binary logs */
+
+#define PRELOG_BINLOG_HEADER    1
+#define PRELOG_BINLOG_EVENT     2
+#define PRELOG_BINLOG_RAW       3
+
+#define PRELOG_BINLOG_MAX_STRINGS 16384
+#define PRELOG_BINLOG_BYTES_MAX   (4 * 1024 * 1024)
+#define PRELOG_BINLOG_INTERN_MAX  4096
+
+#define PRELOG_BINLOG_RAW_MAX(len) ((len) + 32) /* encoded size of a raw record */
+
+typedef struct _PrelogBinlog PrelogBinlog;
+
+extern const char *const prelog_binlog_interpretations[];
+
+PrelogBinlog *prelog_binlog_new (void);
+void prelog_binlog_free (PrelogBinlog *b);
+
+size_t prelog_binlog_encode_header (PrelogBinlog *b, char *out, size_t room,
+                                    pid_t pid, const char *actor, const char *cmdline);
+size_t prelog_binlog_encode_record (PrelogBinlog *b, char *out, size_t room,
+                                    PrelogTime timestamp, const char *body, size_t len);
+
+ssize_t prelog_binlog_decode_record (PrelogBinlog *b, const char *data, size_t len,
+                                     char *out, size_t size, size_t *out_len);
+
+#endif /* BINLOG.h  */
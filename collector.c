@@ -0,0 +1,463 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* preload-logger-collector [-r seconds]
+ *
+ * Collects the logs of all the processes of a session that find its socket
+ * (see collector.h), and writes them to a single gzip file in the usual log
+ * directory, replaced by a new one every few seconds given by -r. Each
+ * process' header line is repeated whenever its records follow another
+ * process', so the file reads like many process logs concatenated.
+ *
+ * Records come from the shared ring, and from client sockets when the ring
+ * is full. Each pass reads the sockets first, so that the header of a process
+ * is known before its records come out of the ring, then drains the ring, and
+ * only then forgets about the clients that hung up. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "collector.h"
+#include "logger.h"
+#include "shmring.h"
+
+#define COLLECTOR_FLUSH_SECONDS 5 /* how soon written records become readable */
+
+typedef struct _CollectorClient {
+  unsigned long      id;
+  pid_t              pid;
+  int                closing;
+  char              *header;
+  size_t             header_len;
+} CollectorClient;
+
+static volatile sig_atomic_t stopping = 0;
+
+static struct pollfd   *fds = NULL;     /* fds[0] is the listening socket */
+static CollectorClient *clients = NULL; /* clients[i] goes with fds[i] */
+static size_t           n_fds = 0;
+static size_t           capacity = 0;
+static unsigned long    next_id = 1;
+static size_t           last_found = 0;  /* where the last ring record's client was */
+
+static PrelogShmRing   *ring = NULL;
+static char            *message = NULL; /* socket messages are read here */
+static char            *record = NULL;  /* and ring records there */
+
+static gzFile           out = NULL;
+static unsigned long    last_writer = 0; /* client whose header applies */
+static PrelogTime       previous = 0;    /* last timestamp written for it */
+static int              has_previous = 0;
+static time_t           flush_at = 0;    /* when to make written data readable, if set */
+
+static void collector_stop (int signum)
+{
+  stopping = 1;
+}
+
+static int collector_mkdir (const char *dir)
+{
+  char tmp[PATH_MAX], *p;
+
+  if (snprintf (tmp, sizeof (tmp), "%s", dir) >= (int) sizeof (tmp))
+    return -1;
+
+  for (p = tmp + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir (tmp, 0700);
+      *p = '/';
+    }
+  }
+
+  return (mkdir (tmp, 0700) < 0 && errno != EEXIST) ? -1 : 0;
+}
+
+static int collector_open_output (void)
+{
+  const char *home = getenv ("HOME");
+  char dir[PATH_MAX], path[PATH_MAX + 64], date[100];
+
+  if (!home || snprintf (dir, sizeof (dir), "%s/%s", home, PRELOG_TARGET_DIR) >= (int) sizeof (dir)) {
+    fprintf (stderr, "preload-logger-collector: HOME is not usable\n");
+    return -1;
+  }
+  if (collector_mkdir (dir) < 0) {
+    fprintf (stderr, "preload-logger-collector: cannot create %s: %s\n", dir, strerror (errno));
+    return -1;
+  }
+
+  time_t t = time (NULL);
+  struct tm ttm;
+  localtime_r (&t, &ttm);
+  if (!strftime (date, sizeof (date), "%Y-%m-%d_%H%M%S", &ttm))
+    date[0] = '\0';
+
+  snprintf (path, sizeof (path), "%s/%s_%d.log.gz", dir, date, getpid ());
+  out = prelog_gzopen (path, "a");
+  if (!out) {
+    fprintf (stderr, "preload-logger-collector: cannot open %s\n", path);
+    return -1;
+  }
+
+  // Every process introduces itself again in the new file
+  last_writer = 0;
+  has_previous = 0;
+  flush_at = 0;
+  return 0;
+}
+
+static int collector_listen (const char *path)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", path) >= (int) sizeof (addr.sun_path))
+    return -1;
+
+  int fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 && errno == EADDRINUSE) {
+    // Only take over the socket of a collector that is gone
+    int probe = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    int alive = probe >= 0 && connect (probe, (struct sockaddr *) &addr, sizeof (addr)) == 0;
+    if (probe >= 0)
+      close (probe);
+    if (alive) {
+      fprintf (stderr, "preload-logger-collector: another collector listens on %s\n", path);
+      close (fd);
+      return -1;
+    }
+
+    unlink (path);
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+      close (fd);
+      return -1;
+    }
+  }
+
+  if (listen (fd, SOMAXCONN) < 0) {
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// A fresh file every time: clients of a previous collector may still map the
+// old one, and shrinking it under them would crash them
+static PrelogShmRing *collector_open_ring (const char *path)
+{
+  unlink (path);
+  int fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return NULL;
+
+  PrelogShmRing *r = prelog_shm_ring_create (fd, PRELOG_SHM_RING_SIZE);
+  close (fd);
+  if (!r)
+    unlink (path);
+  return r;
+}
+
+static int collector_add (int fd, pid_t pid)
+{
+  if (n_fds == capacity) {
+    size_t grown = capacity ? capacity * 2 : 64;
+    struct pollfd *f = realloc (fds, grown * sizeof (struct pollfd));
+    if (!f)
+      return -1;
+    fds = f;
+    CollectorClient *c = realloc (clients, grown * sizeof (CollectorClient));
+    if (!c)
+      return -1;
+    clients = c;
+    capacity = grown;
+  }
+
+  fds[n_fds].fd = fd;
+  fds[n_fds].events = POLLIN;
+  fds[n_fds].revents = 0;
+  clients[n_fds].id = next_id++;
+  clients[n_fds].pid = pid;
+  clients[n_fds].closing = 0;
+  clients[n_fds].header = NULL;
+  clients[n_fds].header_len = 0;
+  n_fds++;
+  return 0;
+}
+
+static void collector_remove (size_t i)
+{
+  close (fds[i].fd);
+  free (clients[i].header);
+
+  n_fds--;
+  fds[i] = fds[n_fds];
+  clients[i] = clients[n_fds];
+}
+
+static void collector_switch_to (CollectorClient *client)
+{
+  if (client->id != last_writer) {
+    if (client->header)
+      gzwrite (out, client->header, client->header_len);
+    last_writer = client->id;
+    has_previous = 0;
+  }
+
+  if (!flush_at)
+    flush_at = time (NULL) + COLLECTOR_FLUSH_SECONDS;
+}
+
+// Messages start with an absolute timestamp and end with one we do not know
+static void collector_write (CollectorClient *client, const char *data, size_t len)
+{
+  collector_switch_to (client);
+  gzwrite (out, data, len);
+  has_previous = 0;
+}
+
+static void collector_read (CollectorClient *client, int fd)
+{
+  for (;;) {
+    ssize_t len = recv (fd, message, PRELOG_MESSAGE_MAX, MSG_DONTWAIT);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+    if (len <= 0) {
+      client->closing = 1;
+      return;
+    }
+
+    if (!client->header && message[0] == '@') {
+      client->header = malloc (len);
+      if (client->header) {
+        memcpy (client->header, message, len);
+        client->header_len = len;
+      }
+      continue;
+    }
+
+    collector_write (client, message, len);
+  }
+}
+
+// Also reads what new clients sent already, their header in particular
+static void collector_accept (void)
+{
+  int fd;
+  while ((fd = accept4 (fds[0].fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+    // Ring records only carry the pid of their process
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+    if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || collector_add (fd, cred.pid) < 0)
+      close (fd);
+    else
+      collector_read (&clients[n_fds - 1], fd);
+  }
+}
+
+static CollectorClient *collector_find (pid_t pid)
+{
+  size_t i;
+
+  if (last_found < n_fds && clients[last_found].pid == pid)
+    return &clients[last_found];
+
+  for (i = 1; i < n_fds; ++i) {
+    if (clients[i].pid == pid) {
+      last_found = i;
+      return &clients[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void collector_write_record (uint32_t pid, PrelogTime timestamp,
+                                    const char *record, size_t len, void *data)
+{
+  CollectorClient *client = collector_find (pid);
+  char stamp[PRELOG_STAMP_MAX];
+
+  // The process may have connected since we last looked
+  if (!client) {
+    collector_accept ();
+    client = collector_find (pid);
+  }
+
+  if (client) {
+    collector_switch_to (client);
+  } else {
+    // Its connection is gone already, say whose record it is all the same
+    int written = snprintf (stamp, sizeof (stamp), "@?|%u|\n", pid);
+    gzwrite (out, stamp, written);
+    last_writer = 0;
+    has_previous = 0;
+  }
+
+  size_t stamp_len = prelog_timestamp_serialize (stamp, sizeof (stamp) - 1, timestamp, has_previous ? &previous : NULL);
+  stamp[stamp_len++] = '|';
+  gzwrite (out, stamp, stamp_len);
+  gzwrite (out, record, len);
+
+  previous = timestamp;
+  has_previous = 1;
+}
+
+int main(int argc, char **argv)
+{
+  int rotate = PRELOG_COLLECTOR_ROTATE, opt;
+  char path[sizeof (((struct sockaddr_un *) NULL)->sun_path)];
+  char ring_path[PATH_MAX];
+
+  // Logging our own calls would send them to ourselves
+  if (getenv ("LD_PRELOAD")) {
+    unsetenv ("LD_PRELOAD");
+    execv ("/proc/self/exe", argv);
+    fprintf (stderr, "preload-logger-collector: cannot run without LD_PRELOAD: %s\n", strerror (errno));
+    return 1;
+  }
+
+  while ((opt = getopt (argc, argv, "r:")) != -1) {
+    if (opt == 'r' && atoi (optarg) > 0) {
+      rotate = atoi (optarg);
+    } else {
+      fprintf (stderr, "usage: %s [-r rotation-seconds]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (prelog_collector_socket_path (path, sizeof (path)) < 0) {
+    fprintf (stderr, "preload-logger-collector: set XDG_RUNTIME_DIR or %s\n", PRELOG_COLLECTOR_SOCKET_ENV);
+    return 1;
+  }
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = collector_stop;
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGINT, &sa, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  message = malloc (PRELOG_MESSAGE_MAX);
+  record = malloc (PRELOG_RECORD_MAX);
+  umask (077);
+  int listen_fd = collector_listen (path);
+  if (!message || !record || listen_fd < 0 || collector_add (listen_fd, 0) < 0) {
+    fprintf (stderr, "preload-logger-collector: cannot listen on %s\n", path);
+    return 1;
+  }
+  if (collector_open_output () < 0) {
+    unlink (path);
+    return 1;
+  }
+
+  // Without a ring, clients send everything over their sockets
+  if (prelog_collector_ring_path (ring_path, sizeof (ring_path)) == 0)
+    ring = collector_open_ring (ring_path);
+  if (!ring)
+    fprintf (stderr, "preload-logger-collector: no shared ring, using sockets only\n");
+
+  time_t rotation = time (NULL) + rotate;
+
+  while (!stopping) {
+    time_t now = time (NULL);
+    if (now >= rotation) {
+      prelog_gzclose_w (out);
+      if (collector_open_output () < 0)
+        break;
+      rotation = now + rotate;
+    }
+    if (flush_at && now >= flush_at) {
+      gzflush (out, Z_SYNC_FLUSH);
+      flush_at = 0;
+    }
+
+    int timeout = (rotation - now) * 1000;
+    if (timeout > COLLECTOR_FLUSH_SECONDS * 1000)
+      timeout = COLLECTOR_FLUSH_SECONDS * 1000;
+
+    // With a ring, the futex is where we wait
+    int ready = poll (fds, n_fds, ring ? 0 : timeout);
+    if (ready < 0 && errno != EINTR)
+      break;
+
+    if (ready > 0) {
+      if (fds[0].revents & POLLIN)
+        collector_accept ();
+
+      size_t i;
+      for (i = 1; i < n_fds; ++i) {
+        if (fds[i].revents)
+          collector_read (&clients[i], fds[i].fd);
+      }
+    }
+
+    size_t records = ring ? prelog_shm_ring_consume (ring, record, collector_write_record, NULL) : 0;
+
+    // Backwards, as removing a client moves the last one into its slot
+    size_t i;
+    for (i = n_fds - 1; i > 0; --i) {
+      if (clients[i].closing)
+        collector_remove (i);
+    }
+
+    if (ring && ready <= 0 && !records)
+      prelog_shm_ring_wait (ring, timeout < PRELOG_SHM_RING_WAIT_MS ? timeout : PRELOG_SHM_RING_WAIT_MS);
+  }
+
+  // Clients fall back to their own files once the socket is gone
+  unlink (path);
+  if (ring) {
+    prelog_shm_ring_consume (ring, record, collector_write_record, NULL);
+    if (prelog_shm_ring_overflows (ring))
+      fprintf (stderr, "preload-logger-collector: %llu records did not fit in the ring\n",
+               (unsigned long long) prelog_shm_ring_overflows (ring));
+    if (prelog_shm_ring_lost (ring))
+      fprintf (stderr, "preload-logger-collector: %llu records were reserved but never written\n",
+               (unsigned long long) prelog_shm_ring_lost (ring));
+    prelog_shm_ring_close (ring);
+    unlink (ring_path);
+  }
+  while (n_fds > 1)
+    collector_remove (n_fds - 1);
+  close (listen_fd);
+  if (out)
+    prelog_gzclose_w (out);
+  free (message);
+  free (record);
+  free (fds);
+  free (clients);
+
+  return 0;
+}
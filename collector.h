@@ -0,0 +1,70 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef	_COLLECTOR_H
+#define	_COLLECTOR_H	1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Processes send their log to a per-session collector when one listens on
+ * the collector socket, and write their own log file otherwise. Every message
+ * on the SOCK_SEQPACKET connection is self-contained: the first one is the
+ * process' header line, the next ones are batches of records that start with
+ * an absolute timestamp. The collector appends them all to one gzip file,
+ * which it replaces every PRELOG_COLLECTOR_ROTATE seconds.
+ *
+ * Records normally skip the socket: the collector shares a PrelogShmRing
+ * through the file named after the socket plus PRELOG_COLLECTOR_RING_SUFFIX,
+ * and processes only send records over the socket when the ring is full. */
+
+#define PRELOG_COLLECTOR_SOCKET_ENV  "PRELOG_COLLECTOR_SOCKET" /* overrides the socket path */
+#define PRELOG_COLLECTOR_SOCKET_NAME "preload-logger.sock"     /* in $XDG_RUNTIME_DIR */
+#define PRELOG_COLLECTOR_RING_SUFFIX ".ring"                   /* next to the socket */
+#define PRELOG_COLLECTOR_ROTATE      3600                      /* seconds per output file */
+#define PRELOG_COLLECTOR_SEND_TIMEOUT_MS 1000                  /* before giving up on a stuck collector */
+
+// Writes the collector socket path to buf, returns -1 if there is none
+static inline int prelog_collector_socket_path (char *buf, size_t len)
+{
+  const char *path = getenv (PRELOG_COLLECTOR_SOCKET_ENV);
+  int written;
+
+  if (path && path[0])
+    written = snprintf (buf, len, "%s", path);
+  else if ((path = getenv ("XDG_RUNTIME_DIR")) && path[0])
+    written = snprintf (buf, len, "%s/%s", path, PRELOG_COLLECTOR_SOCKET_NAME);
+  else
+    return -1;
+
+  return (written < 0 || (size_t) written >= len) ? -1 : 0;
+}
+
+static inline int prelog_collector_ring_path (char *buf, size_t len)
+{
+  if (prelog_collector_socket_path (buf, len) < 0 ||
+      strlen (buf) + strlen (PRELOG_COLLECTOR_RING_SUFFIX) >= len)
+    return -1;
+
+  strcat (buf, PRELOG_COLLECTOR_RING_SUFFIX);
+  return 0;
+}
+
+#endif /* COLLECTOR.h  */
@@ -0,0 +1,257 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* preload-logger-convert [file...]
+ * preload-logger-convert --stats [file]
+ *
+ * Prints logs as text, reading binary logs (see binlog.h) through the same
+ * serializer the text logs come from, and copying text logs as they are.
+ * Files may be compressed or not, and standard input is read when no file is
+ * given. A binary log cut short, as a crashed process leaves it, converts up
+ * to its last whole record. Journals (see journal.h) are read from files
+ * only, as they get mapped in memory.
+ *
+ * With --stats, prints the process counters of PRELOG_STATS_FILE instead,
+ * from the user's log directory unless a file is given. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "binlog.h"
+#include "journal.h"
+
+#define CONVERT_BUFFER_SIZE (1024 * 1024)
+
+static char input[CONVERT_BUFFER_SIZE];
+static char text[2 * PRELOG_MESSAGE_MAX];
+
+static int convert_binary (gzFile in, const char *name, size_t len)
+{
+  PrelogBinlog *b = prelog_binlog_new ();
+  size_t start = 0;
+  int eof = 0, status = 0;
+
+  if (!b) {
+    fprintf (stderr, "preload-logger-convert: out of memory\n");
+    return 1;
+  }
+
+  for (;;) {
+    size_t text_len, left = len - start;
+    ssize_t used;
+
+    // Older logs hold an image exec'd within the same second as the one
+    // before it, dictionary and all, in the same file. No record kind is 'P'.
+    if (left && !memcmp (input + start, PRELOG_BINLOG_MAGIC, left < PRELOG_BINLOG_MAGIC_LEN ? left : PRELOG_BINLOG_MAGIC_LEN)) {
+      if (left >= PRELOG_BINLOG_MAGIC_LEN) {
+        prelog_binlog_free (b);
+        b = prelog_binlog_new ();
+        if (!b) {
+          fprintf (stderr, "preload-logger-convert: out of memory\n");
+          return 1;
+        }
+        start += PRELOG_BINLOG_MAGIC_LEN;
+        continue;
+      }
+      used = 0;
+    } else {
+      used = prelog_binlog_decode_record (b, input + start, left, text, sizeof (text), &text_len);
+    }
+
+    if (used > 0) {
+      fwrite (text, 1, text_len, stdout);
+      start += used;
+      continue;
+    }
+    if (used < 0) {
+      fprintf (stderr, "preload-logger-convert: %s: corrupt record\n", name);
+      status = 1;
+      break;
+    }
+
+    // Not a whole record left, read on
+    if (eof) {
+      if (start != len)
+        fprintf (stderr, "preload-logger-convert: %s: truncated record at the end\n", name);
+      break;
+    }
+    if (start == 0 && len == sizeof (input)) {
+      fprintf (stderr, "preload-logger-convert: %s: record too large\n", name);
+      status = 1;
+      break;
+    }
+
+    memmove (input, input + start, len - start);
+    len -= start;
+    start = 0;
+
+    int n = gzread (in, input + len, sizeof (input) - len);
+    if (n < 0) {
+      fprintf (stderr, "preload-logger-convert: %s: read error\n", name);
+      status = 1;
+      break;
+    }
+    eof = n == 0;
+    len += n;
+  }
+
+  prelog_binlog_free (b);
+  return status;
+}
+
+typedef struct _ConvertJournal {
+  PrelogTime         previous;
+  int                has_previous;
+} ConvertJournal;
+
+static void convert_journal_record (int kind, PrelogTime timestamp, const char *record, size_t len, void *data)
+{
+  ConvertJournal *state = data;
+
+  if (kind == PRELOG_JOURNAL_HEADER) {
+    fwrite (record, 1, len, stdout);
+    state->has_previous = 0;
+    return;
+  }
+
+  size_t n = prelog_timestamp_serialize (text, PRELOG_STAMP_MAX - 1, timestamp,
+                                         state->has_previous ? &state->previous : NULL);
+  text[n++] = '|';
+  fwrite (text, 1, n, stdout);
+  fwrite (record, 1, len, stdout);
+
+  state->previous = timestamp;
+  state->has_previous = 1;
+}
+
+static int convert_journal (const char *name)
+{
+  ConvertJournal state = { 0, 0 };
+  struct stat st;
+  int fd = open (name, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || fstat (fd, &st) < 0) {
+    fprintf (stderr, "preload-logger-convert: cannot open %s\n", name);
+    if (fd >= 0)
+      close (fd);
+    return 1;
+  }
+
+  void *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED || prelog_journal_read (data, st.st_size, convert_journal_record, &state) < 0) {
+    fprintf (stderr, "preload-logger-convert: %s: corrupt journal\n", name);
+    if (data != MAP_FAILED)
+      munmap (data, st.st_size);
+    return 1;
+  }
+
+  munmap (data, st.st_size);
+  return 0;
+}
+
+// path is NULL for standard input
+static int convert (gzFile in, const char *name, const char *path)
+{
+  int n, len = 0;
+
+  // Enough to tell binary logs from text ones
+  while (len < PRELOG_BINLOG_MAGIC_LEN && (n = gzread (in, input + len, sizeof (input) - len)) > 0)
+    len += n;
+
+  if (len >= PRELOG_JOURNAL_MAGIC_LEN && !memcmp (input, PRELOG_JOURNAL_MAGIC, PRELOG_JOURNAL_MAGIC_LEN)) {
+    if (!path) {
+      fprintf (stderr, "preload-logger-convert: journals cannot be read from standard input\n");
+      return 1;
+    }
+    return convert_journal (path);
+  }
+
+  if (len >= PRELOG_BINLOG_MAGIC_LEN && !memcmp (input, PRELOG_BINLOG_MAGIC, PRELOG_BINLOG_MAGIC_LEN)) {
+    memmove (input, input + PRELOG_BINLOG_MAGIC_LEN, len - PRELOG_BINLOG_MAGIC_LEN);
+    return convert_binary (in, name, len - PRELOG_BINLOG_MAGIC_LEN);
+  }
+
+  do {
+    fwrite (input, 1, len, stdout);
+  } while ((len = gzread (in, input, sizeof (input))) > 0);
+
+  return len < 0;
+}
+
+static int print_stats (const char *path)
+{
+  char buffer[PATH_MAX];
+  PrelogStats stats;
+
+  if (!path) {
+    const char *home = getenv ("HOME");
+    if (!home || snprintf (buffer, sizeof (buffer), "%s/%s/%s", home, PRELOG_TARGET_DIR, PRELOG_STATS_FILE) >= (int) sizeof (buffer)) {
+      fprintf (stderr, "preload-logger-convert: cannot find the stats file\n");
+      return 1;
+    }
+    path = buffer;
+  }
+
+  FILE *in = fopen (path, "r");
+  if (!in || fread (&stats, sizeof (stats), 1, in) != 1) {
+    fprintf (stderr, "preload-logger-convert: cannot read %s\n", path);
+    if (in)
+      fclose (in);
+    return 1;
+  }
+  fclose (in);
+
+  printf ("processes\t%llu\nlogging\t%llu\nwithout a log\t%llu\n",
+          (unsigned long long) stats.processes, (unsigned long long) stats.logging,
+          (unsigned long long) (stats.processes - stats.logging));
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int i, status = 0;
+
+  if (argc > 1 && !strcmp (argv[1], "--stats"))
+    return print_stats (argc > 2 ? argv[2] : NULL);
+
+  if (argc < 2) {
+    gzFile in = gzdopen (STDIN_FILENO, "r");
+    return in ? convert (in, "stdin", NULL) : 1;
+  }
+
+  for (i = 1; i < argc; ++i) {
+    gzFile in = prelog_gzopen (argv[i], "r");
+    if (!in) {
+      fprintf (stderr, "preload-logger-convert: cannot open %s\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    status |= convert (in, argv[i], argv[i]);
+    gzclose (in);
+  }
+
+  return status;
+}
@@ -0,0 +1,166 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cwd.h"
+
+static pthread_mutex_t _prelog_cwd_lock = PTHREAD_MUTEX_INITIALIZER;
+static char            _prelog_cwd[PATH_MAX];
+static size_t          _prelog_cwd_len = 0;   /* 0 while the cwd is unknown */
+static dev_t           _prelog_cwd_dev;
+static ino_t           _prelog_cwd_ino;
+static uint64_t        _prelog_cwd_checked;  /* when the inode was last compared */
+
+static uint64_t prelog_cwd_now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Call with _prelog_cwd_lock held
+static void prelog_cwd_set (const char *path, size_t len, const struct stat *dot, uint64_t now)
+{
+  memmove (_prelog_cwd, path, len);
+  _prelog_cwd[len] = '\0';
+  _prelog_cwd_len = len;
+  _prelog_cwd_dev = dot->st_dev;
+  _prelog_cwd_ino = dot->st_ino;
+  _prelog_cwd_checked = now;
+}
+
+// Call with _prelog_cwd_lock held. Like get_current_dir_name, $PWD is
+// preferred when it is the cwd.
+static void prelog_cwd_compute (uint64_t now)
+{
+  const char *pwd = getenv ("PWD");
+  char buf[PATH_MAX];
+  struct stat dot, pwd_st;
+
+  _prelog_cwd_len = 0;
+  if (stat (".", &dot))
+    return;
+
+  if (pwd && pwd[0] == '/' && strlen (pwd) < sizeof (buf)
+      && stat (pwd, &pwd_st) == 0
+      && pwd_st.st_dev == dot.st_dev && pwd_st.st_ino == dot.st_ino)
+    prelog_cwd_set (pwd, strlen (pwd), &dot, now);
+  else if (getcwd (buf, sizeof (buf)))
+    prelog_cwd_set (buf, strlen (buf), &dot, now);
+}
+
+// Whether path has no "." or ".." component, so it can be joined as is
+static int prelog_cwd_is_plain (const char *path)
+{
+  const char *p = path;
+
+  while (*p) {
+    while (*p == '/')
+      ++p;
+    const char *end = strchrnul (p, '/');
+    if ((end - p == 1 && p[0] == '.') || (end - p == 2 && p[0] == '.' && p[1] == '.'))
+      return 0;
+    p = end;
+  }
+
+  return 1;
+}
+
+const char *prelog_cwd_get (char *buf, size_t len)
+{
+  const char *ret = NULL;
+  uint64_t now = prelog_cwd_now_ms ();
+  struct stat dot;
+
+  pthread_mutex_lock (&_prelog_cwd_lock);
+  if (!_prelog_cwd_len)
+    prelog_cwd_compute (now);
+  else if (now - _prelog_cwd_checked >= PRELOG_CWD_TTL_MS) {
+    if (stat (".", &dot) == 0 && dot.st_dev == _prelog_cwd_dev && dot.st_ino == _prelog_cwd_ino)
+      _prelog_cwd_checked = now;
+    else
+      prelog_cwd_compute (now);
+  }
+
+  if (_prelog_cwd_len && _prelog_cwd_len < len) {
+    memcpy (buf, _prelog_cwd, _prelog_cwd_len + 1);
+    ret = buf;
+  }
+  pthread_mutex_unlock (&_prelog_cwd_lock);
+
+  return ret;
+}
+
+/* Call after a successful chdir to path, or fchdir to a directory whose
+ * path is known, or NULL. Plain paths are joined to the cached cwd, others
+ * are resolved by the kernel. Nothing is done until the cwd was needed. */
+void prelog_cwd_changed (const char *path)
+{
+  char buf[PATH_MAX];
+  uint64_t now = prelog_cwd_now_ms ();
+  struct stat dot;
+  int len = -1;
+
+  pthread_mutex_lock (&_prelog_cwd_lock);
+  if (!_prelog_cwd_len) {
+    pthread_mutex_unlock (&_prelog_cwd_lock);
+    return;
+  }
+
+  if (path && path[0] && prelog_cwd_is_plain (path)) {
+    if (path[0] == '/')
+      len = snprintf (buf, sizeof (buf), "%s", path);
+    else
+      len = snprintf (buf, sizeof (buf), "%s/%s", _prelog_cwd_len > 1 ? _prelog_cwd : "", path);
+  }
+
+  if (len > 0 && len < (int) sizeof (buf) && stat (".", &dot) == 0) {
+    while (len > 1 && buf[len - 1] == '/')
+      --len;
+    prelog_cwd_set (buf, len, &dot, now);
+  } else
+    prelog_cwd_compute (now);
+  pthread_mutex_unlock (&_prelog_cwd_lock);
+}
+
+// The lock comes last, after every other lock of the library
+void prelog_cwd_fork_prepare (void)
+{
+  pthread_mutex_lock (&_prelog_cwd_lock);
+}
+
+void prelog_cwd_fork_parent (void)
+{
+  pthread_mutex_unlock (&_prelog_cwd_lock);
+}
+
+// The child starts in the same directory, so the cache stays valid
+void prelog_cwd_fork_child (void)
+{
+  pthread_mutex_init (&_prelog_cwd_lock, NULL);
+}
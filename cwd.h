@@ -0,0 +1,40 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_CWD_H
+#define	_CWD_H	1
+
+#include <stddef.h>
+
+/* Cached current working directory, the origin of most relative paths we
+ * log. It is computed once, like get_current_dir_name does, and then kept
+ * up to date by the chdir and fchdir wrappers, so that logging a relative
+ * path costs a copy rather than a getcwd. Directory changes we do not see,
+ * such as raw syscalls, are caught by comparing the cwd's inode with the
+ * cached one, at most once every PRELOG_CWD_TTL_MS. */
+
+#define PRELOG_CWD_TTL_MS 1000
+
+const char *prelog_cwd_get     (char *buf, size_t len);
+void        prelog_cwd_changed (const char *path);
+
+void prelog_cwd_fork_prepare (void);
+void prelog_cwd_fork_parent  (void);
+void prelog_cwd_fork_child   (void);
+
+#endif /* CWD.h  */
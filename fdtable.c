@@ -0,0 +1,150 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "fdtable.h"
+
+static size_t prelog_fd_table_ceiling (void)
+{
+  struct rlimit rl;
+  size_t ceiling = PRELOG_FD_MAX;
+
+  // The hard limit, since the soft one can be raised at any time
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY && rl.rlim_max < ceiling)
+    ceiling = rl.rlim_max;
+
+  return ceiling;
+}
+
+static PrelogFdPage *prelog_fd_table_page (const PrelogFdTable *table, int fd)
+{
+  size_t index = (size_t) fd >> PRELOG_FD_PAGE_BITS;
+  PrelogFdPage **pages = __atomic_load_n (&table->pages, __ATOMIC_ACQUIRE);
+
+  if (fd < 0 || !pages || index >= table->n_pages)
+    return NULL;
+
+  return __atomic_load_n (&pages[index], __ATOMIC_ACQUIRE);
+}
+
+int prelog_fd_table_insert (PrelogFdTable *table, int fd, int oflag, uint32_t path)
+{
+  if (fd < 0)
+    return 0;
+
+  if (!table->pages) {
+    size_t n_pages = (prelog_fd_table_ceiling () + PRELOG_FD_PAGE_MASK) >> PRELOG_FD_PAGE_BITS;
+    PrelogFdPage **pages = calloc (n_pages, sizeof (PrelogFdPage *));
+    if (!pages)
+      return 0;
+    table->n_pages = n_pages;
+    __atomic_store_n (&table->pages, pages, __ATOMIC_RELEASE);
+  }
+
+  size_t index = (size_t) fd >> PRELOG_FD_PAGE_BITS;
+  if (index >= table->n_pages)
+    return 0;
+
+  PrelogFdPage *page = table->pages[index];
+  if (!page) {
+    page = calloc (1, sizeof (PrelogFdPage));
+    if (!page)
+      return 0;
+    __atomic_store_n (&table->pages[index], page, __ATOMIC_RELEASE);
+  }
+
+  int offset = fd & PRELOG_FD_PAGE_MASK;
+  page->slots[offset].oflag = oflag;
+  page->slots[offset].path = path;
+  memset (&page->slots[offset].io, 0, sizeof (PrelogFdIo));
+  __atomic_fetch_or (&page->bits[offset / PRELOG_FD_WORD_BITS], 1UL << (offset % PRELOG_FD_WORD_BITS), __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+int prelog_fd_table_remove (PrelogFdTable *table, int fd)
+{
+  PrelogFdPage *page = prelog_fd_table_page (table, fd);
+  if (!page)
+    return 0;
+
+  int offset = fd & PRELOG_FD_PAGE_MASK;
+  unsigned long mask = 1UL << (offset % PRELOG_FD_WORD_BITS);
+  unsigned long old = __atomic_fetch_and (&page->bits[offset / PRELOG_FD_WORD_BITS], ~mask, __ATOMIC_ACQ_REL);
+
+  return (old & mask) != 0;
+}
+
+int prelog_fd_table_contains (const PrelogFdTable *table, int fd)
+{
+  PrelogFdPage *page = prelog_fd_table_page (table, fd);
+  if (!page)
+    return 0;
+
+  int offset = fd & PRELOG_FD_PAGE_MASK;
+  unsigned long word = __atomic_load_n (&page->bits[offset / PRELOG_FD_WORD_BITS], __ATOMIC_RELAXED);
+  return (word >> (offset % PRELOG_FD_WORD_BITS)) & 1;
+}
+
+PrelogFdSlot *prelog_fd_table_lookup (const PrelogFdTable *table, int fd)
+{
+  PrelogFdPage *page = prelog_fd_table_page (table, fd);
+  if (!page)
+    return NULL;
+
+  int offset = fd & PRELOG_FD_PAGE_MASK;
+  unsigned long word = __atomic_load_n (&page->bits[offset / PRELOG_FD_WORD_BITS], __ATOMIC_ACQUIRE);
+  if (!((word >> (offset % PRELOG_FD_WORD_BITS)) & 1))
+    return NULL;
+
+  return &page->slots[offset];
+}
+
+// Counts one read or write call on fd, and the bytes it moved, if fd is tracked
+void prelog_fd_table_count (const PrelogFdTable *table, int fd, int op, ssize_t bytes)
+{
+  PrelogFdPage *page = prelog_fd_table_page (table, fd);
+  if (!page)
+    return;
+
+  int offset = fd & PRELOG_FD_PAGE_MASK;
+  unsigned long word = __atomic_load_n (&page->bits[offset / PRELOG_FD_WORD_BITS], __ATOMIC_RELAXED);
+  if (!((word >> (offset % PRELOG_FD_WORD_BITS)) & 1))
+    return;
+
+  PrelogFdIo *io = &page->slots[offset].io;
+  __atomic_fetch_add (&io->calls[op], 1, __ATOMIC_RELAXED);
+  if (bytes > 0)
+    __atomic_fetch_add (&io->bytes[op], (uint64_t) bytes, __ATOMIC_RELAXED);
+}
+
+// Adds the counters of slot to io
+void prelog_fd_io_add (PrelogFdIo *io, const PrelogFdSlot *slot)
+{
+  int op;
+
+  for (op = PRELOG_FD_IO_READ; op <= PRELOG_FD_IO_WRITE; ++op) {
+    io->calls[op] += __atomic_load_n (&slot->io.calls[op], __ATOMIC_RELAXED);
+    io->bytes[op] += __atomic_load_n (&slot->io.bytes[op], __ATOMIC_RELAXED);
+  }
+}
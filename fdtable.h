@@ -0,0 +1,82 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_FDTABLE_H
+#define	_FDTABLE_H	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* fd-indexed table of the file descriptors we log. Descriptors are grouped
+ * in pages of PRELOG_FD_PAGE_SIZE, each holding a membership bitmap and one
+ * slot per fd. Pages are only allocated once an fd in their range gets
+ * tracked, and the page directory is sized after the process' fd ceiling
+ * (RLIMIT_NOFILE), so memory is bounded by the highest fd ever tracked.
+ * Slots hold the open flags of their fd and the id of its path in a
+ * PrelogPathTable, or 0 for fds that have none such as pipes and sockets,
+ * along with the calls and bytes of I/O done on the fd while tracked.
+ *
+ * Pages are never freed and the bitmap is updated atomically, so that
+ * prelog_fd_table_contains can be called without holding any lock: most
+ * descriptors closed by a process were never tracked, and this lets close()
+ * and friends skip _prelog_fd_lock for them. Insertions and removals must
+ * still be serialised by the caller. prelog_fd_table_count needs no lock
+ * either: it adds to the counters of tracked fds with relaxed atomics, so
+ * I/O on untracked fds costs a bitmap test. */
+
+#define PRELOG_FD_PAGE_BITS    10
+#define PRELOG_FD_PAGE_SIZE    (1 << PRELOG_FD_PAGE_BITS)
+#define PRELOG_FD_PAGE_MASK    (PRELOG_FD_PAGE_SIZE - 1)
+#define PRELOG_FD_WORD_BITS    (8 * sizeof (unsigned long))
+#define PRELOG_FD_MAX          (1 << 24)
+
+#define PRELOG_FD_IO_READ      0
+#define PRELOG_FD_IO_WRITE     1
+
+typedef struct _PrelogFdIo {
+  uint64_t           calls[2];   /* indexed by PRELOG_FD_IO_READ and _WRITE */
+  uint64_t           bytes[2];
+} PrelogFdIo;
+
+typedef struct _PrelogFdSlot {
+  int                oflag;
+  uint32_t           path;
+  PrelogFdIo         io;
+} PrelogFdSlot;
+
+typedef struct _PrelogFdPage {
+  unsigned long      bits[PRELOG_FD_PAGE_SIZE / PRELOG_FD_WORD_BITS];
+  PrelogFdSlot       slots[PRELOG_FD_PAGE_SIZE];
+} PrelogFdPage;
+
+typedef struct _PrelogFdTable {
+  PrelogFdPage     **pages;
+  size_t             n_pages;
+} PrelogFdTable;
+
+#define PRELOG_FD_TABLE_INIT { NULL, 0 }
+
+int           prelog_fd_table_insert   (PrelogFdTable *table, int fd, int oflag, uint32_t path);
+int           prelog_fd_table_remove   (PrelogFdTable *table, int fd);
+int           prelog_fd_table_contains (const PrelogFdTable *table, int fd);
+PrelogFdSlot *prelog_fd_table_lookup   (const PrelogFdTable *table, int fd);
+void          prelog_fd_table_count    (const PrelogFdTable *table, int fd, int op, ssize_t bytes);
+void          prelog_fd_io_add         (PrelogFdIo *io, const PrelogFdSlot *slot);
+
+#endif /* FDTABLE.h  */
@@ -0,0 +1,170 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "identity.h"
+#include "logger.h"
+#include "originals.h"
+
+static PrelogIdentity *_prelog_identity = NULL;
+static pthread_mutex_t _prelog_identity_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Handed out when we cannot even allocate a record
+static PrelogIdentity _prelog_identity_unknown = { 0, 0, 0, "unknown", "unknown" };
+
+// Reads at most len - 1 bytes of a /proc file, without going through our wrappers
+static ssize_t prelog_identity_read (const char *path, char *buffer, size_t len)
+{
+  int fd = (*PRELOG_ORIGINAL(open)) (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  size_t total = 0;
+  ssize_t n;
+  while (total < len - 1 && (n = (*PRELOG_ORIGINAL(read)) (fd, buffer + total, len - 1 - total)) > 0)
+    total += n;
+
+  (*PRELOG_ORIGINAL(close)) (fd);
+  buffer[total] = '\0';
+  return total;
+}
+
+static const char *prelog_identity_actor (char *buffer, size_t len)
+{
+  ssize_t read_len = readlink ("/proc/self/exe", buffer, len - 1);
+  if (read_len < 0)
+    return "unknown (failed to read exe link)";
+
+  // readlink does not null-terminate the string
+  buffer[read_len] = '\0';
+
+  char *split_target = strrchr (buffer, '/');
+  if (!split_target)
+    return "unknown (could not get file base name from exe link)";
+
+  return split_target + 1;
+}
+
+static const char *prelog_identity_cmdline (char *buffer, size_t len)
+{
+  ssize_t read_len = prelog_identity_read ("/proc/self/cmdline", buffer, len);
+  if (read_len < 0)
+    return "unknown (could not open command line file)";
+  if (read_len == 0)
+    return "unknown (could not read command line file)";
+
+  ssize_t i;
+  for (i = 0; i < read_len; ++i)
+    if (buffer[i] == '\0')
+      buffer[i] = ' ';
+
+  return buffer;
+}
+
+static unsigned long long prelog_identity_start_time (void)
+{
+  char buffer[1024];
+  unsigned long long start_time = 0;
+
+  if (prelog_identity_read ("/proc/self/stat", buffer, sizeof (buffer)) <= 0)
+    return 0;
+
+  // The command name may contain anything, fields resume after its last ')'
+  char *fields = strrchr (buffer, ')');
+  if (!fields || sscanf (fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &start_time) != 1)
+    return 0;
+
+  return start_time;
+}
+
+// Call with _prelog_identity_lock held
+static PrelogIdentity *prelog_identity_create (void)
+{
+  static char exe[PATH_MAX], cmd[PRELOG_CMDLINE_LEN];
+
+  const char *actor = prelog_identity_actor (exe, sizeof (exe));
+  const char *cmdline = prelog_identity_cmdline (cmd, sizeof (cmd));
+  size_t actor_len = strlen (actor) + 1, cmdline_len = strlen (cmdline) + 1;
+
+  // The strings live right after the record, in the same block
+  PrelogIdentity *identity = malloc (sizeof (PrelogIdentity) + actor_len + cmdline_len);
+  if (!identity)
+    return NULL;
+
+  char *strings = (char *) (identity + 1);
+  memcpy (strings, actor, actor_len);
+  memcpy (strings + actor_len, cmdline, cmdline_len);
+
+  identity->pid = getpid ();
+  identity->ppid = getppid ();
+  identity->start_time = prelog_identity_start_time ();
+  identity->actor = strings;
+  identity->cmdline = strings + actor_len;
+
+  return identity;
+}
+
+const PrelogIdentity *prelog_identity_get (void)
+{
+  PrelogIdentity *identity = __atomic_load_n (&_prelog_identity, __ATOMIC_ACQUIRE);
+  if (identity)
+    return identity;
+
+  pthread_mutex_lock (&_prelog_identity_lock);
+  identity = _prelog_identity;
+  if (!identity) {
+    identity = prelog_identity_create ();
+    __atomic_store_n (&_prelog_identity, identity, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock (&_prelog_identity_lock);
+
+  if (!identity) {
+    _prelog_identity_unknown.pid = getpid ();
+    _prelog_identity_unknown.ppid = getppid ();
+    return &_prelog_identity_unknown;
+  }
+
+  return identity;
+}
+
+void prelog_identity_fork_prepare (void)
+{
+  pthread_mutex_lock (&_prelog_identity_lock);
+}
+
+void prelog_identity_fork_parent (void)
+{
+  pthread_mutex_unlock (&_prelog_identity_lock);
+}
+
+void prelog_identity_reset_after_fork (void)
+{
+  // Only the forking thread survived, and it held the lock across fork
+  pthread_mutex_init (&_prelog_identity_lock, NULL);
+  free (_prelog_identity);
+  _prelog_identity = NULL;
+}
@@ -0,0 +1,42 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_IDENTITY_H
+#define	_IDENTITY_H	1
+
+#include <sys/types.h>
+
+/* Who the current process is. The record is built on first use, once per
+ * process image: a fresh copy of the library gets loaded by exec, and the
+ * child of a fork drops its parent's record. Records are never modified, so
+ * callers keep the pointer instead of copying the strings. */
+
+typedef struct _PrelogIdentity {
+  pid_t              pid;
+  pid_t              ppid;
+  unsigned long long start_time; /* clock ticks after boot, as in /proc/<pid>/stat */
+  const char        *actor;      /* base name of the executable */
+  const char        *cmdline;    /* arguments separated by spaces */
+} PrelogIdentity;
+
+const PrelogIdentity *prelog_identity_get (void);
+void prelog_identity_fork_prepare (void);
+void prelog_identity_fork_parent (void);
+void prelog_identity_reset_after_fork (void);
+
+#endif /* IDENTITY.h  */
@@ -0,0 +1,221 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "journal.h"
+
+#define PRELOG_JOURNAL_SLOT_HEADER (2 * sizeof (uint64_t))
+#define PRELOG_JOURNAL_SLOT_SIZE(len) (PRELOG_JOURNAL_SLOT_HEADER + (((len) + 7) & ~(size_t) 7))
+#define PRELOG_JOURNAL_PAGE        4096
+
+typedef struct _PrelogJournalHeader {
+  char               magic[8];
+  uint64_t           segment_size;
+} PrelogJournalHeader;
+
+// Allocates and maps segments up to index, or returns -1 if the disk is full
+// or the journal closed
+static int prelog_journal_map (PrelogJournal *journal, uint32_t index)
+{
+  int ret = 0;
+
+  if (index < __atomic_load_n (&journal->n_segments, __ATOMIC_ACQUIRE))
+    return 0;
+  if (index >= PRELOG_JOURNAL_SEGMENTS)
+    return -1;
+
+  pthread_mutex_lock (&journal->lock);
+  while (journal->n_segments <= index) {
+    off_t offset = PRELOG_JOURNAL_DATA + (off_t) journal->n_segments * journal->segment_size;
+
+    if (__atomic_load_n (&journal->closed, __ATOMIC_ACQUIRE) ||
+        posix_fallocate (journal->fd, offset, journal->segment_size) != 0) {
+      ret = -1;
+      break;
+    }
+
+    void *addr = mmap (NULL, journal->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, offset);
+    if (addr == MAP_FAILED) {
+      ret = -1;
+      break;
+    }
+
+    journal->segments[journal->n_segments] = addr;
+    __atomic_store_n (&journal->n_segments, journal->n_segments + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock (&journal->lock);
+
+  return ret;
+}
+
+// Lays a journal out in the empty file behind fd, which it keeps
+PrelogJournal *prelog_journal_create (int fd, size_t segment_size)
+{
+  PrelogJournalHeader header;
+
+  if (segment_size < 2 * PRELOG_JOURNAL_SLOT_SIZE (PRELOG_RECORD_MAX) || segment_size % PRELOG_JOURNAL_PAGE)
+    return NULL;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, PRELOG_JOURNAL_MAGIC, PRELOG_JOURNAL_MAGIC_LEN);
+  header.segment_size = segment_size;
+  if (ftruncate (fd, PRELOG_JOURNAL_DATA) < 0 ||
+      pwrite (fd, &header, sizeof (header), 0) != sizeof (header))
+    return NULL;
+
+  PrelogJournal *journal = calloc (1, sizeof (PrelogJournal));
+  if (!journal)
+    return NULL;
+
+  journal->fd = fd;
+  journal->segment_size = segment_size;
+  pthread_mutex_init (&journal->lock, NULL);
+
+  if (prelog_journal_map (journal, 0) < 0) {
+    prelog_journal_detach (journal);
+    return NULL;
+  }
+
+  return journal;
+}
+
+/* Turns appends away and gives back the disk space past the last record.
+ * Other threads may still be appending, so nothing gets unmapped, and pages
+ * written to after the hole was punched simply get allocated again. */
+void prelog_journal_close (PrelogJournal *journal)
+{
+  if (!journal)
+    return;
+
+  __atomic_store_n (&journal->closed, 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock (&journal->lock);
+  uint64_t head = __atomic_load_n (&journal->head, __ATOMIC_RELAXED);
+  uint64_t start = (head + PRELOG_JOURNAL_PAGE - 1) & ~(uint64_t) (PRELOG_JOURNAL_PAGE - 1);
+  uint64_t end = (uint64_t) journal->n_segments * journal->segment_size;
+  if (start < end)
+    fallocate (journal->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+               PRELOG_JOURNAL_DATA + start, end - start);
+  pthread_mutex_unlock (&journal->lock);
+}
+
+// Unmaps the journal, when no other thread can be appending; fd stays open
+void prelog_journal_detach (PrelogJournal *journal)
+{
+  uint32_t i;
+
+  if (!journal)
+    return;
+
+  for (i = 0; i < journal->n_segments; ++i)
+    munmap (journal->segments[i], journal->segment_size);
+  free (journal);
+}
+
+// Returns -1 if the journal is closed or could not grow, in which case the
+// record is lost
+int prelog_journal_append (PrelogJournal *journal, int kind, PrelogTime timestamp,
+                           const char *record, size_t len)
+{
+  if (!len || len > PRELOG_RECORD_MAX || __atomic_load_n (&journal->closed, __ATOMIC_ACQUIRE))
+    return -1;
+
+  uint64_t total = PRELOG_JOURNAL_SLOT_SIZE (len);
+  uint64_t reserved = ((uint64_t) len << 32) | PRELOG_JOURNAL_RESERVED;
+  uint64_t head = __atomic_load_n (&journal->head, __ATOMIC_RELAXED);
+  uint64_t start, expected;
+  char *slot;
+
+  for (;;) {
+    // Leave the end of a segment empty rather than straddle two
+    uint64_t offset = head % journal->segment_size;
+    start = offset + total > journal->segment_size ? head - offset + journal->segment_size : head;
+
+    uint32_t index = start / journal->segment_size;
+    if (prelog_journal_map (journal, index) < 0)
+      return -1;
+
+    // Mark the room taken before moving the head, so that the records below
+    // it never start with a zero word, and a crash while copying only loses
+    // this record
+    slot = journal->segments[index] + start % journal->segment_size;
+    expected = 0;
+    if (!__atomic_compare_exchange_n ((uint64_t *) slot, &expected, reserved, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      head = __atomic_load_n (&journal->head, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_compare_exchange_n (&journal->head, &head, start + total, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+
+    // Our head was stale, hand the word back unless a record was copied over it
+    expected = reserved;
+    __atomic_compare_exchange_n ((uint64_t *) slot, &expected, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+
+  uint64_t *word = (uint64_t *) slot;
+  memcpy (slot + sizeof (uint64_t), &timestamp, sizeof (timestamp));
+  memcpy (slot + PRELOG_JOURNAL_SLOT_HEADER, record, len);
+  __atomic_store_n (word, ((uint64_t) len << 32) | (uint32_t) kind, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+// Hands the published records of the journal held in data to func, in order,
+// or returns -1 if data holds no journal
+int prelog_journal_read (const char *data, size_t len, PrelogJournalFunc func, void *user_data)
+{
+  PrelogJournalHeader header;
+  size_t segment, pos;
+
+  if (len < PRELOG_JOURNAL_DATA)
+    return -1;
+
+  memcpy (&header, data, sizeof (header));
+  if (memcmp (header.magic, PRELOG_JOURNAL_MAGIC, PRELOG_JOURNAL_MAGIC_LEN) ||
+      header.segment_size < 2 * PRELOG_JOURNAL_SLOT_SIZE (PRELOG_RECORD_MAX) ||
+      header.segment_size % PRELOG_JOURNAL_PAGE)
+    return -1;
+
+  for (segment = PRELOG_JOURNAL_DATA; segment < len; segment += header.segment_size) {
+    size_t end = len - segment < header.segment_size ? len : segment + header.segment_size;
+
+    for (pos = segment; pos + PRELOG_JOURNAL_SLOT_HEADER <= end; ) {
+      uint64_t word;
+      PrelogTime timestamp;
+
+      memcpy (&word, data + pos, sizeof (word));
+      size_t record_len = word >> 32;
+      if (!word || record_len > PRELOG_RECORD_MAX || pos + PRELOG_JOURNAL_SLOT_SIZE (record_len) > end)
+        break;
+
+      if ((uint32_t) word != PRELOG_JOURNAL_RESERVED) {
+        memcpy (&timestamp, data + pos + sizeof (uint64_t), sizeof (timestamp));
+        func ((int) (uint32_t) word, timestamp, data + pos + PRELOG_JOURNAL_SLOT_HEADER, record_len, user_data);
+      }
+      pos += PRELOG_JOURNAL_SLOT_SIZE (record_len);
+    }
+  }
+
+  return 0;
+}
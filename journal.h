@@ -0,0 +1,80 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef	_JOURNAL_H
+#define	_JOURNAL_H	1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "logger.h"
+
+/* Crash-durable log mode, chosen with PRELOG_JOURNAL=1 when there is no
+ * collector. Records are copied straight into a file mapped in memory,
+ * from the thread that logs them, so they belong to the kernel as soon as
+ * the call returns: a SIGKILL, an abort or an _exit loses nothing. Appending
+ * takes a compare-and-swap and a copy, and no system call.
+ *
+ * The file is a header page followed by segments of the same size, which
+ * get allocated on disk and mapped one at a time as the journal grows, so
+ * that a full disk shows up as a failed append and not as a SIGBUS. Records
+ * never straddle two segments. Each one is two 64-bit words, its length and
+ * kind and then its timestamp, followed by the serialized event padded to 8
+ * bytes. The first word is claimed, as reserved, before the record's room
+ * is taken, and published last. A word of zero ends the records of its
+ * segment, and a reserved record is one whose process died before it could
+ * publish it.
+ *
+ * Journals hold serialized events uncompressed, whatever PRELOG_FORMAT says.
+ * preload-logger-convert turns them into text logs, which compress well. */
+
+#define PRELOG_JOURNAL_ENV      "PRELOG_JOURNAL" /* set to "1" to log to a journal */
+#define PRELOG_JOURNAL_MAGIC    "PRLJ\001"
+#define PRELOG_JOURNAL_MAGIC_LEN 5
+#define PRELOG_JOURNAL_DATA     4096             /* the header page comes first */
+#define PRELOG_JOURNAL_SEGMENT  (1024 * 1024)
+#define PRELOG_JOURNAL_SEGMENTS 4096             /* 4 GiB of records at most */
+
+#define PRELOG_JOURNAL_RESERVED 1
+#define PRELOG_JOURNAL_EVENT    2
+#define PRELOG_JOURNAL_HEADER   3                /* the process header line */
+
+typedef struct _PrelogJournal {
+  int                fd;
+  size_t             segment_size;
+  char              *segments[PRELOG_JOURNAL_SEGMENTS];
+  uint32_t           n_segments;  /* mapped so far */
+  uint64_t           head;        /* offset of the next record */
+  int                closed;
+  pthread_mutex_t    lock;        /* taken to map a new segment */
+} PrelogJournal;
+
+typedef void (*PrelogJournalFunc) (int kind, PrelogTime timestamp,
+                                   const char *record, size_t len, void *data);
+
+PrelogJournal *prelog_journal_create (int fd, size_t segment_size);
+void prelog_journal_close (PrelogJournal *journal);
+void prelog_journal_detach (PrelogJournal *journal);
+
+int prelog_journal_append (PrelogJournal *journal, int kind, PrelogTime timestamp,
+                           const char *record, size_t len);
+
+int prelog_journal_read (const char *data, size_t len, PrelogJournalFunc func, void *user_data);
+
+#endif /* JOURNAL.h  */
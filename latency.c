@@ -0,0 +1,313 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+
+typedef struct _PrelogLatencyKind {
+  const char        *name;      /* NULL until a call site claims the kind */
+  uint64_t           calls;
+  uint64_t           sum;
+  uint64_t           max;
+  uint64_t           buckets[PRELOG_LATENCY_BUCKETS];
+  uint64_t           threshold; /* 0 when every event gets logged */
+  uint64_t           skipped;   /* events under the threshold */
+} PrelogLatencyKind;
+
+typedef struct _PrelogSlowThreshold {
+  char               name[PRELOG_SLOW_NAME_LEN];
+  uint64_t           ns;
+} PrelogSlowThreshold;
+
+int prelog_latency_enabled = 0;
+
+static PrelogLatencyKind _prelog_latency_kinds[PRELOG_LATENCY_KINDS];
+static int _prelog_latency_final = 0;
+static __thread int64_t _prelog_latency_last = -1;
+static __thread PrelogTime _prelog_latency_stamp = 0;  /* monotonic start of the last timed call */
+static __thread int _prelog_latency_kind = -1;   /* of the last timed call */
+static __thread int _prelog_latency_quiet = 0;   /* whether it was under its threshold */
+
+static int _prelog_slow = 0;
+static uint64_t _prelog_slow_default = 0;
+static PrelogSlowThreshold _prelog_slow_thresholds[PRELOG_LATENCY_KINDS];
+static int _prelog_slow_n_thresholds = 0;
+static uint64_t _prelog_slow_reported = 0;
+
+static uint64_t prelog_latency_coarse_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Reads "<default>,<name>=<ns>,..." and ignores what does not parse
+static void prelog_slow_parse (const char *config)
+{
+  const char *p = config;
+
+  while (*p) {
+    const char *end = strchrnul (p, ',');
+    const char *eq = memchr (p, '=', end - p);
+    char *num_end;
+
+    if (!eq) {
+      uint64_t ns = strtoull (p, &num_end, 10);
+      if (num_end == end && num_end != p)
+        _prelog_slow_default = ns;
+    } else if (eq - p > 0 && eq - p < PRELOG_SLOW_NAME_LEN && _prelog_slow_n_thresholds < PRELOG_LATENCY_KINDS) {
+      uint64_t ns = strtoull (eq + 1, &num_end, 10);
+      if (num_end == end && num_end != eq + 1) {
+        PrelogSlowThreshold *t = &_prelog_slow_thresholds[_prelog_slow_n_thresholds++];
+        memcpy (t->name, p, eq - p);
+        t->name[eq - p] = '\0';
+        t->ns = ns;
+      }
+    }
+
+    p = *end ? end + 1 : end;
+  }
+}
+
+static uint64_t prelog_slow_threshold (const char *interpretation)
+{
+  int i;
+
+  if (!_prelog_slow)
+    return 0;
+
+  for (i = 0; i < _prelog_slow_n_thresholds; ++i)
+    if (strcmp (_prelog_slow_thresholds[i].name, interpretation) == 0)
+      return _prelog_slow_thresholds[i].ns;
+
+  return _prelog_slow_default;
+}
+
+// The log may never have been opened by the time we exit, in which case
+// prelog_log_shutdown never runs to write the histograms
+static void prelog_latency_exit (void)
+{
+  prelog_latency_flush (prelog_log_get_default (PRELOG_LOG_DONT_RESET), 1);
+}
+
+__attribute__((constructor))
+static void prelog_latency_init (void)
+{
+  const char *latency = getenv (PRELOG_LATENCY_ENV);
+  const char *slow = getenv (PRELOG_SLOW_ENV);
+
+  if (slow && *slow) {
+    _prelog_slow = 1;
+    prelog_slow_parse (slow);
+  }
+
+  if ((latency && strcmp (latency, "1") == 0) || _prelog_slow) {
+    prelog_latency_enabled = 1;
+    atexit (prelog_latency_exit);
+  }
+}
+
+static int prelog_latency_bucket (uint64_t ns)
+{
+  if (ns < PRELOG_LATENCY_SUB)
+    return ns;
+
+  int shift = 63 - __builtin_clzll (ns) - PRELOG_LATENCY_SUB_BITS;
+  int bucket = (shift + 1) * PRELOG_LATENCY_SUB + (int) ((ns >> shift) & (PRELOG_LATENCY_SUB - 1));
+  return bucket < PRELOG_LATENCY_BUCKETS ? bucket : PRELOG_LATENCY_BUCKETS - 1;
+}
+
+static uint64_t prelog_latency_bucket_low (int bucket)
+{
+  if (bucket < PRELOG_LATENCY_SUB)
+    return bucket;
+
+  return (uint64_t) (PRELOG_LATENCY_SUB + bucket % PRELOG_LATENCY_SUB) << (bucket / PRELOG_LATENCY_SUB - 1);
+}
+
+// Finds the kind of interpretation, or claims a free one for it
+static int prelog_latency_kind (const char *interpretation)
+{
+  int k;
+
+  for (k = 0; k < PRELOG_LATENCY_KINDS; ++k) {
+    const char *name = __atomic_load_n (&_prelog_latency_kinds[k].name, __ATOMIC_ACQUIRE);
+    // Calls that find the kind before its threshold is set get logged
+    if (!name && __atomic_compare_exchange_n (&_prelog_latency_kinds[k].name, &name, interpretation,
+                                              0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n (&_prelog_latency_kinds[k].threshold, prelog_slow_threshold (interpretation), __ATOMIC_RELAXED);
+      return k;
+    }
+    if (name == interpretation || strcmp (name, interpretation) == 0)
+      return k;
+  }
+
+  return PRELOG_LATENCY_KINDS;
+}
+
+void prelog_latency_done (const char *interpretation, int *kind)
+{
+  // A call stamped before latency got enabled has no start
+  PrelogTime started = prelog_clock_started ();
+  int64_t ns = started ? prelog_clock_monotonic () - started : 0;
+
+  _prelog_latency_last = ns;
+  _prelog_latency_stamp = started;
+  _prelog_latency_quiet = 0;
+
+  int k = __atomic_load_n (kind, __ATOMIC_RELAXED);
+  if (k < 0) {
+    k = prelog_latency_kind (interpretation);
+    __atomic_store_n (kind, k, __ATOMIC_RELAXED);
+  }
+  _prelog_latency_kind = k;
+  if (k >= PRELOG_LATENCY_KINDS)
+    return;
+
+  PrelogLatencyKind *h = &_prelog_latency_kinds[k];
+  _prelog_latency_quiet = (uint64_t) ns < __atomic_load_n (&h->threshold, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->sum, (uint64_t) ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->buckets[prelog_latency_bucket (ns)], 1, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+  while ((uint64_t) ns > max
+         && !__atomic_compare_exchange_n (&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// The duration of the call the current event was stamped for, or -1
+int64_t prelog_latency_last (void)
+{
+  if (!prelog_latency_enabled || _prelog_latency_stamp != prelog_clock_started ())
+    return -1;
+
+  return _prelog_latency_last;
+}
+
+// Writes the counts of skipped events, and empties them
+static void prelog_slow_report (PrelogLog *log)
+{
+  char text[128];
+  int k;
+
+  for (k = 0; k < PRELOG_LATENCY_KINDS; ++k) {
+    PrelogLatencyKind *h = &_prelog_latency_kinds[k];
+    const char *name = __atomic_load_n (&h->name, __ATOMIC_ACQUIRE);
+    if (!name)
+      break;
+
+    uint64_t skipped = __atomic_exchange_n (&h->skipped, 0, __ATOMIC_RELAXED);
+    if (!skipped)
+      continue;
+
+    snprintf (text, sizeof (text), "%llu events under %llu ns", (unsigned long long) skipped,
+              (unsigned long long) __atomic_load_n (&h->threshold, __ATOMIC_RELAXED));
+    PrelogSubject subject;
+    prelog_subject_init (&subject, name, text, NULL);
+    PrelogSubject *subjects[] = { &subject, NULL };
+    prelog_log_insert (log, prelog_clock_now (), PRELOG_SLOW_SCI, subjects);
+  }
+}
+
+/* Whether the event about to be logged is that of a call under its
+ * threshold, in which case it is counted and must be dropped. Call once
+ * per event, before formatting it. */
+int prelog_latency_skip (void)
+{
+  if (!_prelog_slow || !_prelog_latency_quiet || _prelog_latency_stamp != prelog_clock_started ()
+      || _prelog_latency_kind < 0 || _prelog_latency_kind >= PRELOG_LATENCY_KINDS)
+    return 0;
+
+  __atomic_fetch_add (&_prelog_latency_kinds[_prelog_latency_kind].skipped, 1, __ATOMIC_RELAXED);
+
+  // One thread reports the counts, once in a while
+  uint64_t now = prelog_latency_coarse_ms ();
+  uint64_t reported = __atomic_load_n (&_prelog_slow_reported, __ATOMIC_RELAXED);
+  if (!reported)
+    __atomic_compare_exchange_n (&_prelog_slow_reported, &reported, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  else if (now - reported >= PRELOG_SLOW_REPORT_MS
+           && __atomic_compare_exchange_n (&_prelog_slow_reported, &reported, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    prelog_slow_report (prelog_log_get_default (PRELOG_LOG_DONT_RESET));
+
+  return 1;
+}
+
+/* Writes a record per histogram with calls in it, and empties them, then
+ * the counts of skipped events. Calls that complete meanwhile may land in
+ * either this flush or the next. The final flush, at exit, is the last
+ * one. */
+void prelog_latency_flush (PrelogLog *log, int final)
+{
+  char text[PRELOG_LATENCY_TEXT_MAX];
+  int k, b;
+
+  if (!prelog_latency_enabled || !log || _prelog_latency_final)
+    return;
+  if (final)
+    _prelog_latency_final = 1;
+
+  for (k = 0; k < PRELOG_LATENCY_KINDS; ++k) {
+    PrelogLatencyKind *h = &_prelog_latency_kinds[k];
+    const char *name = __atomic_load_n (&h->name, __ATOMIC_ACQUIRE);
+    if (!name)
+      break;
+
+    uint64_t calls = __atomic_exchange_n (&h->calls, 0, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_exchange_n (&h->sum, 0, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_exchange_n (&h->max, 0, __ATOMIC_RELAXED);
+    if (!calls)
+      continue;
+
+    size_t n = snprintf (text, sizeof (text), "%llu calls, total %llu ns, max %llu ns:",
+                         (unsigned long long) calls, (unsigned long long) sum, (unsigned long long) max);
+    const char *separator = " ";
+    for (b = 0; b < PRELOG_LATENCY_BUCKETS; ++b) {
+      uint64_t count = __atomic_exchange_n (&h->buckets[b], 0, __ATOMIC_RELAXED);
+      if (!count || n >= sizeof (text))
+        continue;
+      n += snprintf (text + n, sizeof (text) - n, "%s%llu %llu", separator,
+                     (unsigned long long) prelog_latency_bucket_low (b), (unsigned long long) count);
+      separator = ", ";
+    }
+
+    PrelogSubject subject;
+    prelog_subject_init (&subject, name, text, NULL);
+    PrelogSubject *subjects[] = { &subject, NULL };
+    prelog_log_insert (log, prelog_clock_now (), PRELOG_LATENCY_SCI, subjects);
+  }
+
+  prelog_slow_report (log);
+}
+
+// The child starts with empty histograms, its parent reports its own calls
+void prelog_latency_fork_child (void)
+{
+  int k;
+
+  for (k = 0; k < PRELOG_LATENCY_KINDS; ++k) {
+    PrelogLatencyKind *h = &_prelog_latency_kinds[k];
+    h->calls = h->sum = h->max = h->skipped = 0;
+    memset (h->buckets, 0, sizeof (h->buckets));
+  }
+}
@@ -0,0 +1,85 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_LATENCY_H
+#define	_LATENCY_H	1
+
+#include <stdint.h>
+#include "logger.h"
+
+/* Opt-in timing of the real calls behind our wrappers, enabled by setting
+ * PRELOG_LATENCY=1. Wrappers stamp the event right before calling into
+ * libc and mark the end of the call with PRELOG_LATENCY_DONE right after.
+ * Calls are timed with CLOCK_MONOTONIC, which the vDSO serves as cheaply as
+ * the clock of the event stamp, and which neither PRELOG_CLOCK=coarse nor a
+ * step of the realtime clock can skew.
+ *
+ * The duration is appended to the text of the event, as ", <n> ns", and
+ * counted in a log-linear histogram per interpretation: values below
+ * PRELOG_LATENCY_SUB get a bucket each, then every power of two is split in
+ * PRELOG_LATENCY_SUB buckets of equal width. Histograms cover every call,
+ * logged or not, and are written as PRELOG_LATENCY_SCI records at exit and
+ * before exec, one per interpretation:
+ *
+ *   <ts>|latency|<interpretation>|<calls> calls, total <sum> ns, max <max> ns: <low> <count>, ...|
+ *
+ * where each <low> <count> pair is the lowest value of a non-empty bucket
+ * and the number of calls in it. Histograms are shared by the threads of
+ * the process and updated with relaxed atomics.
+ *
+ * Setting PRELOG_SLOW turns timing on and only logs the events of calls
+ * that took at least as long as the threshold of their interpretation. It
+ * holds a default threshold in nanoseconds and per-call ones, separated by
+ * commas, such as "1000000,fsync=10000000,mkdir=0". Calls without a
+ * threshold are all logged. Other events are not formatted, only counted
+ * per interpretation, and the counts are written every
+ * PRELOG_SLOW_REPORT_MS at most, at exit and before exec, as:
+ *
+ *   <ts>|skipped|<interpretation>|<events> events under <threshold> ns|
+ */
+
+#define PRELOG_LATENCY_ENV       "PRELOG_LATENCY" /* set to 1 to time the real calls */
+#define PRELOG_LATENCY_SCI       "latency"
+#define PRELOG_LATENCY_SUB_BITS  2
+#define PRELOG_LATENCY_SUB       (1 << PRELOG_LATENCY_SUB_BITS)
+#define PRELOG_LATENCY_BUCKETS   (41 * PRELOG_LATENCY_SUB) /* up to 2^41 ns, about 37 minutes */
+#define PRELOG_LATENCY_KINDS     64
+#define PRELOG_LATENCY_TEXT_MAX  8192
+
+#define PRELOG_SLOW_ENV          "PRELOG_SLOW" /* thresholds of the slow-call-only mode */
+#define PRELOG_SLOW_SCI          "skipped"
+#define PRELOG_SLOW_REPORT_MS    10000
+#define PRELOG_SLOW_NAME_LEN     32
+
+extern int prelog_latency_enabled;
+
+// kind caches the histogram of the call site, -1 until it is looked up
+void prelog_latency_done (const char *interpretation, int *kind);
+
+#define PRELOG_LATENCY_DONE(interpretation) do {                           \
+    static int _prelog_kind = -1;                                          \
+    if (__builtin_expect (prelog_latency_enabled, 0))                      \
+      prelog_latency_done ((interpretation), &_prelog_kind);               \
+  } while (0)
+
+int64_t prelog_latency_last (void);
+int prelog_latency_skip (void);
+void prelog_latency_flush (PrelogLog *log, int final);
+void prelog_latency_fork_child (void);
+
+#endif /* LATENCY.h  */
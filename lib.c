@@ -23,8 +23,11 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,23 +35,119 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cwd.h"
+#include "latency.h"
 #include "logger.h"
-#include "gslist.h"
-
-PrelogSList *fds = NULL;
-PrelogSList *files = NULL;
-PrelogSList *dirs = NULL;
+#include "originals.h"
+#include "fdtable.h"
+#include "pathfilter.h"
+#include "pathtable.h"
+#include "ptrset.h"
+
+PrelogFdTable fds = PRELOG_FD_TABLE_INIT;
+PrelogFdTable dirfds = PRELOG_FD_TABLE_INIT;
+PrelogFdTable streams = PRELOG_FD_TABLE_INIT; /* fds of the FILE streams we track */
+PrelogPathTable paths = PRELOG_PATH_TABLE_INIT;
+PrelogPtrSet files = PRELOG_PTR_SET_INIT;
+PrelogPtrSet dirs = PRELOG_PTR_SET_INIT;
 
 static pthread_mutex_t _prelog_fd_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Run around every fork of the process, whether it goes through our fork()
+ * or not. _prelog_fd_lock comes first, as it is held while logging. The fd
+ * tables are consistent while we hold it, so the child keeps them as they
+ * are: its descriptors are the parent's, and copy-on-write makes that free. */
+static void prelog_fork_prepare (void)
+{
+  pthread_mutex_lock(&_prelog_fd_lock);
+  prelog_log_fork_prepare();
+  prelog_cwd_fork_prepare();
+}
+
+static void prelog_fork_parent (void)
+{
+  prelog_cwd_fork_parent();
+  prelog_log_fork_parent();
+  pthread_mutex_unlock(&_prelog_fd_lock);
+}
+
+static void prelog_fork_child (void)
+{
+  pthread_mutex_init(&_prelog_fd_lock, NULL);
+  prelog_log_fork_child();
+  prelog_cwd_fork_child();
+  prelog_latency_fork_child();
+}
+
+__attribute__((constructor))
+static void prelog_fork_init (void)
+{
+  pthread_atfork(prelog_fork_prepare, prelog_fork_parent, prelog_fork_child);
+}
+
 //TODO dbus API?
 
-static void prelog_log_event(const char *syscall_text,
+/* Room for the text of a subject and for "fd: %d" style pseudo-paths. Every
+ * wrapper formats its event on the stack, the hot path never allocates. */
+#define PRELOG_TEXT_LEN 256
+#define PRELOG_NAME_LEN 32
+
+// Call with _prelog_fd_lock held. The path a directory fd was opened
+// with, or the path of a tracked fd, or NULL.
+static const char *prelog_fd_path(int fd)
+{
+  PrelogFdSlot *slot = prelog_fd_table_lookup(&dirfds, fd);
+  if (!slot)
+    slot = prelog_fd_table_lookup(&fds, fd);
+  return slot ? prelog_path_table_get(&paths, slot->path) : NULL;
+}
+
+/* Origin of a relative path: the cached cwd, or the path of the dirfd of
+ * *at calls, written in buf. Dirfds we know no path for are named
+ * "fd: %d". Must not be called with _prelog_fd_lock held unless dirfd is
+ * negative. */
+static const char *prelog_get_origin(const char *file, const int dirfd, char *buf, size_t len)
+{
+  if (!file || file[0] == '/')
+    return NULL;
+
+  if (dirfd >= 0) {
+    const char *dir = NULL;
+    if (prelog_fd_table_contains(&dirfds, dirfd) || prelog_fd_table_contains(&fds, dirfd)) {
+      pthread_mutex_lock(&_prelog_fd_lock);
+      dir = prelog_fd_path(dirfd);
+      if (dir)
+        snprintf (buf, len, "%s", dir);
+      pthread_mutex_unlock(&_prelog_fd_lock);
+    }
+    if (!dir)
+      snprintf (buf, len, "fd: %d", dirfd);
+    return buf;
+  }
+
+  /* Includes AT_FDCWD */
+  return prelog_cwd_get(buf, len);
+}
+
+// Appends the duration of the real call to text, when it was timed
+static const char *prelog_timed_text(const char *text, char *buf, size_t len)
+{
+  int64_t ns = prelog_latency_last();
+  if (ns < 0)
+    return text;
+
+  snprintf (buf, len, "%s, %lld ns", text, (long long) ns);
+  return buf;
+}
+
+// Callers ask prelog_latency_skip first, before formatting or resolving anything
+static void prelog_log_event_at(const char *syscall_text,
                      const char *file,
-                     const int dirfd,
+                     const char *origin,
                      const char *event_interpretation)
 {
   if (!file || !syscall_text || !event_interpretation)
@@ -57,39 +156,25 @@ static void prelog_log_event(const char *syscall_text,
   PrelogLog *log = prelog_log_get_default(PRELOG_LOG_DONT_RESET);
   if (!log) return;
 
-  PrelogEvent *event = prelog_event_new ();
-  if (!event) return;
-  
-  prelog_event_set_interpretation (event, event_interpretation);
-  
-  PrelogSubject *subject = prelog_subject_new ();
-  if (!subject) {
-    prelog_event_free (event);
-    return;
-  }
-  prelog_subject_set_uri (subject, file);
-  prelog_subject_set_text (subject, syscall_text);
-
-  if (file && file[0] != '/') {
-    char *origin = NULL;
-
-    if (dirfd < 0) /* Includes AT_FDCWD */ {
-      origin = get_current_dir_name();
-    } else {
-      origin = malloc (100 * sizeof(char));
-      if (origin)
-        snprintf (origin, 100, "fd: %d", dirfd);
-    }
-    prelog_subject_set_origin(subject, origin);
-    free (origin);
-  }
+  char timed_txt[PRELOG_TEXT_LEN + PRELOG_NAME_LEN];
+  PrelogSubject subject;
+  prelog_subject_init (&subject, file, prelog_timed_text(syscall_text, timed_txt, sizeof(timed_txt)), origin);
+  PrelogSubject *subjects[] = { &subject, NULL };
 
-  prelog_event_add_subject(event, subject);
-  prelog_log_insert_event(log, event);
+  prelog_log_insert(log, prelog_clock_stamped(), event_interpretation, subjects);
 }
 
-static void prelog_log_old_new_event(const char *oldsubjecttext, const char *oldfile, const int olddirfd,
-                              const char *newsubjecttext, const char *newfile, const int newdirfd,
+static void prelog_log_event(const char *syscall_text,
+                     const char *file,
+                     const int dirfd,
+                     const char *event_interpretation)
+{
+  char origin_buf[PATH_MAX];
+  prelog_log_event_at(syscall_text, file, prelog_get_origin(file, dirfd, origin_buf, sizeof(origin_buf)), event_interpretation);
+}
+
+static void prelog_log_old_new_event_at(const char *oldsubjecttext, const char *oldfile, const char *old_origin,
+                              const char *newsubjecttext, const char *newfile, const char *new_origin,
                               const char *event_interpretation)
 {
   if (!oldfile || !newfile || !oldsubjecttext || !newsubjecttext || !event_interpretation)
@@ -98,107 +183,142 @@ static void prelog_log_old_new_event(const char *oldsubjecttext, const char *old
   PrelogLog *log = prelog_log_get_default(0);
   if (!log) return;
 
-  PrelogEvent *event = prelog_event_new ();
-  if (!event) return;
+  // The new subject holds the outcome of the call
+  char timed_txt[PRELOG_TEXT_LEN + PRELOG_NAME_LEN];
+  PrelogSubject old_subject, new_subject;
+  prelog_subject_init (&old_subject, oldfile, oldsubjecttext, old_origin);
+  prelog_subject_init (&new_subject, newfile, prelog_timed_text(newsubjecttext, timed_txt, sizeof(timed_txt)), new_origin);
+  PrelogSubject *subjects[] = { &old_subject, &new_subject, NULL };
 
-  prelog_event_set_interpretation (event, event_interpretation);
-  
-  PrelogSubject *subject = prelog_subject_new ();
-  if (!subject) {
-    prelog_event_free (event);
-    return;
-  }
-  prelog_subject_set_uri (subject, oldfile);
-  prelog_subject_set_text (subject, oldsubjecttext);
+  prelog_log_insert(log, prelog_clock_stamped(), event_interpretation, subjects);
+}
 
-  if (oldfile && oldfile[0] != '/') {
-    char *origin = NULL;
-    
-    if (olddirfd < 0) /* Includes AT_FDCWD */ {
-      origin = get_current_dir_name();
-    } else {
-      origin = malloc (100 * sizeof(char));
-      if (origin)
-        snprintf (origin, 100, "fd: %d", olddirfd);
-    }
-    prelog_subject_set_origin(subject, origin);
-    free (origin);
-  }
-  prelog_event_add_subject(event, subject);
-  
-  subject = prelog_subject_new ();
-  if (!subject) {
-    prelog_event_free (event); // will clear the added subject
-    return;
-  }
-  prelog_subject_set_uri (subject, newfile);
-  prelog_subject_set_text (subject, newsubjecttext);
+static void prelog_log_old_new_event(const char *oldsubjecttext, const char *oldfile, const int olddirfd,
+                              const char *newsubjecttext, const char *newfile, const int newdirfd,
+                              const char *event_interpretation)
+{
+  char old_origin_buf[PATH_MAX], new_origin_buf[PATH_MAX];
+  prelog_log_old_new_event_at(oldsubjecttext, oldfile, prelog_get_origin(oldfile, olddirfd, old_origin_buf, sizeof(old_origin_buf)),
+                              newsubjecttext, newfile, prelog_get_origin(newfile, newdirfd, new_origin_buf, sizeof(new_origin_buf)),
+                              event_interpretation);
+}
 
-  if (newfile && newfile[0] != '/') {
-    char *origin = NULL;
-    
-    if (newdirfd < 0) /* Includes AT_FDCWD */ {
-      origin = get_current_dir_name();
-    } else {
-      origin = malloc (100 * sizeof(char));
-      if (origin)
-        snprintf (origin, 100, "fd: %d", newdirfd);
-    }
-    prelog_subject_set_origin(subject, origin);
-    free (origin);
-  }
-  prelog_event_add_subject(event, subject);
-  prelog_log_insert_event(log, event);
+/* Tracked fds and streams keep the path they were opened with, joined to its
+ * origin, so that their close, dup and fdopen events name the file without
+ * asking the kernel. Those that have none, like pipes and sockets, keep
+ * their "fd: %d" style names, with the cwd as their origin. */
+
+// Call with _prelog_fd_lock held. Relative paths are joined to their origin.
+static uint32_t prelog_path_intern(const char *file, const char *origin)
+{
+  char buf[PATH_MAX];
+
+  if (!file)
+    return 0;
+
+  if (file[0] == '/' || !origin)
+    return prelog_path_table_intern(&paths, file, strlen(file));
+
+  int len = snprintf(buf, sizeof(buf), "%s/%s", origin, file);
+  if (len < 0 || len >= (int) sizeof(buf))
+    return 0;
+  return prelog_path_table_intern(&paths, buf, len);
+}
+
+// Call with _prelog_fd_lock held, with a reference to path for the fd to
+// keep. Drops what the fd stood for if we missed its close, as happens when
+// fclose closes an fdopen'd fd.
+static void prelog_fd_track(PrelogFdTable *table, int fd, int oflag, uint32_t path)
+{
+  PrelogFdSlot *slot = prelog_fd_table_lookup(table, fd);
+  if (slot)
+    prelog_path_table_unref(&paths, slot->path);
+  if (!prelog_fd_table_insert(table, fd, oflag, path))
+    prelog_path_table_unref(&paths, path);
 }
 
-int prelog_starts_with(const char *string, const char *prefix)
+// Call with _prelog_fd_lock held. Adds the I/O done on fd to io, if any.
+static void prelog_fd_forget(PrelogFdTable *table, int fd, PrelogFdIo *io)
 {
-  size_t lenpre = strlen(prefix), lenstr = strlen(string);
-  return lenstr < lenpre ? 0 : strncmp (prefix, string, lenpre) == 0;
+  PrelogFdSlot *slot = prelog_fd_table_lookup(table, fd);
+  if (slot && io)
+    prelog_fd_io_add(io, slot);
+  if (slot && prelog_fd_table_remove(table, fd))
+    prelog_path_table_unref(&paths, slot->path);
 }
 
-static int prelog_is_forbidden_file(const char *file)
+// Forgets an fd closed behind close()'s back, before the kernel can hand
+// its number out again: streams close theirs, dup2 replaces its target.
+// Streams get the I/O done on their fd in io.
+static void prelog_fd_untrack (int fd, PrelogFdIo *io)
 {
-  if(!file)
-    return 1;
+  if(!prelog_fd_table_contains(&fds, fd) && !prelog_fd_table_contains(&dirfds, fd)
+     && !prelog_fd_table_contains(&streams, fd))
+    return;
 
-  const char *home = getenv("HOME");
-  if(!home)
-    home = "/usr";
-  
-  char *banned[] = {
-    PRELOG_TARGET_DIR,
-    ".cache/",
-    NULL
-  };
-
-  int forbidden = 0, i;
-  for (i=0; banned[i] && !forbidden; ++i) {
-    size_t len = strlen(home) + 1 + strlen(banned[i]) + 1;
-    char *full_path = malloc (sizeof (char) * len);
-    if (full_path) {
-      snprintf (full_path, len, "%s/%s", home, banned[i]);
-      forbidden |= prelog_starts_with(file, full_path);
-      free (full_path);
-    }
-  }
+  pthread_mutex_lock(&_prelog_fd_lock);
+  prelog_fd_forget(&fds, fd, io);
+  prelog_fd_forget(&dirfds, fd, NULL);
+  prelog_fd_forget(&streams, fd, io);
+  pthread_mutex_unlock(&_prelog_fd_lock);
+}
+
+// Appends the I/O summary of a closed fd or stream to text, if it did any
+static void prelog_io_summary(char *text, size_t len, const PrelogFdIo *io)
+{
+  size_t used = strlen(text);
+  if (!io || !(io->calls[PRELOG_FD_IO_READ] || io->calls[PRELOG_FD_IO_WRITE]) || used >= len)
+    return;
 
-  return forbidden;
+  snprintf (text + used, len - used, ", read %llu B in %llu calls, wrote %llu B in %llu calls",
+            (unsigned long long) io->bytes[PRELOG_FD_IO_READ], (unsigned long long) io->calls[PRELOG_FD_IO_READ],
+            (unsigned long long) io->bytes[PRELOG_FD_IO_WRITE], (unsigned long long) io->calls[PRELOG_FD_IO_WRITE]);
 }
 
-static int prelog_is_home(const char *file)
+/* Directory fds keep the path they were opened with whether or not their
+ * open got logged, since the files opened relative to them might be. They
+ * are the origin of *at calls, and the cwd after an fchdir. */
+static void prelog_dirfd_track(int fd, const char *file, int dirfd)
 {
-  return (file && file[0]=='/' && file[1]=='h' && file[2]=='o' && file[3]=='m' && file[4]=='e' && file[5]=='/');
+  char origin_buf[PATH_MAX];
+  const char *origin = prelog_get_origin(file, dirfd, origin_buf, sizeof(origin_buf));
+
+  pthread_mutex_lock(&_prelog_fd_lock);
+  prelog_fd_track(&dirfds, fd, O_DIRECTORY, prelog_path_intern(file, origin));
+  pthread_mutex_unlock(&_prelog_fd_lock);
 }
 
-static int prelog_is_tmp(const char *file)
+// Call with _prelog_fd_lock held. Writes the path of id to buf, or name if
+// it has none, and returns the origin to log it with.
+static const char *prelog_path_copy(uint32_t id, const char *name, char *buf, char *origin_buf, size_t len)
 {
-  return (file && file[0]=='/' && file[1]=='t' && file[2]=='m' && file[3]=='p' && file[4]=='/');
+  const char *path = prelog_path_table_get(&paths, id);
+  snprintf(buf, len, "%s", path ? path : name);
+  return path ? NULL : prelog_get_origin(name, -1, origin_buf, len);
 }
 
-static int prelog_is_relative(const char *file)
+// Tracks a stream opened on fd under the path of fd, which gets written to
+// buf as with prelog_path_copy
+static const char *prelog_fd_stream_add(PrelogPtrSet *set, const void *stream, int fd, char *buf, char *origin_buf, size_t len)
 {
-  return (file && file[0] != '\0' && file[0] != '/');
+  char name[PRELOG_NAME_LEN];
+  const char *origin = NULL;
+  if (buf)
+    snprintf (name, sizeof (name), "fd: %d", fd);
+
+  pthread_mutex_lock(&_prelog_fd_lock);
+  PrelogFdSlot *slot = prelog_fd_table_lookup(&fds, fd);
+  uint32_t id = slot ? slot->path : 0;
+  if (buf)
+    origin = prelog_path_copy(id, name, buf, origin_buf, len);
+  if (stream) {
+    prelog_path_table_ref(&paths, id);
+    if (!prelog_ptr_set_add(set, stream, id))
+      prelog_path_table_unref(&paths, id);
+  }
+  pthread_mutex_unlock(&_prelog_fd_lock);
+
+  return origin;
 }
 
 static int prelog_is_existent(const int ret)
@@ -211,35 +331,51 @@ static int prelog_is_open_for_writing(const int oflag)
   return oflag & (O_WRONLY | O_RDWR);
 }
 
-void prelog_open (const int ret, const char *interpretation, int creates, int dirfd, const char *file, int oflag)
+// ret is an fd to track, unless is_fd is 0 as for mkdir and mkfifo
+static void prelog_open_event (const int ret, const char *interpretation, int creates, int dirfd, const char *file, int oflag, int is_fd)
 {
   if (
-         (geteuid() >= 1000)                                                                     /* Limit the performance hit on service processes */
-      && (creates || prelog_is_existent (ret))                                                          /* Filter out vain searches in PATH and LD_LIBRARY_PATH */
-      && (prelog_is_open_for_writing (oflag) || prelog_is_home (file) || prelog_is_tmp (file) || prelog_is_relative (file) ) /* We don't care about /etc, /usr... */
-      && (!prelog_is_forbidden_file (file))                                                             /* Our log files in ~/.local/share/... are off-limits */
+         !(prelog_is_user_process())                                                             /* Limit the performance hit on service processes */
+      || !(creates || prelog_is_existent (ret))                                                         /* Filter out vain searches in PATH and LD_LIBRARY_PATH */
+     )
+    return;
+
+  if (is_fd && ret >= 0 && (oflag & O_DIRECTORY))
+    prelog_dirfd_track(ret, file, dirfd);
+
+  int classes = prelog_path_classify (file);
+  if (
+         (prelog_is_open_for_writing (oflag) || (classes & PRELOG_PATH_INCLUDED))               /* We don't care about /etc, /usr... */
+      && !(classes & PRELOG_PATH_EXCLUDED)                                                                 /* Our log files in ~/.local/share/... are off-limits */
      )
   {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
+    int err = errno;
+
+    // Fast calls in slow-call-only mode are still tracked, but not formatted
+    int skip = prelog_latency_skip();
+    if (skip && !(is_fd && ret >= 0))
+      return;
+
+    char open_txt[PRELOG_TEXT_LEN];
+    char origin_buf[PATH_MAX];
+    const char *origin = prelog_get_origin(file, dirfd, origin_buf, sizeof(origin_buf));
+    if (!skip) {
+      snprintf (open_txt, sizeof (open_txt), "fd %d: with flag %d, e%d", ret, oflag, (ret<0? err:0));
+      prelog_log_event_at(open_txt, file, origin, interpretation);
     }
-
-    size_t len = 24 /* oflag and ret */ + 200 /* snprintf format string + some extra for safety */ + 1024 /* error_str string */;
-    char *open_txt = malloc (sizeof (char) * len);
-    if (open_txt) {
-      snprintf (open_txt, len, "fd %d: with flag %d, %s", ret, oflag, (ret<0? error_str:"e0"));
-      prelog_log_event(open_txt, file, dirfd, interpretation);
-      free (open_txt);
+    if (is_fd && ret >= 0) {
+      pthread_mutex_lock(&_prelog_fd_lock);
+      prelog_fd_track(&fds, ret, oflag, prelog_path_intern(file, origin));
+      pthread_mutex_unlock(&_prelog_fd_lock);
     }
-    pthread_mutex_lock(&_prelog_fd_lock);
-    fds = prelog_slist_prepend(fds, PRELOG_INT_TO_POINTER(ret));
-    pthread_mutex_unlock(&_prelog_fd_lock);
   }
 }
 
+void prelog_open (const int ret, const char *interpretation, int creates, int dirfd, const char *file, int oflag)
+{
+  prelog_open_event (ret, interpretation, creates, dirfd, file, oflag, 1);
+}
+
 int open (const char *file, int oflag, ...)
 {
   va_list list;
@@ -247,8 +383,10 @@ int open (const char *file, int oflag, ...)
   mode_t momo = va_arg(list, int);
   va_end(list);
 
-  typeof(open) *original_open = dlsym(RTLD_NEXT, "open");
+  typeof(open) *original_open = PRELOG_ORIGINAL(open);
+  prelog_clock_stamp();
   int ret = (*original_open)(file, oflag, momo);
+  PRELOG_LATENCY_DONE(OPEN_SCI);
   int saved_errno = errno;
   prelog_open(ret, OPEN_SCI, O_CREAT & oflag, -1, file, oflag);
   errno = saved_errno;
@@ -262,8 +400,10 @@ int open64 (const char *file, int oflag, ...)
   mode_t momo = va_arg(list, int);
   va_end(list);
 
-  typeof(open64) *original_open = dlsym(RTLD_NEXT, "open64");
+  typeof(open64) *original_open = PRELOG_ORIGINAL(open64);
+  prelog_clock_stamp();
   int ret = (*original_open)(file, oflag, momo);
+  PRELOG_LATENCY_DONE(OPEN64_SCI);
   int saved_errno = errno;
    prelog_open(ret, OPEN64_SCI, O_CREAT & oflag, -1, file, oflag | O_LARGEFILE);
   errno = saved_errno;
@@ -277,8 +417,10 @@ int openat (int dirfd, const char *file, int oflag, ...)
   mode_t momo = va_arg(list, int);
   va_end(list);
 
-  typeof(openat) *original_open = dlsym(RTLD_NEXT, "openat");
+  typeof(openat) *original_open = PRELOG_ORIGINAL(openat);
+  prelog_clock_stamp();
   int ret = (*original_open)(dirfd, file, oflag, momo);
+  PRELOG_LATENCY_DONE(OPENAT_SCI);
   int saved_errno = errno;
   prelog_open(ret, OPENAT_SCI, O_CREAT & oflag, dirfd, file, oflag);
   errno = saved_errno;
@@ -292,8 +434,10 @@ int openat64 (int dirfd, const char *file, int oflag, ...)
   mode_t momo = va_arg(list, int);
   va_end(list);
 
-  typeof(openat64) *original_open = dlsym(RTLD_NEXT, "openat64");
+  typeof(openat64) *original_open = PRELOG_ORIGINAL(openat64);
+  prelog_clock_stamp();
   int ret = (*original_open)(dirfd, file, oflag, momo);
+  PRELOG_LATENCY_DONE(OPENAT64_SCI);
   int saved_errno = errno;
   prelog_open(ret, OPENAT64_SCI, O_CREAT & oflag, dirfd, file, oflag | O_LARGEFILE);
   errno = saved_errno;
@@ -302,8 +446,10 @@ int openat64 (int dirfd, const char *file, int oflag, ...)
 
 int creat (const char *pathname, mode_t mode)
 {
-  typeof(creat) *original_open = dlsym(RTLD_NEXT, "creat");
+  typeof(creat) *original_open = PRELOG_ORIGINAL(creat);
+  prelog_clock_stamp();
   int ret = (*original_open)(pathname, mode);
+  PRELOG_LATENCY_DONE(CREAT_SCI);
   int saved_errno = errno;
   prelog_open(ret, CREAT_SCI, 1, -1, pathname, O_CREAT|O_WRONLY|O_TRUNC);
   errno = saved_errno;
@@ -314,34 +460,73 @@ int creat (const char *pathname, mode_t mode)
 
 
 
+// The new fd shares the path of the old one, and dup3 only adds O_CLOEXEC
 void prelog_dup (const int ret, const char *interpretation, int oldfd, int newfd, mode_t mode)
 {
-  pthread_mutex_lock(&_prelog_fd_lock);
-  if(prelog_slist_find(fds, PRELOG_INT_TO_POINTER(oldfd))) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) { //FIXME: errno is tampered with by pthread_mutex_lock, must be saved.
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
+  if(prelog_fd_table_contains(&fds, oldfd)) {
+    int err = errno;
+
+    char name[PRELOG_NAME_LEN], new_name[PRELOG_NAME_LEN];
+    char path[PATH_MAX], origin_buf[PATH_MAX];
+    char old_txt[PRELOG_TEXT_LEN];
+    char dup_txt[PRELOG_TEXT_LEN];
+    const char *origin = NULL;
+    int known = 0;
+    // Fast calls in slow-call-only mode are still tracked, but not formatted
+    int skip = prelog_latency_skip();
+    if (!skip) {
+      snprintf (name, sizeof (name), "fd: %d", oldfd);
+      snprintf (new_name, sizeof (new_name), "fd: %d", newfd);
+      snprintf (path, sizeof (path), "%s", name);
     }
 
-    size_t plen = 40, dup_len = 200+1024;
-    char *oldpath = malloc (sizeof(char)*plen), *newpath = malloc (sizeof(char)*plen), *dup_txt = malloc (sizeof(char)*dup_len);
-    snprintf (oldpath, plen, "fd: %d", oldfd);
-    snprintf (newpath, plen, "fd: %d", newfd);
-    snprintf (dup_txt, dup_len, "New fd: %s", (ret? error_str:"e0"));
-    prelog_log_old_new_event ("Old fd", oldpath, -1, dup_txt, newpath, -1, interpretation);
-    free (oldpath);
-    free (newpath);
-    free (dup_txt);
+    pthread_mutex_lock(&_prelog_fd_lock);
+    PrelogFdSlot *slot = prelog_fd_table_lookup(&fds, oldfd);
+    if (slot) {
+      uint32_t id = slot->path;
+      int oflag = (slot->oflag & ~O_CLOEXEC) | (mode & O_CLOEXEC);
+      if (!skip) {
+        origin = prelog_path_copy(id, name, path, origin_buf, sizeof(path));
+        known = prelog_path_table_get(&paths, id) != NULL;
+      }
+      if (ret >= 0 && ret != oldfd) {
+        prelog_path_table_ref(&paths, id);
+        prelog_fd_track(&fds, ret, oflag, id);
+      }
+    }
+    pthread_mutex_unlock(&_prelog_fd_lock);
+    if (skip)
+      return;
+
+    snprintf (old_txt, sizeof (old_txt), "Old fd %d", oldfd);
+    snprintf (dup_txt, sizeof (dup_txt), "New fd %d: e%d", newfd, (ret<0? err:0));
+    // Both share the cwd as their origin when they have no path
+    prelog_log_old_new_event_at (old_txt, path, origin, dup_txt, known ? path : new_name, origin, interpretation);
+  } else if (ret >= 0) {
+    // dup2 and dup3 closed a tracked fd to replace it with one we ignore
+    prelog_fd_untrack(ret, NULL);
+  }
+
+  // A copy of a directory fd stands for the same directory
+  if (ret >= 0 && ret != oldfd
+      && (prelog_fd_table_contains(&dirfds, oldfd) || prelog_fd_table_contains(&dirfds, ret))) {
+    pthread_mutex_lock(&_prelog_fd_lock);
+    PrelogFdSlot *slot = prelog_fd_table_lookup(&dirfds, oldfd);
+    if (slot) {
+      prelog_path_table_ref(&paths, slot->path);
+      prelog_fd_track(&dirfds, ret, slot->oflag, slot->path);
+    } else
+      prelog_fd_forget(&dirfds, ret, NULL);
+    pthread_mutex_unlock(&_prelog_fd_lock);
   }
-  pthread_mutex_unlock(&_prelog_fd_lock);
 }
 
 int dup(int oldfd)
 {
-  typeof(dup) *original_dup = dlsym(RTLD_NEXT, "dup");
+  typeof(dup) *original_dup = PRELOG_ORIGINAL(dup);
+  prelog_clock_stamp();
   int ret = (*original_dup)(oldfd);
+  PRELOG_LATENCY_DONE(DUP_SCI);
   int saved_errno = errno;
 
   int newfd = ret;
@@ -353,8 +538,10 @@ int dup(int oldfd)
 
 int dup2(int oldfd, int newfd)
 {
-  typeof(dup2) *original_dup = dlsym(RTLD_NEXT, "dup2");
+  typeof(dup2) *original_dup = PRELOG_ORIGINAL(dup2);
+  prelog_clock_stamp();
   int ret = (*original_dup)(oldfd, newfd);
+  PRELOG_LATENCY_DONE(DUP2_SCI);
   int saved_errno = errno;
   prelog_dup (ret, DUP2_SCI, oldfd, newfd, 0);
 
@@ -364,8 +551,10 @@ int dup2(int oldfd, int newfd)
 
 int dup3(int oldfd, int newfd, int flags)
 {
-  typeof(dup3) *original_dup = dlsym(RTLD_NEXT, "dup3");
+  typeof(dup3) *original_dup = PRELOG_ORIGINAL(dup3);
+  prelog_clock_stamp();
   int ret = (*original_dup)(oldfd, newfd, flags);
+  PRELOG_LATENCY_DONE(DUP3_SCI);
   int saved_errno = errno;
   prelog_dup (ret, DUP3_SCI, oldfd, newfd, flags);
 
@@ -378,30 +567,26 @@ void prelog_link (const int ret, const char *interpretation,
             const char *newpath, const int newdirfd, int flags)
 {
   if (
-         (geteuid() >= 1000)                                               /* Limit the performance hit on service processes */
-      && (prelog_is_home (oldpath) || prelog_is_tmp (oldpath) || prelog_is_relative (oldpath) ||
-          prelog_is_home (newpath) || prelog_is_tmp (newpath) || prelog_is_relative (newpath))  /* We don't care about /etc, /usr... */
+         (prelog_is_user_process())                                        /* Limit the performance hit on service processes */
+      && ((prelog_path_classify (oldpath) | prelog_path_classify (newpath)) & PRELOG_PATH_INCLUDED)  /* We don't care about /etc, /usr... */
      )
   {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+    int err = errno;
+    if (prelog_latency_skip())
+      return;
 
-    size_t new_len = 200+1024;
-    char *new_txt = malloc (sizeof(char)*new_len);
-    snprintf (new_txt, new_len, "with flag %d, %s", flags, (ret<0? error_str:"e0"));
+    char new_txt[PRELOG_TEXT_LEN];
+    snprintf (new_txt, sizeof (new_txt), "with flag %d, e%d", flags, (ret<0? err:0));
     prelog_log_old_new_event ("", oldpath, olddirfd, new_txt, newpath, newdirfd, interpretation);
-    free (new_txt);
   }
 }
 
 int link(const char *oldpath, const char *newpath)
 {
-  typeof(link) *original_link = dlsym(RTLD_NEXT, "link");
+  typeof(link) *original_link = PRELOG_ORIGINAL(link);
+  prelog_clock_stamp();
   int ret = (*original_link)(oldpath, newpath);
+  PRELOG_LATENCY_DONE(LINK_SCI);
   int saved_errno = errno;
   prelog_link (ret, LINK_SCI, oldpath, -1, newpath, -1, 0);
   errno = saved_errno;
@@ -411,8 +596,10 @@ int link(const char *oldpath, const char *newpath)
 int linkat(int olddirfd, const char *oldpath,
            int newdirfd, const char *newpath, int flags)
 {
-  typeof(linkat) *original_link = dlsym(RTLD_NEXT, "linkat");
+  typeof(linkat) *original_link = PRELOG_ORIGINAL(linkat);
+  prelog_clock_stamp();
   int ret = (*original_link)(olddirfd, oldpath, newdirfd, newpath, flags);
+  PRELOG_LATENCY_DONE(LINKAT_SCI);
   int saved_errno = errno;
   prelog_link (ret, LINKAT_SCI, oldpath, -1, newpath, -1, flags);
   errno = saved_errno;
@@ -421,8 +608,10 @@ int linkat(int olddirfd, const char *oldpath,
 
 int symlink(const char *target, const char *newpath)
 {
-  typeof(symlink) *original_symlink = dlsym(RTLD_NEXT, "symlink");
+  typeof(symlink) *original_symlink = PRELOG_ORIGINAL(symlink);
+  prelog_clock_stamp();
   int ret = (*original_symlink)(target, newpath);
+  PRELOG_LATENCY_DONE(SYMLINK_SCI);
   int saved_errno = errno;
   prelog_link (ret, SYMLINK_SCI, target, -1, newpath, -1, 0);
   errno = saved_errno;
@@ -431,8 +620,10 @@ int symlink(const char *target, const char *newpath)
 
 int symlinkat(const char *target, int newdirfd, const char *linkpath)
 {
-  typeof(symlinkat) *original_symlink = dlsym(RTLD_NEXT, "symlinkat");
+  typeof(symlinkat) *original_symlink = PRELOG_ORIGINAL(symlinkat);
+  prelog_clock_stamp();
   int ret = (*original_symlink)(target, newdirfd, linkpath);
+  PRELOG_LATENCY_DONE(SYMLINKAT_SCI);
   int saved_errno = errno;
   prelog_link (ret, SYMLINKAT_SCI, target, -1, linkpath, newdirfd, 0);
   errno = saved_errno;
@@ -469,35 +660,46 @@ static void prelog_fopen(FILE *ret, const char *path, const char *mode, const ch
 {
   int flag = prelog_translate_fopen_mode(mode);
 
-  if((geteuid() >= 1000) 
-     && (is_command || ((prelog_is_open_for_writing (flag) || prelog_is_home (path) || prelog_is_tmp (path) || prelog_is_relative (path))
-                        && !prelog_is_forbidden_file (path) )
-        )
+  if (!prelog_is_user_process())
+    return;
+
+  int classes = is_command ? 0 : prelog_path_classify (path);
+  if (is_command || ((prelog_is_open_for_writing (flag) || (classes & PRELOG_PATH_INCLUDED))
+                     && !(classes & PRELOG_PATH_EXCLUDED))
     ) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+    int err = errno;
+
+    // Fast calls in slow-call-only mode are still tracked, but not formatted
+    int skip = prelog_latency_skip();
+    if (skip && !ret)
+      return;
 
-    size_t len = 12 /* flag */ + 200 /* snprintf format string + some extra for safety */ + 1024 /* error_str string */;
-    char *open_txt = malloc (sizeof (char) * len);
-    if (open_txt) {
-      snprintf (open_txt, len, "FILE %p: with flag %d, %s", ret, flag, (ret? "e0":error_str));
+    char open_txt[PRELOG_TEXT_LEN];
+    char origin_buf[PATH_MAX];
+    const char *origin = skip && is_command ? NULL : prelog_get_origin(path, -1, origin_buf, sizeof(origin_buf));
+    if (ret) {
       pthread_mutex_lock(&_prelog_fd_lock);
-      files = prelog_slist_prepend(files, ret);
+      // Commands are kept as they are
+      uint32_t id = prelog_path_intern(path, is_command ? NULL : origin);
+      if (!prelog_ptr_set_add(&files, ret, id))
+        prelog_path_table_unref(&paths, id);
+      else
+        prelog_fd_track(&streams, fileno(ret), flag, 0);
       pthread_mutex_unlock(&_prelog_fd_lock);
-      prelog_log_event(open_txt, path, -1, interpretation);
-      free (open_txt);
+    }
+    if (!skip) {
+      snprintf (open_txt, sizeof (open_txt), "FILE %p: with flag %d, e%d", ret, flag, (ret? 0:err));
+      prelog_log_event_at(open_txt, path, origin, interpretation);
     }
   }
 }
 
 FILE *fopen(const char *path, const char *mode)
 {
-  typeof(fopen) *original_open = dlsym(RTLD_NEXT, "fopen");
+  typeof(fopen) *original_open = PRELOG_ORIGINAL(fopen);
+  prelog_clock_stamp();
   FILE *ret = (*original_open)(path, mode);
+  PRELOG_LATENCY_DONE(FOPEN_SCI);
   int saved_errno = errno;
   prelog_fopen (ret, path, mode, FOPEN_SCI, 0);
   errno = saved_errno;
@@ -506,8 +708,10 @@ FILE *fopen(const char *path, const char *mode)
 
 FILE *freopen(const char *path, const char *mode, FILE *stream)
 {
-  typeof(freopen) *original_open = dlsym(RTLD_NEXT, "freopen");
+  typeof(freopen) *original_open = PRELOG_ORIGINAL(freopen);
+  prelog_clock_stamp();
   FILE *ret = (*original_open)(path, mode, stream);
+  PRELOG_LATENCY_DONE(FREOPEN_SCI);
   int saved_errno = errno;
   prelog_fopen (ret, path, mode, FREOPEN_SCI, 0);
   errno = saved_errno;
@@ -516,37 +720,35 @@ FILE *freopen(const char *path, const char *mode, FILE *stream)
 
 FILE *fdopen(int fd, const char *mode)
 {
-  typeof(fdopen) *original_open = dlsym(RTLD_NEXT, "fdopen");
+  typeof(fdopen) *original_open = PRELOG_ORIGINAL(fdopen);
+  prelog_clock_stamp();
   FILE *ret = (*original_open)(fd, mode);
+  PRELOG_LATENCY_DONE(FDOPEN_SCI);
   int saved_errno = errno;
-  pthread_mutex_lock(&_prelog_fd_lock);
-  if(prelog_slist_find(fds, PRELOG_INT_TO_POINTER(fd))) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+  if(prelog_fd_table_contains(&fds, fd)) {
+    int err = errno;
 
     int flag = prelog_translate_fopen_mode(mode);
-
-    size_t len = 12 /* flag */ + 200 /* snprintf format string + some extra for safety */ + 1024 /* error_str string */;
-    size_t plen = 80;
-    char *open_txt = malloc (sizeof (char) * len);
-    char *file = malloc (sizeof(char)*plen);
-    char *old_fd = malloc (sizeof(char)*plen);
-    if (open_txt && file && old_fd) {
-      snprintf (old_fd, plen, "fd: %d", fd);
-      snprintf (file, plen, "FILE %p", ret);
-      snprintf (open_txt, len, "with flag %d, %s", flag, (ret? "e0":error_str));
-      files = prelog_slist_prepend(files, ret);
-      prelog_log_old_new_event ("", old_fd, -1, open_txt, file, -1, FDOPEN_SCI);
-      free (open_txt);
-      free (old_fd);
-      free (file);
+    // Fast calls in slow-call-only mode are still tracked, but not formatted
+    int skip = prelog_latency_skip();
+
+    char open_txt[PRELOG_TEXT_LEN];
+    char file[PRELOG_NAME_LEN];
+    char fd_txt[PRELOG_NAME_LEN];
+    char old_fd[PATH_MAX], origin_buf[PATH_MAX];
+    const char *origin = prelog_fd_stream_add(&files, ret, fd, skip ? NULL : old_fd, origin_buf, sizeof(old_fd));
+    if (ret) {
+      pthread_mutex_lock(&_prelog_fd_lock);
+      prelog_fd_track(&streams, fd, flag, 0);
+      pthread_mutex_unlock(&_prelog_fd_lock);
+    }
+    if (!skip) {
+      snprintf (fd_txt, sizeof (fd_txt), "fd %d", fd);
+      snprintf (file, sizeof (file), "FILE %p", ret);
+      snprintf (open_txt, sizeof (open_txt), "with flag %d, e%d", flag, (ret? 0:err));
+      prelog_log_old_new_event_at (fd_txt, old_fd, origin, open_txt, file, NULL, FDOPEN_SCI);
     }
   }
-  pthread_mutex_unlock(&_prelog_fd_lock);
 
   errno = saved_errno;
   return ret;
@@ -554,20 +756,24 @@ FILE *fdopen(int fd, const char *mode)
 
 int mkfifo(const char *pathname, mode_t mode)
 {
-  typeof(mkfifo) *original_mkfifo = dlsym(RTLD_NEXT, "mkfifo");
+  typeof(mkfifo) *original_mkfifo = PRELOG_ORIGINAL(mkfifo);
+  prelog_clock_stamp();
   int ret = (*original_mkfifo)(pathname, mode);
+  PRELOG_LATENCY_DONE(MKFIFO_SCI);
   int saved_errno = errno;
-  prelog_open(ret, MKFIFO_SCI, 1, -1, pathname, 0);
+  prelog_open_event(ret, MKFIFO_SCI, 1, -1, pathname, 0, 0);
   errno = saved_errno;
   return ret;
 }
 
 int mkfifoat(int dirfd, const char *pathname, mode_t mode)
 {
-  typeof(mkfifoat) *original_mkfifo = dlsym(RTLD_NEXT, "mkfifoat");
+  typeof(mkfifoat) *original_mkfifo = PRELOG_ORIGINAL(mkfifoat);
+  prelog_clock_stamp();
   int ret = (*original_mkfifo)(dirfd, pathname, mode);
+  PRELOG_LATENCY_DONE(MKFIFOAT_SCI);
   int saved_errno = errno;
-  prelog_open(ret, MKFIFOAT_SCI, 1, dirfd, pathname, 0);
+  prelog_open_event(ret, MKFIFOAT_SCI, 1, dirfd, pathname, 0, 0);
   errno = saved_errno;
   return ret;
 }
@@ -577,28 +783,27 @@ void prelog_pipe(int ret, int pipefd[2], int flags, const char *interpretation)
   if (!ret) // don't fool around with a potentially NULL pipefd, we don't care about the types of errors that might occur anyway
     return;
 
-  if ((geteuid() >= 1000)) {
-    size_t len = 50;
-    char *p0_txt = malloc (sizeof (char) * len);
-    char *p1_txt = malloc (sizeof (char) * len);
-    if (p0_txt && p1_txt) {
-      snprintf (p0_txt, len, "read fd %d", pipefd[0]);
-      snprintf (p1_txt, len, "write fd %d", pipefd[1]);
+  if ((prelog_is_user_process())) {
+    if (!prelog_latency_skip()) {
+      char p0_txt[PRELOG_NAME_LEN];
+      char p1_txt[PRELOG_NAME_LEN];
+      snprintf (p0_txt, sizeof (p0_txt), "read fd %d", pipefd[0]);
+      snprintf (p1_txt, sizeof (p1_txt), "write fd %d", pipefd[1]);
       prelog_log_old_new_event("", p0_txt, -1, "", p1_txt, -1, interpretation);
-      free (p0_txt);
-      free (p1_txt);
     }
     pthread_mutex_lock(&_prelog_fd_lock);
-    fds = prelog_slist_prepend(fds, PRELOG_INT_TO_POINTER(pipefd[0]));
-    fds = prelog_slist_prepend(fds, PRELOG_INT_TO_POINTER(pipefd[1]));
+    prelog_fd_track(&fds, pipefd[0], O_RDONLY | flags, 0);
+    prelog_fd_track(&fds, pipefd[1], O_WRONLY | flags, 0);
     pthread_mutex_unlock(&_prelog_fd_lock);
   }
 }
 
 int pipe2(int pipefd[2], int flags)
 {
-  typeof(pipe2) *original_pipe2 = dlsym(RTLD_NEXT, "pipe2");
+  typeof(pipe2) *original_pipe2 = PRELOG_ORIGINAL(pipe2);
+  prelog_clock_stamp();
   int ret = (*original_pipe2)(pipefd, flags);
+  PRELOG_LATENCY_DONE(PIPE2_SCI);
   int saved_errno = errno;
   prelog_pipe(ret, pipefd, flags, PIPE2_SCI);
   errno = saved_errno;
@@ -607,8 +812,10 @@ int pipe2(int pipefd[2], int flags)
 
 int pipe(int pipefd[2])
 {
-  typeof(pipe) *original_pipe = dlsym(RTLD_NEXT, "pipe");
+  typeof(pipe) *original_pipe = PRELOG_ORIGINAL(pipe);
+  prelog_clock_stamp();
   int ret = (*original_pipe)(pipefd);
+  PRELOG_LATENCY_DONE(PIPE_SCI);
   int saved_errno = errno;
   prelog_pipe(ret, pipefd, 0, PIPE_SCI);
   errno = saved_errno;
@@ -617,32 +824,25 @@ int pipe(int pipefd[2])
 
 int socketpair(int domain, int type, int protocol, int sv[2])
 {
-  typeof(socketpair) *original_socket = dlsym(RTLD_NEXT, "socketpair");
+  typeof(socketpair) *original_socket = PRELOG_ORIGINAL(socketpair);
+  prelog_clock_stamp();
   int ret = (*original_socket)(domain, type, protocol, sv);
+  PRELOG_LATENCY_DONE(SOCKETPAIR_SCI);
   int saved_errno = errno;
 
-  if ((geteuid() >= 1000) && (domain == AF_UNIX || domain == AF_LOCAL) && (errno!=EFAULT)) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+  if ((prelog_is_user_process()) && (domain == AF_UNIX || domain == AF_LOCAL) && (errno!=EFAULT)) {
+    int err = errno;
     
-    size_t len = 50;
-    size_t txtlen = 600 + 1024 /* error_str string */;
-    char *p0_txt = malloc (sizeof (char) * len);
-    char *open_txt = malloc (sizeof (char) * txtlen);
-    if (p0_txt && open_txt) {
-      snprintf (p0_txt, len, "socket %d", sv[0]);
-      snprintf (open_txt, txtlen, "socket %d: with domain %d, type %d, protocol %d, %s", sv[1], domain, type, protocol, (ret<0? error_str:"e0"));
+    if (!prelog_latency_skip()) {
+      char p0_txt[PRELOG_NAME_LEN];
+      char open_txt[PRELOG_TEXT_LEN];
+      snprintf (p0_txt, sizeof (p0_txt), "socket %d", sv[0]);
+      snprintf (open_txt, sizeof (open_txt), "socket %d: with domain %d, type %d, protocol %d, e%d", sv[1], domain, type, protocol, (ret<0? err:0));
       prelog_log_old_new_event("", p0_txt, -1, "", open_txt, -1, SOCKETPAIR_SCI);
-      free (p0_txt);
-      free (open_txt);
     }
     pthread_mutex_lock(&_prelog_fd_lock);
-    fds = prelog_slist_prepend(fds, PRELOG_INT_TO_POINTER(sv[0]));
-    fds = prelog_slist_prepend(fds, PRELOG_INT_TO_POINTER(sv[1]));
+    prelog_fd_track(&fds, sv[0], O_RDWR, 0);
+    prelog_fd_track(&fds, sv[1], O_RDWR, 0);
     pthread_mutex_unlock(&_prelog_fd_lock);
   }
 
@@ -652,8 +852,10 @@ int socketpair(int domain, int type, int protocol, int sv[2])
 
 FILE *popen(const char *command, const char *type)
 {
-  typeof(popen) *original_open = dlsym(RTLD_NEXT, "popen");
+  typeof(popen) *original_open = PRELOG_ORIGINAL(popen);
+  prelog_clock_stamp();
   FILE *ret = (*original_open)(command, type);
+  PRELOG_LATENCY_DONE(POPEN_SCI);
   int saved_errno = errno;
   prelog_fopen (ret, command, type, POPEN_SCI, 1);
   errno = saved_errno;
@@ -662,64 +864,322 @@ FILE *popen(const char *command, const char *type)
 
 pid_t fork(void)
 {
-  typeof(fork) *original_fork = dlsym(RTLD_NEXT, "fork");
+  typeof(fork) *original_fork = PRELOG_ORIGINAL(fork);
+  prelog_clock_stamp();
   pid_t ret = (*original_fork)();
+  PRELOG_LATENCY_DONE(FORK_SCI);
   int saved_errno = errno;
 
-  // Reset the log for the child
-  if (ret == 0)
-  {
-    prelog_log_get_default(PRELOG_LOG_RESET_FORK);
-  }
-  else 
+  // The child was reset by prelog_fork_child
+  if (ret != 0 && !prelog_latency_skip())
   {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+    int err = errno;
     
-    size_t len = 24;
-    size_t txtlen = 100 + 1024 /* error_str string */;
-    char *pid_txt = malloc (sizeof (char) * len);
-    char *err_txt = malloc (sizeof (char) * txtlen);
-    if (pid_txt && err_txt) {
-      snprintf (pid_txt, len, "pid %d", ret);
-      snprintf (err_txt, txtlen, "%s", (ret<0? error_str:"e0"));
-      prelog_log_event(err_txt, pid_txt, -1, FORK_SCI);
-      free (pid_txt);
-      free (err_txt);
-    }
+    char pid_txt[PRELOG_NAME_LEN];
+    char err_txt[PRELOG_TEXT_LEN];
+    snprintf (pid_txt, sizeof (pid_txt), "pid %d", ret);
+    snprintf (err_txt, sizeof (err_txt), "e%d", (ret<0? err:0));
+    prelog_log_event(err_txt, pid_txt, -1, FORK_SCI);
   }
 
   errno = saved_errno;
   return ret;
 }
 
+/* Lineage of process images. exec replaces the image without running its
+ * exit handlers, so before the real call we log where it goes and write out
+ * pending records, see prelog_writer_sync. The old image is the subject we
+ * leave, the new one the path being run, and its text holds a digest of argv
+ * that reads the same as one of /proc/<pid>/cmdline, which the next image's
+ * log header shows along with the same pid. Images without a log of their
+ * own, like shells that exec right after forking, skip all of it: the fork
+ * event in the parent and the pid in the next header already link them. */
+static uint64_t prelog_argv_digest(char *const argv[], int *argc)
+{
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  int i;
+
+  for (i = 0; argv && argv[i]; ++i) {
+    const unsigned char *p = (const unsigned char *) argv[i];
+    do {
+      hash ^= *p;
+      hash *= 1099511628211ULL;
+    } while (*p++);
+  }
+
+  *argc = i;
+  return hash;
+}
+
+// dirfd is -1 for the cwd, -2 for files that have no origin
+static const char *prelog_exec_origin(const char *file, int dirfd, char *buf, size_t len)
+{
+  return dirfd == -2 ? NULL : prelog_get_origin(file, dirfd, buf, len);
+}
+
+static void prelog_exec_begin(const char *interpretation, const char *file, int dirfd, char *const argv[])
+{
+  if (!prelog_is_user_process())
+    return;
+
+  // The new image will not run our exit handler for this one
+  PrelogLog *log = prelog_log_get_default(PRELOG_LOG_DONT_RESET);
+  if (!prelog_log_is_open(log)) {
+    prelog_log_count_unlogged();
+    return;
+  }
+
+  char image[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", image, sizeof(image) - 1);
+  if (len < 0)
+    len = 0;
+  image[len] = '\0';
+
+  char pid_txt[PRELOG_NAME_LEN];
+  char argv_txt[PRELOG_TEXT_LEN];
+  char origin_buf[PATH_MAX];
+  int argc;
+  uint64_t digest = prelog_argv_digest(argv, &argc);
+  snprintf (pid_txt, sizeof (pid_txt), "pid %d", getpid());
+  snprintf (argv_txt, sizeof (argv_txt), "argv %016llx, %d args", (unsigned long long) digest, argc);
+  const char *origin = prelog_exec_origin(file, dirfd, origin_buf, sizeof(origin_buf));
+
+  PrelogSubject old_subject, new_subject;
+  prelog_subject_init (&old_subject, image, pid_txt, NULL);
+  prelog_subject_init (&new_subject, file, argv_txt, origin);
+  PrelogSubject *subjects[] = { &old_subject, &new_subject, NULL };
+
+  prelog_log_insert(log, prelog_clock_stamped(), interpretation, subjects);
+  prelog_latency_flush(log, 0);
+  prelog_writer_sync(log);
+}
+
+// exec only returns when it failed, the image goes on and says why
+static void prelog_exec_failed(const char *interpretation, const char *file, int dirfd)
+{
+  int err = errno;
+  PrelogLog *log = prelog_is_user_process() ? prelog_log_get_default(PRELOG_LOG_DONT_RESET) : NULL;
+
+  if (prelog_log_is_open(log)) {
+    char err_txt[PRELOG_TEXT_LEN];
+    char origin_buf[PATH_MAX];
+    snprintf (err_txt, sizeof (err_txt), "e%d", err);
+
+    PrelogSubject subject;
+    prelog_subject_init (&subject, file, err_txt, prelog_exec_origin(file, dirfd, origin_buf, sizeof(origin_buf)));
+    PrelogSubject *subjects[] = { &subject, NULL };
+    prelog_log_insert(log, prelog_clock_stamped(), interpretation, subjects);
+  }
+
+  errno = err;
+}
+
+// $PATH is searched for files without a slash, their origin is not the cwd
+static int prelog_exec_dirfd(const char *file)
+{
+  return strchr(file, '/') ? -1 : -2;
+}
+
+int execve(const char *path, char *const argv[], char *const envp[])
+{
+  typeof(execve) *original_execve = PRELOG_ORIGINAL(execve);
+  prelog_clock_stamp();
+  prelog_exec_begin(EXECVE_SCI, path, -1, argv);
+  int ret = (*original_execve)(path, argv, envp);
+  prelog_exec_failed(EXECVE_SCI, path, -1);
+  return ret;
+}
+
+int execv(const char *path, char *const argv[])
+{
+  typeof(execv) *original_execv = PRELOG_ORIGINAL(execv);
+  prelog_clock_stamp();
+  prelog_exec_begin(EXECV_SCI, path, -1, argv);
+  int ret = (*original_execv)(path, argv);
+  prelog_exec_failed(EXECV_SCI, path, -1);
+  return ret;
+}
+
+int execvp(const char *file, char *const argv[])
+{
+  typeof(execvp) *original_execvp = PRELOG_ORIGINAL(execvp);
+  prelog_clock_stamp();
+  prelog_exec_begin(EXECVP_SCI, file, prelog_exec_dirfd(file), argv);
+  int ret = (*original_execvp)(file, argv);
+  prelog_exec_failed(EXECVP_SCI, file, prelog_exec_dirfd(file));
+  return ret;
+}
+
+int execvpe(const char *file, char *const argv[], char *const envp[])
+{
+  typeof(execvpe) *original_execvpe = PRELOG_ORIGINAL(execvpe);
+  prelog_clock_stamp();
+  prelog_exec_begin(EXECVPE_SCI, file, prelog_exec_dirfd(file), argv);
+  int ret = (*original_execvpe)(file, argv, envp);
+  prelog_exec_failed(EXECVPE_SCI, file, prelog_exec_dirfd(file));
+  return ret;
+}
+
+int fexecve(int fd, char *const argv[], char *const envp[])
+{
+  typeof(fexecve) *original_fexecve = PRELOG_ORIGINAL(fexecve);
+  char fd_txt[PRELOG_NAME_LEN];
+  snprintf (fd_txt, sizeof (fd_txt), "fd: %d", fd);
+  prelog_clock_stamp();
+  prelog_exec_begin(FEXECVE_SCI, fd_txt, -2, argv);
+  int ret = (*original_fexecve)(fd, argv, envp);
+  prelog_exec_failed(FEXECVE_SCI, fd_txt, -2);
+  return ret;
+}
+
+/* The execl family, which libc implements without going through our
+ * wrappers, is turned into its execv counterpart here the way libc does it:
+ * arguments are counted, then copied to an array on the stack. */
+#define PRELOG_EXECL_ARGV(argv, arg) \
+  va_list list; \
+  size_t argc = 1; \
+  va_start(list, arg); \
+  while (va_arg(list, char *)) \
+    argc++; \
+  va_end(list); \
+  char *argv[argc + 1]; \
+  argv[0] = (char *) arg; \
+  va_start(list, arg); \
+  for (size_t i = 1; i <= argc; ++i) \
+    argv[i] = va_arg(list, char *);
+
+int execl(const char *path, const char *arg, ...)
+{
+  PRELOG_EXECL_ARGV(argv, arg)
+  va_end(list);
+
+  typeof(execv) *original_execv = PRELOG_ORIGINAL(execv);
+  prelog_clock_stamp();
+  prelog_exec_begin(EXECL_SCI, path, -1, argv);
+  int ret = (*original_execv)(path, argv);
+  prelog_exec_failed(EXECL_SCI, path, -1);
+  return ret;
+}
+
+int execlp(const char *file, const char *arg, ...)
+{
+  PRELOG_EXECL_ARGV(argv, arg)
+  va_end(list);
+
+  typeof(execvp) *original_execvp = PRELOG_ORIGINAL(execvp);
+  prelog_clock_stamp();
+  prelog_exec_begin(EXECLP_SCI, file, prelog_exec_dirfd(file), argv);
+  int ret = (*original_execvp)(file, argv);
+  prelog_exec_failed(EXECLP_SCI, file, prelog_exec_dirfd(file));
+  return ret;
+}
+
+int execle(const char *path, const char *arg, ...)
+{
+  PRELOG_EXECL_ARGV(argv, arg)
+  char *const *envp = va_arg(list, char *const *);
+  va_end(list);
+
+  typeof(execve) *original_execve = PRELOG_ORIGINAL(execve);
+  prelog_clock_stamp();
+  prelog_exec_begin(EXECLE_SCI, path, -1, argv);
+  int ret = (*original_execve)(path, argv, envp);
+  prelog_exec_failed(EXECLE_SCI, path, -1);
+  return ret;
+}
+
+/* posix_spawn leaves this image running, so it is logged like fork, in the
+ * parent and after the call, with the new pid and the path it runs. */
+static void prelog_spawn(int ret, const pid_t *pid, const char *file, int dirfd, char *const argv[], const char *interpretation)
+{
+  if (!prelog_is_user_process())
+    return;
+
+  char spawn_txt[PRELOG_TEXT_LEN];
+  int argc;
+  uint64_t digest = prelog_argv_digest(argv, &argc);
+  snprintf (spawn_txt, sizeof (spawn_txt), "pid %d: argv %016llx, %d args, e%d",
+            (ret == 0 && pid) ? *pid : -1, (unsigned long long) digest, argc, ret);
+
+  PrelogLog *log = prelog_log_get_default(PRELOG_LOG_DONT_RESET);
+  if (!log) return;
+
+  char origin_buf[PATH_MAX];
+  const char *origin = prelog_exec_origin(file, dirfd, origin_buf, sizeof(origin_buf));
+
+  PrelogSubject subject;
+  prelog_subject_init (&subject, file, spawn_txt, origin);
+  PrelogSubject *subjects[] = { &subject, NULL };
+
+  prelog_log_insert(log, prelog_clock_stamped(), interpretation, subjects);
+}
+
+int posix_spawn(pid_t *pid, const char *path,
+                const posix_spawn_file_actions_t *file_actions,
+                const posix_spawnattr_t *attrp,
+                char *const argv[], char *const envp[])
+{
+  typeof(posix_spawn) *original_spawn = PRELOG_ORIGINAL(posix_spawn);
+  pid_t child;
+  prelog_clock_stamp();
+  int ret = (*original_spawn)(&child, path, file_actions, attrp, argv, envp);
+  PRELOG_LATENCY_DONE(POSIX_SPAWN_SCI);
+  int saved_errno = errno;
+  if (pid && ret == 0)
+    *pid = child;
+  prelog_spawn(ret, &child, path, -1, argv, POSIX_SPAWN_SCI);
+  errno = saved_errno;
+  return ret;
+}
+
+int posix_spawnp(pid_t *pid, const char *file,
+                 const posix_spawn_file_actions_t *file_actions,
+                 const posix_spawnattr_t *attrp,
+                 char *const argv[], char *const envp[])
+{
+  typeof(posix_spawnp) *original_spawn = PRELOG_ORIGINAL(posix_spawnp);
+  pid_t child;
+  prelog_clock_stamp();
+  int ret = (*original_spawn)(&child, file, file_actions, attrp, argv, envp);
+  PRELOG_LATENCY_DONE(POSIX_SPAWNP_SCI);
+  int saved_errno = errno;
+  if (pid && ret == 0)
+    *pid = child;
+  prelog_spawn(ret, &child, file, prelog_exec_dirfd(file), argv, POSIX_SPAWNP_SCI);
+  errno = saved_errno;
+  return ret;
+}
+
 DIR *opendir(const char *name)
 {
-  typeof(opendir) *original_open = dlsym(RTLD_NEXT, "opendir");
+  typeof(opendir) *original_open = PRELOG_ORIGINAL(opendir);
+  prelog_clock_stamp();
   DIR *ret = (*original_open)(name);
+  PRELOG_LATENCY_DONE(OPENDIR_SCI);
   int saved_errno = errno;
 
-  if((geteuid() >= 1000) && (prelog_is_home (name) || prelog_is_tmp (name) || prelog_is_relative (name))) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+  if (ret && prelog_is_user_process())
+    prelog_dirfd_track(dirfd(ret), name, -1);
+
+  if((prelog_is_user_process()) && (prelog_path_classify (name) & PRELOG_PATH_INCLUDED)) {
+    int err = errno;
 
-    size_t len = 12 /* flag */ + 200 /* snprintf format string + some extra for safety */ + 1024 /* error_str string */;
-    char *open_txt = malloc (sizeof (char) * len);
-    if (open_txt) {
-      snprintf (open_txt, len, "DIR %p: %s", ret, (ret? "e0":error_str));
+    // Fast calls in slow-call-only mode are still tracked, but not formatted
+    int skip = prelog_latency_skip();
+
+    char open_txt[PRELOG_TEXT_LEN];
+    char origin_buf[PATH_MAX];
+    const char *origin = skip && !ret ? NULL : prelog_get_origin(name, -1, origin_buf, sizeof(origin_buf));
+    if (ret) {
       pthread_mutex_lock(&_prelog_fd_lock);
-      dirs = prelog_slist_prepend(dirs, ret);
+      uint32_t id = prelog_path_intern(name, origin);
+      if (!prelog_ptr_set_add(&dirs, ret, id))
+        prelog_path_table_unref(&paths, id);
       pthread_mutex_unlock(&_prelog_fd_lock);
-      prelog_log_event(open_txt, name, -1, OPENDIR_SCI);
-      free (open_txt);
+    }
+    if (!skip) {
+      snprintf (open_txt, sizeof (open_txt), "DIR %p: e%d", ret, (ret? 0:err));
+      prelog_log_event_at(open_txt, name, origin, OPENDIR_SCI);
     }
   }
 
@@ -729,36 +1189,29 @@ DIR *opendir(const char *name)
 
 DIR *fdopendir(int fd)
 {
-  typeof(fdopendir) *original_open = dlsym(RTLD_NEXT, "fdopendir");
+  typeof(fdopendir) *original_open = PRELOG_ORIGINAL(fdopendir);
+  prelog_clock_stamp();
   DIR *ret = (*original_open)(fd);
+  PRELOG_LATENCY_DONE(FDOPENDIR_SCI);
   int saved_errno = errno;
 
-  pthread_mutex_lock(&_prelog_fd_lock);
-  if(prelog_slist_find(fds, PRELOG_INT_TO_POINTER(fd))) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
-
-    size_t len = 200 /* snprintf format string + some extra for safety */ + 1024 /* error_str string */;
-    size_t plen = 80;
-    char *open_txt = malloc (sizeof (char) * len);
-    char *file = malloc (sizeof(char)*plen);
-    char *old_fd = malloc (sizeof(char)*plen);
-    if (open_txt && file && old_fd) {
-      snprintf (old_fd, plen, "fd: %d", fd);
-      snprintf (file, plen, "DIR %p", ret);
-      snprintf (open_txt, len, "%s", (ret? "e0":error_str));
-      dirs = prelog_slist_prepend(dirs, ret);
-      prelog_log_old_new_event ("", old_fd, -1, open_txt, file, -1, FDOPENDIR_SCI);
-      free (open_txt);
-      free (old_fd);
-      free (file);
+  if(prelog_fd_table_contains(&fds, fd)) {
+    int err = errno;
+    // Fast calls in slow-call-only mode are still tracked, but not formatted
+    int skip = prelog_latency_skip();
+
+    char open_txt[PRELOG_TEXT_LEN];
+    char file[PRELOG_NAME_LEN];
+    char fd_txt[PRELOG_NAME_LEN];
+    char old_fd[PATH_MAX], origin_buf[PATH_MAX];
+    const char *origin = prelog_fd_stream_add(&dirs, ret, fd, skip ? NULL : old_fd, origin_buf, sizeof(old_fd));
+    if (!skip) {
+      snprintf (fd_txt, sizeof (fd_txt), "fd %d", fd);
+      snprintf (file, sizeof (file), "DIR %p", ret);
+      snprintf (open_txt, sizeof (open_txt), "e%d", (ret? 0:err));
+      prelog_log_old_new_event_at (fd_txt, old_fd, origin, open_txt, file, NULL, FDOPENDIR_SCI);
     }
   }
-  pthread_mutex_unlock(&_prelog_fd_lock);
 
   errno = saved_errno;
   return ret;
@@ -766,10 +1219,8 @@ DIR *fdopendir(int fd)
 
 int shm_open(const char *name, int oflag, mode_t mode)
 {
-  typeof(shm_open) *original_shm_open = dlsym(RTLD_NEXT, "shm_open");
-
-  if (!original_shm_open)
-    original_shm_open = dlsym(dlopen("librt.so", RTLD_NOW), "shm_open");
+  typeof(shm_open) *original_shm_open = prelog_original_shm_open();
+  prelog_clock_stamp();
 
   if (!original_shm_open)
   {
@@ -779,24 +1230,16 @@ int shm_open(const char *name, int oflag, mode_t mode)
   }
 
   int ret = (*original_shm_open)(name, oflag, mode);
+  PRELOG_LATENCY_DONE(SHM_OPEN_SCI);
   int saved_errno = errno;
 
-  if (geteuid() >= 1000)
+  if (prelog_is_user_process() && !prelog_latency_skip())
   {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+    int err = errno;
 
-    size_t len = 300 + 1024 /* error_str string */;
-    char *open_txt = malloc (sizeof (char) * len);
-    if (open_txt) {
-      snprintf (open_txt, len, "shm %d: with flag %d and mode %d: %s", ret, oflag, mode, (ret<0? error_str:"e0"));
-      prelog_log_event(open_txt, name, -1, SHM_OPEN_SCI);
-      free (open_txt);
-    }
+    char open_txt[PRELOG_TEXT_LEN];
+    snprintf (open_txt, sizeof (open_txt), "shm %d: with flag %d and mode %d: e%d", ret, oflag, mode, (ret<0? err:0));
+    prelog_log_event(open_txt, name, -1, SHM_OPEN_SCI);
   }
   
   errno = saved_errno;
@@ -805,10 +1248,8 @@ int shm_open(const char *name, int oflag, mode_t mode)
 
 int shm_unlink(const char *name)
 {
-  typeof(shm_unlink) *original_shm_unlink = dlsym(RTLD_NEXT, "shm_unlink");
-
-  if (!original_shm_unlink)
-    original_shm_unlink = dlsym(dlopen("librt.so", RTLD_NOW), "shm_unlink");
+  typeof(shm_unlink) *original_shm_unlink = prelog_original_shm_unlink();
+  prelog_clock_stamp();
 
   if (!original_shm_unlink)
   {
@@ -818,24 +1259,16 @@ int shm_unlink(const char *name)
   }
 
   int ret = (*original_shm_unlink)(name);
+  PRELOG_LATENCY_DONE(SHM_UNLINK_SCI);
   int saved_errno = errno;
 
-  if (geteuid() >= 1000)
+  if (prelog_is_user_process() && !prelog_latency_skip())
   {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+    int err = errno;
 
-    size_t len = 300 + 1024 /* error_str string */;
-    char *open_txt = malloc (sizeof (char) * len);
-    if (open_txt) {
-      snprintf (open_txt, len, "shm: %s", (ret<0? error_str:"e0"));
-      prelog_log_event(open_txt, name, -1, SHM_UNLINK_SCI);
-      free (open_txt);
-    }
+    char open_txt[PRELOG_TEXT_LEN];
+    snprintf (open_txt, sizeof (open_txt), "shm: e%d", (ret<0? err:0));
+    prelog_log_event(open_txt, name, -1, SHM_UNLINK_SCI);
   }
   
   errno = saved_errno;
@@ -844,11 +1277,13 @@ int shm_unlink(const char *name)
 
 int mkdir(const char *pathname, mode_t mode)
 {
-  typeof(mkdir) *original_mkdir = dlsym(RTLD_NEXT, "mkdir");
+  typeof(mkdir) *original_mkdir = PRELOG_ORIGINAL(mkdir);
+  prelog_clock_stamp();
   int ret = (*original_mkdir)(pathname, mode);
+  PRELOG_LATENCY_DONE(MKDIR_SCI);
   int saved_errno = errno;
   
-  prelog_open(ret, MKDIR_SCI, 1, -1, pathname, O_CREAT);
+  prelog_open_event(ret, MKDIR_SCI, 1, -1, pathname, O_CREAT, 0);
 
   errno = saved_errno;
   return ret;
@@ -856,39 +1291,75 @@ int mkdir(const char *pathname, mode_t mode)
 
 int mkdirat(int dirfd, const char *pathname, mode_t mode)
 {
-  typeof(mkdirat) *original_mkdir = dlsym(RTLD_NEXT, "mkdirat");
+  typeof(mkdirat) *original_mkdir = PRELOG_ORIGINAL(mkdirat);
+  prelog_clock_stamp();
   int ret = (*original_mkdir)(dirfd, pathname, mode);
+  PRELOG_LATENCY_DONE(MKDIRAT_SCI);
   int saved_errno = errno;
   
-  prelog_open(ret, MKDIRAT_SCI, 1, dirfd, pathname, O_CREAT);
+  prelog_open_event(ret, MKDIRAT_SCI, 1, dirfd, pathname, O_CREAT, 0);
 
   errno = saved_errno;
   return ret;
 }
 
-void prelog_rename(int ret, const char *oldpath, const int olddirfd, const char *newpath, const int newdirfd, const int flags, const char *interpretation)
+// Keep the cached cwd in step, without logging anything
+int chdir(const char *path)
 {
-  if(( prelog_is_home (oldpath) || prelog_is_tmp (oldpath) || prelog_is_relative (oldpath) ||  prelog_is_home (newpath) || prelog_is_tmp (newpath) || prelog_is_relative (newpath) ) /* We don't care about /etc, /usr... */
-      && !(prelog_is_forbidden_file (oldpath) || prelog_is_forbidden_file (newpath)) ) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
+  typeof(chdir) *original_chdir = PRELOG_ORIGINAL(chdir);
+  int ret = (*original_chdir)(path);
+  int saved_errno = errno;
+
+  if (ret == 0)
+    prelog_cwd_changed(path);
+
+  errno = saved_errno;
+  return ret;
+}
+
+int fchdir(int fd)
+{
+  typeof(fchdir) *original_fchdir = PRELOG_ORIGINAL(fchdir);
+  int ret = (*original_fchdir)(fd);
+  int saved_errno = errno;
+
+  if (ret == 0) {
+    char path[PATH_MAX];
+    const char *dir = NULL;
+    if (prelog_fd_table_contains(&dirfds, fd) || prelog_fd_table_contains(&fds, fd)) {
+      pthread_mutex_lock(&_prelog_fd_lock);
+      dir = prelog_fd_path(fd);
+      if (dir)
+        dir = snprintf (path, sizeof (path), "%s", dir) < (int) sizeof (path) ? path : NULL;
+      pthread_mutex_unlock(&_prelog_fd_lock);
     }
+    prelog_cwd_changed(dir);
+  }
 
-    size_t newlen = 100 + 1024;
-    char *newtxt = malloc (sizeof(char)*newlen);
-    snprintf (newtxt, newlen, "New file: with flags %d, %s", flags, (ret? error_str:"e0"));
+  errno = saved_errno;
+  return ret;
+}
+
+void prelog_rename(int ret, const char *oldpath, const int olddirfd, const char *newpath, const int newdirfd, const int flags, const char *interpretation)
+{
+  int classes = prelog_path_classify (oldpath) | prelog_path_classify (newpath);
+  if((classes & PRELOG_PATH_INCLUDED) /* We don't care about /etc, /usr... */
+      && !(classes & PRELOG_PATH_EXCLUDED)
+      && !prelog_latency_skip() ) {
+    int err = errno;
+
+    char newtxt[PRELOG_TEXT_LEN];
+    snprintf (newtxt, sizeof (newtxt), "New file: with flags %d, e%d", flags, (ret? err:0));
     prelog_log_old_new_event ("Old file", oldpath, olddirfd, newtxt, newpath, newdirfd, interpretation);
-    free (newtxt);
   }
 }
 
 int rename(const char *oldpath, const char *newpath)
 {
-  typeof(rename) *original_rename = dlsym(RTLD_NEXT, "rename");
+  typeof(rename) *original_rename = PRELOG_ORIGINAL(rename);
+  prelog_clock_stamp();
   int ret = (*original_rename)(oldpath, newpath);
+  PRELOG_LATENCY_DONE(RENAME_SCI);
   int saved_errno = errno;
   
   prelog_rename(ret, oldpath, -1, newpath, -1, 0, RENAME_SCI);
@@ -899,8 +1370,10 @@ int rename(const char *oldpath, const char *newpath)
 int renameat(int olddirfd, const char *oldpath,
             int newdirfd, const char *newpath)
 {
-  typeof(renameat) *original_rename = dlsym(RTLD_NEXT, "renameat");
+  typeof(renameat) *original_rename = PRELOG_ORIGINAL(renameat);
+  prelog_clock_stamp();
   int ret = (*original_rename)(olddirfd, oldpath, newdirfd, newpath);
+  PRELOG_LATENCY_DONE(RENAMEAT_SCI);
   int saved_errno = errno;
   
   prelog_rename(ret, oldpath, olddirfd, newpath, newdirfd, 0, RENAMEAT_SCI);
@@ -911,8 +1384,10 @@ int renameat(int olddirfd, const char *oldpath,
 int renameat2(int olddirfd, const char *oldpath,
              int newdirfd, const char *newpath, unsigned int flags)
 {
-  typeof(renameat2) *original_rename = dlsym(RTLD_NEXT, "renameat2");
+  typeof(renameat2) *original_rename = PRELOG_ORIGINAL(renameat2);
+  prelog_clock_stamp();
   int ret = (*original_rename)(olddirfd, oldpath, newdirfd, newpath, flags);
+  PRELOG_LATENCY_DONE(RENAMEAT2_SCI);
   int saved_errno = errno;
   
   prelog_rename(ret, oldpath, olddirfd, newpath, newdirfd, flags, RENAMEAT2_SCI);
@@ -924,136 +1399,260 @@ int renameat2(int olddirfd, const char *oldpath,
 
 int close (int fd)
 {
-  typeof(close) *original_close = dlsym(RTLD_NEXT, "close");
+  typeof(close) *original_close = PRELOG_ORIGINAL(close);
+
+  // Most closed fds were never tracked, let those through without locking,
+  // timed all the same
+  if(!prelog_fd_table_contains(&fds, fd) && !prelog_fd_table_contains(&dirfds, fd)) {
+    if (__builtin_expect (!prelog_latency_enabled, 1))
+      return (*original_close)(fd);
+
+    prelog_clock_stamp();
+    int ret = (*original_close)(fd);
+    PRELOG_LATENCY_DONE(CLOSE_SCI);
+    return ret;
+  }
+
+  // Untrack before the real close, so that a concurrent open() getting the
+  // same fd number back from the kernel cannot have its entry removed by us
+  char name[PRELOG_NAME_LEN];
+  char path[PATH_MAX], origin_buf[PATH_MAX];
+  const char *origin = NULL;
+  PrelogFdIo io = { { 0 } };
+  snprintf (name, sizeof (name), "fd: %d", fd);
+
+  pthread_mutex_lock(&_prelog_fd_lock);
+  PrelogFdSlot *slot = prelog_fd_table_lookup(&fds, fd);
+  if (slot)
+    prelog_fd_io_add(&io, slot);
+  int tracked = slot && prelog_fd_table_remove(&fds, fd);
+  if (tracked) {
+    origin = prelog_path_copy(slot->path, name, path, origin_buf, sizeof(path));
+    prelog_path_table_unref(&paths, slot->path);
+  }
+  prelog_fd_forget(&dirfds, fd, NULL);
+  pthread_mutex_unlock(&_prelog_fd_lock);
+
+  prelog_clock_stamp();
   int ret = (*original_close)(fd);
+  PRELOG_LATENCY_DONE(CLOSE_SCI);
   int saved_errno = errno;
   
-  pthread_mutex_lock(&_prelog_fd_lock);
-  if(prelog_slist_find(fds, PRELOG_INT_TO_POINTER(fd))) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+  if(tracked && !prelog_latency_skip()) {
+    int err = errno;
     
-    char *path = malloc(sizeof(char) * 200);
-    snprintf(path, 200, "fd: %d", fd);
-    size_t close_len = 200 + 1024;
-    char *close_txt = malloc (sizeof(char) * close_len);
-    snprintf (close_txt, close_len, "%s", (ret? error_str:"e0"));
-    prelog_log_event (close_txt, path, -1, CLOSE_SCI);
-    free (close_txt);
-    free (path);
-
-    fds = prelog_slist_remove(fds, PRELOG_INT_TO_POINTER(fd));
+    char close_txt[PRELOG_TEXT_LEN];
+    snprintf (close_txt, sizeof (close_txt), "fd %d: e%d", fd, (ret? err:0));
+    prelog_io_summary (close_txt, sizeof (close_txt), &io);
+    prelog_log_event_at (close_txt, path, origin, CLOSE_SCI);
   }
-  pthread_mutex_unlock(&_prelog_fd_lock);
   
   errno = saved_errno;
   return ret;
 }
 
-void prelog_fclose (int ret, FILE *fp, const char *interpretation)
+// Logs the close of a FILE or DIR stream we track, named after its path,
+// with the I/O done through it if io is set
+static void prelog_stream_close (int ret, PrelogPtrSet *set, const void *stream, const char *type, const char *interpretation, const PrelogFdIo *io)
 {
+  int err = errno;
+  uint32_t id;
+
   pthread_mutex_lock(&_prelog_fd_lock);
-  if(prelog_slist_find(files, fp)) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
-    
-    char *path = malloc(sizeof(char) * 200);
-    snprintf(path, 200, "FILE: %p", fp);
-    size_t close_len = 200 + 1024;
-    char *close_txt = malloc (sizeof(char) * close_len);
-    snprintf (close_txt, close_len, "%s", (ret? error_str:"e0"));
-    prelog_log_event (close_txt, path, -1, interpretation);
-    free (close_txt);
-    free (path);
-
-    files = prelog_slist_remove(files, fp);
+  int tracked = prelog_ptr_set_remove(set, stream, &id);
+  // Fast calls in slow-call-only mode are still untracked, but not formatted
+  if(tracked && prelog_latency_skip()) {
+    prelog_path_table_unref(&paths, id);
+  } else if(tracked) {
+    char name[PRELOG_NAME_LEN];
+    char path[PATH_MAX], origin_buf[PATH_MAX];
+    snprintf (name, sizeof (name), "%s: %p", type, stream);
+    const char *origin = prelog_path_copy(id, name, path, origin_buf, sizeof(path));
+    prelog_path_table_unref(&paths, id);
+
+    char close_txt[PRELOG_TEXT_LEN];
+    snprintf (close_txt, sizeof (close_txt), "%s %p: e%d", type, stream, (ret? err:0));
+    prelog_io_summary (close_txt, sizeof (close_txt), io);
+    prelog_log_event_at (close_txt, path, origin, interpretation);
   }
   pthread_mutex_unlock(&_prelog_fd_lock);
 }
 
+void prelog_fclose (int ret, FILE *fp, const char *interpretation, const PrelogFdIo *io)
+{
+  prelog_stream_close (ret, &files, fp, "FILE", interpretation, io);
+}
+
 int fclose (FILE *fp)
 {
-  typeof(fclose) *original_fclose = dlsym(RTLD_NEXT, "fclose");
+  typeof(fclose) *original_fclose = PRELOG_ORIGINAL(fclose);
+  PrelogFdIo io = { { 0 } };
+  if (fp)
+    prelog_fd_untrack(fileno(fp), &io);
+  prelog_clock_stamp();
   int ret = (*original_fclose)(fp);
+  PRELOG_LATENCY_DONE(FCLOSE_SCI);
   int saved_errno = errno;
-  prelog_fclose (ret, fp, FCLOSE_SCI);
+  prelog_fclose (ret, fp, FCLOSE_SCI, &io);
   errno = saved_errno;
   return ret;
 }
 
 int pclose (FILE *fp)
 {
-  typeof(pclose) *original_pclose = dlsym(RTLD_NEXT, "pclose");
+  typeof(pclose) *original_pclose = PRELOG_ORIGINAL(pclose);
+  PrelogFdIo io = { { 0 } };
+  if (fp)
+    prelog_fd_untrack(fileno(fp), &io);
+  prelog_clock_stamp();
   int ret = (*original_pclose)(fp);
+  PRELOG_LATENCY_DONE(PCLOSE_SCI);
   int saved_errno = errno;
-  prelog_fclose (ret /* not actual fs error... */, fp, PCLOSE_SCI);
+  prelog_fclose (ret /* not actual fs error... */, fp, PCLOSE_SCI, &io);
   errno = saved_errno;
   return ret;
 }
 
 int closedir(DIR *dirp)
 {
-  typeof(closedir) *original_closedir = dlsym(RTLD_NEXT, "closedir");
+  typeof(closedir) *original_closedir = PRELOG_ORIGINAL(closedir);
+  prelog_fd_untrack(dirfd(dirp), NULL);
+  prelog_clock_stamp();
   int ret = (*original_closedir)(dirp);
+  PRELOG_LATENCY_DONE(CLOSEDIR_SCI);
   int saved_errno = errno;
-  pthread_mutex_lock(&_prelog_fd_lock);
-  if(prelog_slist_find(dirs, dirp)) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+  prelog_stream_close (ret, &dirs, dirp, "DIR", CLOSEDIR_SCI, NULL);
 
-    char *path = malloc(sizeof(char) * 200);
-    snprintf(path, 200, "DIR: %p", dirp);
-    size_t close_len = 200 + 1024;
-    char *close_txt = malloc (sizeof(char) * close_len);
-    snprintf (close_txt, close_len, "%s", (ret? error_str:"e0"));
-    prelog_log_event (close_txt, path, -1, CLOSEDIR_SCI);
-    free (close_txt);
-    free (path);
+  errno = saved_errno;
+  return ret;
+}
 
-    dirs = prelog_slist_remove(dirs, dirp);
-  }
-  pthread_mutex_unlock(&_prelog_fd_lock);
 
+/* Reads and writes are never logged on their own, they only add to the
+ * counters of tracked fds and FILE streams, which their close event sums
+ * up. Counting does not touch errno. */
+ssize_t read(int fd, void *buf, size_t count)
+{
+  typeof(read) *original_read = PRELOG_ORIGINAL(read);
+  ssize_t ret = (*original_read)(fd, buf, count);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_READ, ret);
+  return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+  typeof(write) *original_write = PRELOG_ORIGINAL(write);
+  ssize_t ret = (*original_write)(fd, buf, count);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_WRITE, ret);
+  return ret;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+  typeof(pread) *original_pread = PRELOG_ORIGINAL(pread);
+  ssize_t ret = (*original_pread)(fd, buf, count, offset);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_READ, ret);
+  return ret;
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+  typeof(pread64) *original_pread = PRELOG_ORIGINAL(pread64);
+  ssize_t ret = (*original_pread)(fd, buf, count, offset);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_READ, ret);
+  return ret;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+  typeof(pwrite) *original_pwrite = PRELOG_ORIGINAL(pwrite);
+  ssize_t ret = (*original_pwrite)(fd, buf, count, offset);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_WRITE, ret);
+  return ret;
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+  typeof(pwrite64) *original_pwrite = PRELOG_ORIGINAL(pwrite64);
+  ssize_t ret = (*original_pwrite)(fd, buf, count, offset);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_WRITE, ret);
+  return ret;
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+  typeof(readv) *original_readv = PRELOG_ORIGINAL(readv);
+  ssize_t ret = (*original_readv)(fd, iov, iovcnt);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_READ, ret);
+  return ret;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  typeof(writev) *original_writev = PRELOG_ORIGINAL(writev);
+  ssize_t ret = (*original_writev)(fd, iov, iovcnt);
+  prelog_fd_table_count(&fds, fd, PRELOG_FD_IO_WRITE, ret);
+  return ret;
+}
+
+// fileno does not lock the stream, but sets errno for streams without an fd
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+  typeof(fread) *original_fread = PRELOG_ORIGINAL(fread);
+  size_t ret = (*original_fread)(ptr, size, nmemb, stream);
+  int saved_errno = errno;
+  prelog_fd_table_count(&streams, fileno(stream), PRELOG_FD_IO_READ, (ssize_t) (ret * size));
+  errno = saved_errno;
+  return ret;
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+  typeof(fwrite) *original_fwrite = PRELOG_ORIGINAL(fwrite);
+  size_t ret = (*original_fwrite)(ptr, size, nmemb, stream);
+  int saved_errno = errno;
+  prelog_fd_table_count(&streams, fileno(stream), PRELOG_FD_IO_WRITE, (ssize_t) (ret * size));
   errno = saved_errno;
   return ret;
 }
 
+// Only timed, for the latency histograms
+int fsync(int fd)
+{
+  typeof(fsync) *original_fsync = PRELOG_ORIGINAL(fsync);
+  prelog_clock_stamp();
+  int ret = (*original_fsync)(fd);
+  PRELOG_LATENCY_DONE(FSYNC_SCI);
+  return ret;
+}
+
+int fdatasync(int fd)
+{
+  typeof(fdatasync) *original_fdatasync = PRELOG_ORIGINAL(fdatasync);
+  prelog_clock_stamp();
+  int ret = (*original_fdatasync)(fd);
+  PRELOG_LATENCY_DONE(FDATASYNC_SCI);
+  return ret;
+}
 
 int socket(int domain, int type, int protocol)
 {
-  typeof(socket) *original_socket = dlsym(RTLD_NEXT, "socket");
+  typeof(socket) *original_socket = PRELOG_ORIGINAL(socket);
+  prelog_clock_stamp();
   int ret = (*original_socket)(domain, type, protocol);
+  PRELOG_LATENCY_DONE(SOCKET_SCI);
   int saved_errno = errno;
 
-  if ((geteuid() >= 1000) && (domain == AF_UNIX || domain == AF_LOCAL)) {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+  if ((prelog_is_user_process()) && (domain == AF_UNIX || domain == AF_LOCAL)) {
+    int err = errno;
 
-    size_t len = 600 + 1024 /* error_str string */;
-    char *open_txt = malloc (sizeof (char) * len);
-    if (open_txt) {
-      snprintf (open_txt, len, "socket %d: with domain %d, type %d, protocol %d, %s", ret, domain, type, protocol, (ret<0? error_str:"e0"));
+    if (!prelog_latency_skip()) {
+      char open_txt[PRELOG_TEXT_LEN];
+      snprintf (open_txt, sizeof (open_txt), "socket %d: with domain %d, type %d, protocol %d, e%d", ret, domain, type, protocol, (ret<0? err:0));
       prelog_log_event(open_txt, "socket", -1, SOCKET_SCI);
-      free (open_txt);
     }
     pthread_mutex_lock(&_prelog_fd_lock);
-    fds = prelog_slist_prepend(fds, PRELOG_INT_TO_POINTER(ret));
+    prelog_fd_track(&fds, ret, O_RDWR, 0);
     pthread_mutex_unlock(&_prelog_fd_lock);
   }
 
@@ -1067,31 +1666,25 @@ int socket(int domain, int type, int protocol)
 void prelog_rm (int ret, const char *pathname, const char *interpretation)
 {
   if (
-         (geteuid() >= 1000)               /* Limit the performance hit on service processes */
-      && (!prelog_is_forbidden_file (pathname))   /* Our log files in ~/.local/share/... are off-limits */
+         (prelog_is_user_process())        /* Limit the performance hit on service processes */
+      && !(prelog_path_classify (pathname) & PRELOG_PATH_EXCLUDED)   /* Our log files in ~/.local/share/... are off-limits */
+      && !prelog_latency_skip()
      )
   {
-    char *error_str = NULL;//, error[1024];
-    if (errno) {
-      //error_str = strerror_r (errno, error, 1024);
-      error_str = malloc (26);
-      snprintf (error_str, 26, "e%d", errno);
-    }
+    int err = errno;
 
-    size_t len = 200 /* snprintf format string + some extra for safety */ + 1024 /* error_str string */;
-    char *rm_txt = malloc (sizeof (char) * len);
-    if (rm_txt) {
-      snprintf (rm_txt, len, "%s", (ret<0? error_str:"e0"));
-      prelog_log_event(rm_txt, pathname, -1, interpretation);
-      free (rm_txt);
-    }
+    char rm_txt[PRELOG_TEXT_LEN];
+    snprintf (rm_txt, sizeof (rm_txt), "e%d", (ret<0? err:0));
+    prelog_log_event(rm_txt, pathname, -1, interpretation);
   }
 }
 
 int remove (const char *pathname)
 {
-  typeof(remove) *original_remove = dlsym(RTLD_NEXT, "remove");
+  typeof(remove) *original_remove = PRELOG_ORIGINAL(remove);
+  prelog_clock_stamp();
   int ret = (*original_remove)(pathname);
+  PRELOG_LATENCY_DONE(REMOVE_SCI);
   int saved_errno = errno;
 
   prelog_rm (ret, pathname, REMOVE_SCI);
@@ -1101,8 +1694,10 @@ int remove (const char *pathname)
 
 int rmdir (const char *pathname)
 {
-  typeof(rmdir) *original_rmdir = dlsym(RTLD_NEXT, "rmdir");
+  typeof(rmdir) *original_rmdir = PRELOG_ORIGINAL(rmdir);
+  prelog_clock_stamp();
   int ret = (*original_rmdir)(pathname);
+  PRELOG_LATENCY_DONE(RMDIR_SCI);
   int saved_errno = errno;
 
   prelog_rm (ret, pathname, RMDIR_SCI);
@@ -1112,8 +1707,10 @@ int rmdir (const char *pathname)
 
 int unlink (const char *pathname)
 {
-  typeof(unlink) *original_unlink = dlsym(RTLD_NEXT, "unlink");
+  typeof(unlink) *original_unlink = PRELOG_ORIGINAL(unlink);
+  prelog_clock_stamp();
   int ret = (*original_unlink)(pathname);
+  PRELOG_LATENCY_DONE(UNLINK_SCI);
   int saved_errno = errno;
 
   prelog_rm (ret, pathname, UNLINK_SCI);
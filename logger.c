@@ -25,159 +25,28 @@
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include "binlog.h"
+#include "collector.h"
+#include "identity.h"
+#include "journal.h"
+#include "latency.h"
 #include "logger.h"
+#include "originals.h"
+#include "shmring.h"
 
 static int _prelog_exit_registered = 0;
 static pthread_mutex_t _prelog_lock = PTHREAD_MUTEX_INITIALIZER;
 
-char *prelog_get_actor_from_pid (pid_t pid)
-{
-  static char *cached = NULL;
-  static pid_t cached_pid = 0;
-  
-  if (cached_pid && cached_pid != pid) {
-    if (cached) {
-      free (cached);
-      cached = NULL;
-    }
-  }
-
-  if (cached) {
-    return strdup (cached);
-  }
-
-  char         *link_file     = NULL;
-  char         *link_target   = NULL;
-  char         *split_target  = NULL;
-  char         *actor_name    = NULL;
-  ssize_t       read_len      = PATH_MAX; // 4096, so it's unlikely link_len ever overflows :)
-  ssize_t       link_len      = 1;
-
-  if (pid <= 0)
-  {
-      cached = strdup ("unknown (no pid)");
-      return strdup (cached);
-  }
-
-  size_t len = strlen ("/proc//exe") + 100 + 1; //100 is much more than current pid_t's longest digit representation
-  link_file = malloc (sizeof (char) * len);
-  snprintf (link_file, len, "/proc/%d/exe", pid);
-  if (link_file == NULL)
-  {
-      cached = strdup ("unknown (no exe link)");
-      return strdup (cached);
-  }
-
-  // It is impossible to obtain the size of /proc link targets as /proc is
-  // not POSIX compliant. Hence, we start from the NAME_MAX limit and increase
-  // it all the way up to readlink failing. readlink will fail upon reaching
-  // the PATH_MAX limit on Linux implementations. read_len will be strictly
-  // inferior to link_len as soon as the latter is big enough to contain the
-  // path to the executable and a trailing null character.
-  while (read_len >= link_len)
-  {
-    link_len += NAME_MAX;
-
-    free (link_target);
-    link_target = malloc (link_len * sizeof (char));
-
-    if (link_target == NULL)
-    {
-      free (link_file);
-      free (link_target);
-      cached = strdup ("unknown (could not allocate memory when reading exe link)");
-      return strdup (cached);
-    }
-
-    read_len= readlink (link_file, link_target, link_len);
-
-    if (read_len < 0)
-    {
-      free (link_file);
-      free (link_target);
-      cached = strdup ("unknown (failed to read exe link)");
-      return strdup (cached);
-    }
-  }
-
-  free (link_file);
-
-  // readlink does not null-terminate the string
-  link_target[read_len] = '\0';
-
-  split_target = strrchr (link_target, '/');
-
-  if(split_target == NULL)
-  {
-    free (link_target);
-    cached = strdup ("unknown (could not get file base name from exe link)");
-    return strdup (cached);
-  }
-
-  // Turn it into an arbitrary actor name
-  size_t actor_len = strlen (split_target) + 1;
-  actor_name = malloc (sizeof (char) * actor_len);
-  snprintf (actor_name, actor_len, "%s", split_target+1);
-  free (link_target);
-
-  // Better safe than sorry
-  if (!actor_name)
-    actor_name = strdup ("unknown");
-
-  cached = actor_name;
-  return strdup(actor_name);
-}
-
-char *prelog_get_cmdline_from_pid (pid_t pid)
-{
-  if (pid <= 0)
-  {
-      return strdup ("unknown (no pid)");
-  }
-
-  size_t len = strlen ("/proc//cmdline") + 100 + 1; //100 is much more than current pid_t's longest digit representation
-  char *cmd_path = malloc (sizeof (char) * len);
-  snprintf (cmd_path, len, "/proc/%d/cmdline", pid);
-  if (cmd_path == NULL)
-      return strdup ("unknown (could not file command line file)");
-
-  typeof(fopen) *original_fopen;
-  original_fopen = dlsym(RTLD_NEXT, "fopen");
-  FILE *cmd_f = (*original_fopen) (cmd_path, "rb");
-  if (cmd_f == NULL)
-    return strdup ("unknown (could not open command line file)");
-
-  char *buffer = malloc (sizeof (char) * PRELOG_CMDLINE_LEN);
-  size_t read = 0, index = 0;
-  if (buffer)
-  {
-    read = fread (buffer, 1, PRELOG_CMDLINE_LEN - 1, cmd_f);
-  }
-
-  for(; index<read; ++index)
-    if (buffer[index] == '\0')
-      buffer[index] = ' ';
-  buffer[read] = '\0';
-
-  typeof(fclose) *original_fclose;
-  original_fclose = dlsym(RTLD_NEXT, "fclose");
-  (*original_fclose) (cmd_f);
-
-  if (!read)
-  {
-    free (buffer);
-    return strdup ("unknown (could not read command line file)");
-  }
-  else
-    return buffer;
-}
-
 PrelogSubject *prelog_subject_new (void)
 {
   PrelogSubject *s = malloc(sizeof(PrelogSubject));
@@ -201,10 +70,20 @@ void prelog_subject_free (PrelogSubject *s)
     free(s->uri);
   if(s->origin)
     free(s->origin);
+  if(s->text)
+    free(s->text);
 
   free(s);
 }
 
+/* For subjects living on the caller's stack, which must not be freed */
+void prelog_subject_init (PrelogSubject *s, const char *uri, const char *text, const char *origin)
+{
+  s->uri = (char *) uri;
+  s->text = (char *) text;
+  s->origin = (char *) origin;
+}
+
 void prelog_subject_set_uri (PrelogSubject *s, const char *uri)
 {
   if(!s)
@@ -213,7 +92,7 @@ void prelog_subject_set_uri (PrelogSubject *s, const char *uri)
   if(s->uri)
     free(s->uri);
   
-  s->uri = strndup (uri, 8192);
+  s->uri = strndup (uri, PRELOG_FIELD_MAX);
 }
 
 void prelog_subject_set_origin (PrelogSubject *s, const char *origin)
@@ -224,7 +103,7 @@ void prelog_subject_set_origin (PrelogSubject *s, const char *origin)
   if(s->origin)
     free(s->origin);
   
-  s->origin = strndup (origin, 8192);
+  s->origin = strndup (origin, PRELOG_FIELD_MAX);
 }
 
 void prelog_subject_set_text (PrelogSubject *s, const char *text)
@@ -235,7 +114,7 @@ void prelog_subject_set_text (PrelogSubject *s, const char *text)
   if(s->text)
     free(s->text);
   
-  s->text = strndup (text, 8192);
+  s->text = strndup (text, PRELOG_FIELD_MAX);
 }
 
 PrelogEvent *prelog_event_new (void)
@@ -245,7 +124,7 @@ PrelogEvent *prelog_event_new (void)
   if(!e)
     return NULL;
 
-  e->timestamp = time(NULL);
+  e->timestamp = prelog_clock_now();
   e->subjects = NULL;
   e->interpretation = NULL;
 
@@ -266,6 +145,7 @@ void prelog_event_free (PrelogEvent *e)
     free(e->subjects);
   }
 
+  free(e->interpretation);
   free(e);
 }
 
@@ -274,7 +154,7 @@ void prelog_event_set_interpretation (PrelogEvent *e, const char *interpretation
   if(!e)
     return;
 
-  e->interpretation = strndup (interpretation, 8192);
+  e->interpretation = strndup (interpretation, PRELOG_FIELD_MAX);
 }
 
 void prelog_event_add_subject (PrelogEvent *e, PrelogSubject *s)
@@ -301,15 +181,45 @@ void prelog_log_free (PrelogLog *log, PrelogLogResetFlag reset)
   if(!log)
     return;
 
+  // A forked child already reset the writer, see prelog_log_fork_child
+  if (reset != PRELOG_LOG_RESET_FORK)
+    prelog_writer_shutdown ();
+
+  // Other threads may still append at exit, so only a forked child unmaps
+  if (log->ring && reset == PRELOG_LOG_RESET_FORK)
+    prelog_shm_ring_detach (log->ring);
+
+  // Same with the journal, which a forked child leaves to its parent
+  if (log->journal) {
+    if (reset == PRELOG_LOG_RESET_FORK) {
+      typeof(close) *original_close;
+      original_close = PRELOG_ORIGINAL(close);
+      (*original_close) (log->journal->fd);
+      prelog_journal_detach (log->journal);
+    } else {
+      prelog_journal_close (log->journal);
+    }
+  }
+
+  // A forked child leaves the connection to its parent
+  if (log->collector_fd >= 0) {
+    typeof(close) *original_close;
+    original_close = PRELOG_ORIGINAL(close);
+    (*original_close) (log->collector_fd);
+  }
+
   if (log->write_zfd != NULL) {
-    /*typeof(close) *original_close;
-    original_close = dlsym(RTLD_NEXT, "close");
-    (*original_close) (log->write_fd);*/
-    if (reset == PRELOG_LOG_RESET_FORK)
-      prelog_gzclose_no_flush (log->write_zfd);
-    else
+    // The parent will write what is pending, and its stream is none of our
+    // business, so a forked child only closes its copy of the file
+    if (reset == PRELOG_LOG_RESET_FORK) {
+      typeof(close) *original_close;
+      original_close = PRELOG_ORIGINAL(close);
+      (*original_close) (prelog_gzabandon (log->write_zfd));
+    } else {
       prelog_gzclose_w (log->write_zfd);
+    }
   }
+  prelog_binlog_free (log->binlog);
   
   free (log);
   log = NULL;
@@ -318,7 +228,7 @@ void prelog_log_free (PrelogLog *log, PrelogLogResetFlag reset)
 static void prelog_mkdir (const char *dir)
 {
   typeof(mkdir) *original_mkdir;
-  original_mkdir = dlsym(RTLD_NEXT, "mkdir");
+  original_mkdir = PRELOG_ORIGINAL(mkdir);
   
   char tmp[PATH_MAX];
   char *p = NULL;
@@ -341,162 +251,647 @@ static void prelog_mkdir (const char *dir)
   (*original_mkdir)(tmp, S_IRWXU);
 }
 
-int prelog_log_allowed_to_log ()
+// Events are dated with PRELOG_CLOCK_ENV's clock, realtime by default. With
+// latency on, stamps also start the monotonic clock that times the call.
+static clockid_t _prelog_clock = CLOCK_REALTIME;
+static __thread PrelogTime _prelog_stamp = 0;
+static __thread PrelogTime _prelog_started = 0;
+
+__attribute__((constructor))
+static void prelog_clock_init (void)
+{
+  const char *clock = getenv (PRELOG_CLOCK_ENV);
+  if (clock && strcmp (clock, "coarse") == 0)
+    _prelog_clock = CLOCK_REALTIME_COARSE;
+}
+
+static PrelogTime prelog_clock_read (clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime (clock, &ts);
+  return (PrelogTime) ts.tv_sec * PRELOG_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Served by the vDSO for every clock we read, without entering the kernel
+PrelogTime prelog_clock_now (void)
+{
+  return prelog_clock_read (_prelog_clock);
+}
+
+PrelogTime prelog_clock_monotonic (void)
+{
+  return prelog_clock_read (CLOCK_MONOTONIC);
+}
+
+// Wrappers stamp the event before calling into libc, so that it is dated
+// from when the call was made rather than from when it got logged
+void prelog_clock_stamp (void)
+{
+  _prelog_stamp = prelog_clock_now ();
+  if (__builtin_expect (prelog_latency_enabled, 0))
+    _prelog_started = prelog_clock_monotonic ();
+}
+
+PrelogTime prelog_clock_stamped (void)
+{
+  return _prelog_stamp ? _prelog_stamp : prelog_clock_now ();
+}
+
+// The monotonic time of the last stamp, or 0 if latency was off then
+PrelogTime prelog_clock_started (void)
+{
+  return _prelog_started;
+}
+
+/* Permission checks cost a few syscalls and allocations, and their outcome
+ * only changes when the user drops or removes a lock file or when the process
+ * changes credentials. Their result is cached, along with the coarse
+ * monotonic time at which it was computed, and recomputed at most every
+ * PRELOG_PERMISSION_TTL_MS. The three fields are packed in a single word so
+ * that threads always see a consistent decision. */
+static uint64_t prelog_coarse_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int prelog_cached_decision (uint64_t *cache, int (*compute) (void))
+{
+  uint64_t now = prelog_coarse_ms ();
+  uint64_t cached = __atomic_load_n (cache, __ATOMIC_RELAXED);
+
+  if ((cached & 1) && now - (cached >> 2) < PRELOG_PERMISSION_TTL_MS)
+    return (cached >> 1) & 1;
+
+  int decision = compute () ? 1 : 0;
+  __atomic_store_n (cache, (now << 2) | (decision << 1) | 1, __ATOMIC_RELAXED);
+  return decision;
+}
+
+static int prelog_check_user_process (void)
+{
+  // Limit the performance hit on service processes
+  return geteuid() >= 1000;
+}
+
+int prelog_is_user_process (void)
+{
+  static uint64_t cache = 0;
+  return prelog_cached_decision (&cache, prelog_check_user_process);
+}
+
+static int prelog_log_check_allowed_to_log (void)
 {
   typeof(access) *original_access;
-  original_access = dlsym(RTLD_NEXT, "access");
+  original_access = PRELOG_ORIGINAL(access);
   
   const char *home = getenv("HOME");
   if(!home)
     return 0;
 
-  int accessed = -1;
-  size_t len = strlen(home) + 1 + strlen(PRELOG_TARGET_DIR) + 1 + strlen(PRELOG_LOG_FORBIDDEN) + 1;
-  char *full_path = malloc (sizeof (char) * len);
-  if (full_path) {
-    snprintf (full_path, len, "%s/%s/%s", home, PRELOG_TARGET_DIR, PRELOG_LOG_FORBIDDEN);
-    accessed = (*original_access) (full_path, F_OK);
-    free (full_path);
-  }
+  char full_path[PATH_MAX];
+  int written = snprintf (full_path, sizeof (full_path), "%s/%s/%s", home, PRELOG_TARGET_DIR, PRELOG_LOG_FORBIDDEN);
+  if (written < 0 || (size_t) written >= sizeof (full_path))
+    return -1;
 
-  if (accessed == 0)
+  if ((*original_access) (full_path, F_OK) == 0)
     return 0;
 
-  char *name = prelog_get_actor_from_pid (getpid());
-  if (!name)
-    return 0;
+  written = snprintf (full_path, sizeof (full_path), "%s/%s/%s.lock", home, PRELOG_TARGET_DIR, prelog_identity_get()->actor);
+  if (written < 0 || (size_t) written >= sizeof (full_path))
+    return -1;
 
-  len = strlen(home) + 1 + strlen(PRELOG_TARGET_DIR) + 1 + strlen(name) + 6;
-  full_path = malloc (sizeof (char) * len);
-  if (full_path) {
-    snprintf (full_path, len, "%s/%s/%s.lock", home, PRELOG_TARGET_DIR, name);
-    accessed = (*original_access) (full_path, F_OK);
-    free (full_path);
-    free (name);
-  }
+  return (*original_access) (full_path, F_OK);
+}
+
+int prelog_log_allowed_to_log (void)
+{
+  static uint64_t cache = 0;
+  return prelog_cached_decision (&cache, prelog_log_check_allowed_to_log);
+}
 
-  return accessed;
+static void prelog_log_disconnect (PrelogLog *log)
+{
+  typeof(close) *original_close;
+  original_close = PRELOG_ORIGINAL(close);
+  (*original_close) (log->collector_fd);
+  log->collector_fd = -1;
+
+  // Records go to our writer from now on. Other threads may still be
+  // appending to the ring, so it stays mapped
+  __atomic_store_n (&log->ring, NULL, __ATOMIC_RELEASE);
 }
 
+static void prelog_log_open_file (PrelogLog *log, int allow_binary);
+
 void prelog_log_log_process_data (PrelogLog *log)
 {
-  if(log->write_zfd != NULL && prelog_log_allowed_to_log()) {
-    pid_t pid = getpid();
-    char *actor = prelog_get_actor_from_pid (pid);
-    if (!actor)
+  if((log->write_zfd != NULL || log->collector_fd >= 0 || log->journal) && prelog_log_allowed_to_log()) {
+    const PrelogIdentity *identity = prelog_identity_get();
+
+    // Sent as a single message, so that the collector knows who is talking
+    char *header = malloc(PRELOG_MESSAGE_MAX);
+    if (!header)
       return;
-    char *cmdline = prelog_get_cmdline_from_pid (pid);
+    int len;
+    if (log->binlog) {
+      len = prelog_binlog_encode_header(log->binlog, header, PRELOG_MESSAGE_MAX, identity->pid, identity->actor, identity->cmdline);
+    } else {
+      len = snprintf(header, PRELOG_MESSAGE_MAX, "@%s|%d|%s\n", identity->actor, identity->pid, identity->cmdline);
+      if (len >= PRELOG_MESSAGE_MAX)
+        len = PRELOG_MESSAGE_MAX - 1;
+    }
 
-    char *msg = NULL;
-    size_t msg_len = 0;
-    
-    msg_len = strlen(actor) + (cmdline? strlen(cmdline) : 20) + 12 /* pid */ + 4 /* @ : \n \0 */;
-    msg = malloc(sizeof (char) * msg_len);
-    if (!msg) {
-      free (actor);
-      free (cmdline);
+    if (log->collector_fd >= 0 && send(log->collector_fd, header, len, MSG_NOSIGNAL) != len) {
+      prelog_log_disconnect(log);
+      prelog_log_open_file(log, 0);
+    }
+    if (log->write_zfd != NULL)
+      gzwrite(log->write_zfd, header, len);
+    if (log->journal)
+      prelog_journal_append(log->journal, PRELOG_JOURNAL_HEADER, 0, header, len < PRELOG_RECORD_MAX ? len : PRELOG_RECORD_MAX);
+
+    free(header);
+  }
+}
+
+// Sends data to the collector, or appends it to the log file if there is no
+// collector or if it went away. Call with the writer lock held.
+void prelog_log_write (PrelogLog *log, const char *data, size_t len)
+{
+  if (!log || !len)
+    return;
+
+  int saved_errno = errno;
+
+  if (log->collector_fd >= 0) {
+    if (send(log->collector_fd, data, len, MSG_NOSIGNAL) == (ssize_t) len) {
+      errno = saved_errno;
       return;
     }
 
-    snprintf(msg, msg_len, "@%s|%d|%s\n", actor, pid, cmdline);
-    
-    //write(log->write_fd, msg, strlen(msg));
-    gzwrite(log->write_zfd, msg, strlen(msg));
-    free(actor);
-    free (cmdline);
-    free(msg);
+    // Pending output is text, so the fallback file is too
+    prelog_log_disconnect(log);
+    prelog_log_open_file(log, 0);
+    prelog_log_log_process_data(log);
   }
+
+  if (log->write_zfd != NULL)
+    gzwrite(log->write_zfd, data, len);
+
+  errno = saved_errno;
 }
 
+/* How far the current process is counted in the stats: not yet, as a process,
+ * or as one that logged too. Each process counts itself once, as it opens its
+ * log or, never having logged, as it exits or execs. */
+enum {
+  PRELOG_STATS_UNCOUNTED,
+  PRELOG_STATS_PROCESS,
+  PRELOG_STATS_LOGGING
+};
+static int _prelog_stats_counted = PRELOG_STATS_UNCOUNTED;
+
 static void prelog_log_shutdown()
 {
+  // Histograms go out while the log can still take them
+  prelog_latency_flush(prelog_log_get_default(PRELOG_LOG_DONT_RESET), 1);
   prelog_log_get_default(PRELOG_LOG_RESET_SHUTDOWN);
 }
 
+static PrelogLog *prelog_log_create (void);
+
 PrelogLog *prelog_log_get_default (PrelogLogResetFlag reset)
 {
   static PrelogLog *log = NULL;
   
   if (reset != PRELOG_LOG_DONT_RESET) {
+    if (reset == PRELOG_LOG_RESET_FORK)
+      pthread_mutex_init (&_prelog_lock, NULL);
+
+    pthread_mutex_lock(&_prelog_lock);
     prelog_log_free (log, reset);
-    log = NULL;
+    __atomic_store_n (&log, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_prelog_lock);
 
-    if (reset == PRELOG_LOG_RESET_SHUTDOWN)
-      return NULL;
+    // A new log only gets created when something needs it
+    return NULL;
   }
 
-  if (geteuid() < 1000)
+  if (!prelog_is_user_process())
     return NULL;
-  
-  if (!log) {
-    log = malloc(sizeof(PrelogLog));
-    if(!log)
-        return NULL;
-    //log->write_fd = -1;
-    log->write_zfd = NULL;
-
-    /* Try to init write_fd / write_zfd */
-    const char *env = getenv("HOME");
-    if (env) {
-    
-      size_t elen = strlen (env) + 1 + strlen (PRELOG_TARGET_DIR) + 1;
-      char *epath = malloc (sizeof (char) * elen);
-      if (!epath) {
-        free(log);
-        log = NULL;
-        return NULL;
-      }
-      snprintf (epath, elen, "%s/%s", env, PRELOG_TARGET_DIR);
-      typeof(opendir) *original_opendir;
-      original_opendir = dlsym(RTLD_NEXT, "opendir");
-      
-      DIR *exists = (*original_opendir) (epath);
-
-      if (!exists) {
-        prelog_mkdir (epath);
-      } else {
-        typeof(closedir) *original_closedir;
-        original_closedir = dlsym(RTLD_NEXT, "closedir");
-        (*original_closedir) (exists);
-      }
-      free (epath);
-
-      time_t t = time(NULL);
-      struct tm ttm;
-      localtime_r(&t, &ttm);
-      char date[100] = {0};
-      if (!strftime(date, sizeof(date), "%Y-%m-%d_%H%M%S", &ttm))
-        date[0] = '\0';
-
-      size_t len = strlen (env) + 1/*/*/ + strlen (PRELOG_TARGET_DIR) + 1/*/*/ + strnlen(date, 100) + 1/*_*/ + 24/*pid*/ + 5/*.log+\0*/ + 3/*.gz*/;
-      char *path = malloc (sizeof (char) * len);
-      if (!path) {
-        free(log);
-        log = NULL;
-        return NULL;
-      }
-      
-      //snprintf (path, len, "%s/%s/%s_%d.log", env, PRELOG_TARGET_DIR, date, getpid());
-      //typeof(open) *original_open;
-      //original_open = dlsym(RTLD_NEXT, "open");
-      //log->write_fd = (*original_open) (path, O_WRONLY | O_CREAT | O_APPEND, 00666);
-
-      snprintf (path, len, "%s/%s/%s_%d.log.gz", env, PRELOG_TARGET_DIR, date, getpid());
-      log->write_zfd = prelog_gzopen(path, "a");
-      free (path);
-
-      prelog_log_log_process_data(log);
-
-      if (!_prelog_exit_registered) {
-        _prelog_exit_registered = 1;
-        atexit(prelog_log_shutdown);
-      }
+
+  PrelogLog *current = __atomic_load_n (&log, __ATOMIC_ACQUIRE);
+  if (current)
+    return current;
+
+  pthread_mutex_lock(&_prelog_lock);
+  current = log;
+  if (!current) {
+    current = prelog_log_create ();
+    __atomic_store_n (&log, current, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&_prelog_lock);
+
+  return current;
+}
+
+/* Fork handlers, called by those of lib.c. Holding every lock of ours across
+ * fork means that no other thread is halfway through the log, the writer or
+ * the identity when the child gets its copy of them, and that the writer
+ * thread is not in the middle of a write. Locks are taken in the order the
+ * rest of the code nests them: _prelog_lock, then the writer, then the
+ * identity. */
+void prelog_log_fork_prepare (void)
+{
+  pthread_mutex_lock(&_prelog_lock);
+  prelog_writer_fork_prepare();
+  prelog_identity_fork_prepare();
+}
+
+void prelog_log_fork_parent (void)
+{
+  prelog_identity_fork_parent();
+  prelog_writer_fork_parent();
+  pthread_mutex_unlock(&_prelog_lock);
+}
+
+// The child starts over with its own identity, its own log once it logs, and
+// counts itself in the stats through the mapping of its parent
+void prelog_log_fork_child (void)
+{
+  prelog_identity_reset_after_fork();
+  prelog_writer_reset_after_fork();
+  prelog_log_get_default(PRELOG_LOG_RESET_FORK);
+  _prelog_stats_counted = PRELOG_STATS_UNCOUNTED;
+}
+
+// Returns a connection to the session collector, or -1 if none is listening
+static int prelog_log_connect_collector (void)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (prelog_collector_socket_path (addr.sun_path, sizeof (addr.sun_path)) < 0)
+    return -1;
+
+  typeof(socket) *original_socket;
+  original_socket = PRELOG_ORIGINAL(socket);
+  typeof(close) *original_close;
+  original_close = PRELOG_ORIGINAL(close);
+
+  // Non-blocking so that a collector with a full backlog is skipped
+  int fd = (*original_socket) (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+    (*original_close) (fd);
+    return -1;
+  }
+
+  // Sends block on a busy collector, for a while only
+  struct timeval timeout = { PRELOG_COLLECTOR_SEND_TIMEOUT_MS / 1000, (PRELOG_COLLECTOR_SEND_TIMEOUT_MS % 1000) * 1000 };
+  if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK) < 0 ||
+      setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout)) < 0) {
+    (*original_close) (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Maps the collector's ring, which is optional
+static PrelogShmRing *prelog_log_attach_ring (void)
+{
+  char path[PATH_MAX];
+  if (prelog_collector_ring_path (path, sizeof (path)) < 0)
+    return NULL;
+
+  typeof(open) *original_open;
+  original_open = PRELOG_ORIGINAL(open);
+  typeof(close) *original_close;
+  original_close = PRELOG_ORIGINAL(close);
+
+  int fd = (*original_open) (path, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  PrelogShmRing *ring = prelog_shm_ring_attach (fd, prelog_identity_get()->pid);
+  (*original_close) (fd);
+  return ring;
+}
+
+// Returns the path of a new log file with the given extension, creating its
+// directory if needed, or NULL
+static char *prelog_log_new_path (const char *extension)
+{
+  const char *env = getenv("HOME");
+  if (!env)
+    return NULL;
+
+  size_t elen = strlen (env) + 1 + strlen (PRELOG_TARGET_DIR) + 1;
+  char *epath = malloc (sizeof (char) * elen);
+  if (!epath)
+    return NULL;
+  snprintf (epath, elen, "%s/%s", env, PRELOG_TARGET_DIR);
+  typeof(opendir) *original_opendir;
+  original_opendir = PRELOG_ORIGINAL(opendir);
+
+  DIR *exists = (*original_opendir) (epath);
+
+  if (!exists) {
+    prelog_mkdir (epath);
+  } else {
+    typeof(closedir) *original_closedir;
+    original_closedir = PRELOG_ORIGINAL(closedir);
+    (*original_closedir) (exists);
+  }
+  free (epath);
+
+  time_t t = time(NULL);
+  struct tm ttm;
+  localtime_r(&t, &ttm);
+  char date[100] = {0};
+  if (!strftime(date, sizeof(date), "%Y-%m-%d_%H%M%S", &ttm))
+    date[0] = '\0';
+
+  size_t len = strlen (env) + 1/*/*/ + strlen (PRELOG_TARGET_DIR) + 1/*/*/ + strnlen(date, 100) + 1/*_*/ + 24/*pid*/ + 1/*.*/ + strlen (extension) + 1/*\0*/;
+  char *path = malloc (sizeof (char) * len);
+  if (!path)
+    return NULL;
+
+  //snprintf (path, len, "%s/%s/%s_%d.log", env, PRELOG_TARGET_DIR, date, getpid());
+  //typeof(open) *original_open;
+  //original_open = dlsym(RTLD_NEXT, "open");
+  //log->write_fd = (*original_open) (path, O_WRONLY | O_CREAT | O_APPEND, 00666);
+
+  snprintf (path, len, "%s/%s/%s_%d.%s", env, PRELOG_TARGET_DIR, date, getpid(), extension);
+  return path;
+}
+
+static void prelog_log_open_file (PrelogLog *log, int allow_binary)
+{
+  const char *format = getenv(PRELOG_FORMAT_ENV);
+  if (allow_binary && format && !strcmp(format, "binary"))
+    log->binlog = prelog_binlog_new();
+
+  const char *extension = log->binlog ? "binlog.gz" : "log.gz";
+  char *path = prelog_log_new_path (extension);
+  if (!path)
+    return;
+
+  /* Each image opens its own, exec must not hand this one down. An image
+   * exec'd within the same second as the one before it takes the next exec
+   * generation of the name rather than append to a file whose last gzip
+   * member the old image may not have had time to end. */
+  char generation[32];
+  int i;
+  log->write_zfd = prelog_gzopen(path, "axe");
+  for (i = 1; log->write_zfd == NULL && errno == EEXIST && i < PRELOG_EXEC_GENERATIONS; ++i) {
+    free (path);
+    snprintf (generation, sizeof (generation), "%d.%s", i, extension);
+    path = prelog_log_new_path (generation);
+    if (!path)
+      return;
+    log->write_zfd = prelog_gzopen(path, "axe");
+  }
+  free (path);
+
+  if (log->write_zfd != NULL && log->binlog)
+    gzwrite(log->write_zfd, PRELOG_BINLOG_MAGIC, PRELOG_BINLOG_MAGIC_LEN);
+}
+
+// Sends the log to a journal, if PRELOG_JOURNAL asks for one
+static void prelog_log_open_journal (PrelogLog *log)
+{
+  const char *journal = getenv(PRELOG_JOURNAL_ENV);
+  if (!journal || strcmp(journal, "1"))
+    return;
+
+  char *path = prelog_log_new_path ("journal");
+  if (!path)
+    return;
+
+  typeof(open) *original_open;
+  original_open = PRELOG_ORIGINAL(open);
+  typeof(close) *original_close;
+  original_close = PRELOG_ORIGINAL(close);
+  typeof(unlink) *original_unlink;
+  original_unlink = PRELOG_ORIGINAL(unlink);
+
+  int fd = (*original_open) (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    log->journal = prelog_journal_create (fd, PRELOG_JOURNAL_SEGMENT);
+    if (!log->journal) {
+      (*original_close) (fd);
+      (*original_unlink) (path);
     }
   }
 
+  free (path);
+}
+
+/* Process counters, in a page of HOME that a process image maps the first
+ * time it counts itself, and which forked children inherit. The mapping is
+ * kept for the life of the process image, so counting again takes no system
+ * call. Call with _prelog_lock held. */
+static PrelogStats *_prelog_stats = NULL;
+
+static void prelog_log_map_stats (void)
+{
+  const char *home = getenv("HOME");
+  if (!home)
+    return;
+
+  char dir[PATH_MAX], path[PATH_MAX];
+  int written = snprintf (dir, sizeof (dir), "%s/%s", home, PRELOG_TARGET_DIR);
+  if (written < 0 || (size_t) written >= sizeof (dir))
+    return;
+  written = snprintf (path, sizeof (path), "%s/%s", dir, PRELOG_STATS_FILE);
+  if (written < 0 || (size_t) written >= sizeof (path))
+    return;
+
+  typeof(open) *original_open;
+  original_open = PRELOG_ORIGINAL(open);
+  typeof(close) *original_close;
+  original_close = PRELOG_ORIGINAL(close);
+
+  int fd = (*original_open) (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0 && errno == ENOENT) {
+    prelog_mkdir (dir);
+    fd = (*original_open) (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  }
+  if (fd < 0)
+    return;
+
+  // Growing the file is the same for everyone, so racing processes agree
+  struct stat st;
+  if (fstat (fd, &st) == 0 && (st.st_size >= PRELOG_STATS_SIZE || ftruncate (fd, PRELOG_STATS_SIZE) == 0)) {
+    void *addr = mmap (NULL, PRELOG_STATS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED)
+      _prelog_stats = addr;
+  }
+  (*original_close) (fd);
+}
+
+static void prelog_log_count (uint64_t *counter)
+{
+  __atomic_add_fetch (counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Creating a log is cheap: the collector connection or the log file, its
+ * header and the exit handler only come with the first event that passes the
+ * filters, see prelog_log_open. Processes that only touch system files, that
+ * are not allowed to log or that exec right after forking never get one. */
+static PrelogLog *prelog_log_create (void)
+{
+  PrelogLog *log = malloc(sizeof(PrelogLog));
+  if(!log)
+      return NULL;
+  //log->write_fd = -1;
+  log->write_zfd = NULL;
+  log->collector_fd = -1;
+  log->ring = NULL;
+  log->binlog = NULL;
+  log->journal = NULL;
+  log->opened = 0;
+
   return log;
 }
 
+// Call with _prelog_lock held
+static void prelog_log_count_process (int logging)
+{
+  if (_prelog_stats_counted == PRELOG_STATS_LOGGING ||
+      (_prelog_stats_counted == PRELOG_STATS_PROCESS && !logging))
+    return;
+
+  if (!_prelog_stats)
+    prelog_log_map_stats();
+  if (_prelog_stats && _prelog_stats_counted == PRELOG_STATS_UNCOUNTED)
+    prelog_log_count(&_prelog_stats->processes);
+  if (_prelog_stats && logging)
+    prelog_log_count(&_prelog_stats->logging);
+  _prelog_stats_counted = logging ? PRELOG_STATS_LOGGING : PRELOG_STATS_PROCESS;
+}
+
+// Counts a process that never logged, on its way out or to another image
+void prelog_log_count_unlogged (void)
+{
+  if (!prelog_is_user_process() || !prelog_log_allowed_to_log())
+    return;
+
+  pthread_mutex_lock(&_prelog_lock);
+  prelog_log_count_process(0);
+  pthread_mutex_unlock(&_prelog_lock);
+}
+
+// Registering takes no system call, the stats are only mapped at exit
+__attribute__((constructor))
+static void prelog_log_stats_init (void)
+{
+  atexit(prelog_log_count_unlogged);
+}
+
+// Gives the log somewhere to go, the first time it has something to say
+static void prelog_log_open (PrelogLog *log)
+{
+  if (__atomic_load_n (&log->opened, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&_prelog_lock);
+  if (log->opened) {
+    pthread_mutex_unlock(&_prelog_lock);
+    return;
+  }
+
+  /* Prefer the collector, and only create a file of our own without one */
+  log->collector_fd = prelog_log_connect_collector();
+  if (log->collector_fd < 0)
+    prelog_log_open_journal(log);
+  if (log->collector_fd < 0 && !log->journal)
+    prelog_log_open_file(log, 1);
+  else if (log->collector_fd >= 0)
+    log->ring = prelog_log_attach_ring();
+
+  if (log->collector_fd >= 0 || getenv("HOME")) {
+    prelog_log_log_process_data(log);
+
+    if (!_prelog_exit_registered) {
+      _prelog_exit_registered = 1;
+      atexit(prelog_log_shutdown);
+    }
+  }
+
+  prelog_log_count_process(1);
+
+  __atomic_store_n (&log->opened, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&_prelog_lock);
+}
+
+int prelog_log_is_open (PrelogLog *log)
+{
+  return log && __atomic_load_n (&log->opened, __ATOMIC_ACQUIRE);
+}
+
+// Ends the current gzip member so that the file reads back whole even if the
+// log never gets closed, as when exec replaces the image. Later writes start
+// a new member. Call with the writer lock held.
+void prelog_log_finish (PrelogLog *log)
+{
+  if (log && log->write_zfd != NULL)
+    gzflush(log->write_zfd, Z_FINISH);
+}
+
+// Lays a serialized event out for the log in out, which must have room for
+// PRELOG_STAMP_MAX + len bytes at least. Call with the writer lock held.
+size_t prelog_log_format_record (PrelogLog *log, char *out, size_t room, PrelogTime timestamp,
+                                 const PrelogTime *previous, const char *record, size_t len)
+{
+  if (log && log->binlog)
+    return prelog_binlog_encode_record(log->binlog, out, room, timestamp, record, len);
+
+  size_t n = prelog_timestamp_serialize(out, PRELOG_STAMP_MAX - 1, timestamp, previous);
+  out[n++] = '|';
+  memcpy(out + n, record, len);
+  return n + len;
+}
+
+void prelog_log_insert (PrelogLog *log, PrelogTime timestamp, const char *interpretation, PrelogSubject *const *subjects)
+{
+  if(!log || !interpretation)
+    return;
+
+  if(!prelog_log_allowed_to_log())
+    return;
+
+  prelog_log_open(log);
+  if(log->write_zfd == NULL && log->collector_fd < 0 && !log->journal)
+    return;
+
+  char *msg = prelog_writer_scratch();
+  if (!msg)
+    return;
+
+  size_t len = prelog_event_serialize(msg, PRELOG_RECORD_MAX, interpretation, subjects);
+  if (len > PRELOG_RECORD_MAX)
+    len = PRELOG_RECORD_MAX;
+
+  // Straight to the journal, where it is safe from crashes
+  if (log->journal) {
+    prelog_journal_append(log->journal, PRELOG_JOURNAL_EVENT, timestamp, msg, len);
+    return;
+  }
+
+  // Through the collector's ring if there is room, through our writer if not
+  PrelogShmRing *ring = __atomic_load_n(&log->ring, __ATOMIC_ACQUIRE);
+  if (ring && prelog_shm_ring_append(ring, timestamp, msg, len) == 0)
+    return;
+  prelog_writer_append(log, timestamp, msg, len);
+}
+
 void prelog_log_insert_event (PrelogLog *log, PrelogEvent *event)
 {
   if(!log || !event)
@@ -504,43 +899,10 @@ void prelog_log_insert_event (PrelogLog *log, PrelogEvent *event)
 
   if (!event->interpretation) {
     //fprintf (stderr, "UCL study: trying to log event without interpretation, ignoring.\n");
+    prelog_event_free (event);
     return;
   }
 
-  pthread_mutex_lock(&_prelog_lock);
-  char *msg = NULL;
-  size_t msg_len = 0;
-  
-  msg_len = strlen(event->interpretation) + /* actually time_t is a long int so 12 would suffice */ + 24 /*timestamp*/ + 200 /* format string */;
-  msg = malloc(sizeof (char) * msg_len);
-  snprintf(msg, msg_len, "%li|%s%s",
-                         event->timestamp,
-                         event->interpretation,
-                         (event->subjects && !event->subjects[1] ? "|":"\n"));//, event->manifestation);
-
-  int i=0;
-  while (event->subjects && event->subjects[i]) {
-    PrelogSubject *s = event->subjects[i];
-
-    char *old = strdup(msg);
-    size_t slen = strlen(s->uri) + (s->origin ? strlen(s->origin):0) + (s->text ? strlen(s->text):0) + 200;
-    msg = realloc (msg, strlen(old) + slen);
-    snprintf(msg, strlen(old) + slen, "%s%s%s|%s|%s\n",
-                                      old,
-                                       (event->subjects && !event->subjects[1] ? "":" "),
-                                      s->uri,
-                                      s->text,
-                                      s->origin? s->origin:"");
-    free (old);
-    ++i;
-  }
-
-  if(log->write_zfd != NULL && prelog_log_allowed_to_log()) {
-    //write(log->write_fd, msg, strlen(msg));
-    gzwrite(log->write_zfd, msg, strlen(msg));
-  }
-  
-  free(msg);
+  prelog_log_insert(log, event->timestamp, event->interpretation, event->subjects);
   prelog_event_free (event);
-  pthread_mutex_unlock(&_prelog_lock);
 }
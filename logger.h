@@ -19,7 +19,9 @@
 #ifndef	_LOGGER_H
 #define	_LOGGER_H	1
 
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include "zlib/zlib.h"
 
 typedef enum {
@@ -53,6 +55,8 @@ typedef enum {
  *             Steve Dodier-Lazaro <sidnioulz@gmail.com>
  */
 
+typedef int64_t PrelogTime; /* nanoseconds since the epoch */
+
 typedef struct _PrelogSubject {
   char              *uri;
   char              *origin;
@@ -60,7 +64,7 @@ typedef struct _PrelogSubject {
 } PrelogSubject;
 
 typedef struct _PrelogEvent {
-  time_t             timestamp;
+  PrelogTime         timestamp;
   char              *interpretation;
   PrelogSubject **subjects;
 } PrelogEvent;
@@ -68,18 +72,54 @@ typedef struct _PrelogEvent {
 typedef struct _PrelogLog {
 //  int                write_fd;
   gzFile             write_zfd;
+  int                collector_fd; /* -1 unless the log goes to a collector */
+  struct _PrelogShmRing *ring;     /* shared with the collector, if it has one */
+  struct _PrelogBinlog *binlog;    /* string table of a binary log */
+  struct _PrelogJournal *journal;  /* set in journal mode */
+  int                opened;       /* set once the above are */
 } PrelogLog;
 
 #define PRELOG_TARGET_DIR    ".local/share/zeitgeist"
 #define PRELOG_TARGET_FILE   "syscalls.log"
 #define PRELOG_LOG_FORBIDDEN "LOGGING-FORBIDDEN.lock"
 #define PRELOG_TARGET_PATH    ".local/share/zeitgeist/syscalls.log"
+#define PRELOG_STATS_FILE    "preload-logger.stats"
+#define PRELOG_STATS_SIZE    4096
+
+/* Counters shared by every process of the user, in PRELOG_STATS_FILE next to
+ * the logs. Each process counts itself on its first event, or else at exit or
+ * exec. Processes that never logged are processes - logging. */
+typedef struct _PrelogStats {
+  uint64_t           processes;    /* process images and forks allowed to log */
+  uint64_t           logging;      /* those that had an event for it */
+} PrelogStats;
 
 #define PRELOG_CMDLINE_LEN   32000
+#define PRELOG_FIELD_MAX     8192
+#define PRELOG_RECORD_MAX    (64 * 1024) /* fits an interpretation and two full subjects */
+#define PRELOG_STAMP_MAX     48          /* a serialized timestamp and its separator */
+#define PRELOG_MESSAGE_MAX   (PRELOG_RECORD_MAX + PRELOG_STAMP_MAX) /* one write to the log */
+
+#define PRELOG_PERMISSION_TTL_MS 1000        /* how long logging permissions are cached */
+#define PRELOG_BUFFER_SIZE       (64 * 1024) /* per-thread ring of pending records */
+#define PRELOG_WRITER_INTERVAL   1           /* seconds between two drains at most */
+#define PRELOG_EXEC_FLUSH_MS     5           /* time exec waits for pending records at most */
+#define PRELOG_EXEC_GENERATIONS  1000        /* files an image and those it execs open per second */
+
+#define PRELOG_NSEC_PER_SEC      1000000000LL
+#define PRELOG_CLOCK_ENV         "PRELOG_CLOCK" /* set to "coarse" for a cheaper, jiffy-grained clock */
 
-char *prelog_get_actor_from_pid (pid_t pid);
+PrelogTime prelog_clock_now (void);
+PrelogTime prelog_clock_monotonic (void);
+void prelog_clock_stamp (void);
+PrelogTime prelog_clock_stamped (void);
+PrelogTime prelog_clock_started (void);
+
+int prelog_is_user_process (void);
+int prelog_log_allowed_to_log (void);
 
 PrelogSubject *prelog_subject_new (void);
+void prelog_subject_init (PrelogSubject *s, const char *uri, const char *text, const char *origin);
 void prelog_subject_free (PrelogSubject *s);
 void prelog_subject_set_uri (PrelogSubject *s, const char *uri);
 void prelog_subject_set_origin (PrelogSubject *s, const char *origin);
@@ -91,7 +131,29 @@ void prelog_event_set_interpretation (PrelogEvent *e, const char *interpretation
 void prelog_event_add_subject (PrelogEvent *e, PrelogSubject *s);
 
 PrelogLog *prelog_log_get_default (PrelogLogResetFlag reset);
+void prelog_log_fork_prepare (void);
+void prelog_log_fork_parent (void);
+void prelog_log_fork_child (void);
+void prelog_log_count_unlogged (void);
+int prelog_log_is_open (PrelogLog *log);
+void prelog_log_write (PrelogLog *log, const char *data, size_t len);
+void prelog_log_finish (PrelogLog *log);
+size_t prelog_log_format_record (PrelogLog *log, char *out, size_t room, PrelogTime timestamp,
+                                 const PrelogTime *previous, const char *record, size_t len);
 void prelog_log_insert_event (PrelogLog *log, PrelogEvent *event);
+void prelog_log_insert (PrelogLog *log, PrelogTime timestamp, const char *interpretation, PrelogSubject *const *subjects);
+
+size_t prelog_event_serialize (char *buffer, size_t size,
+                               const char *interpretation, PrelogSubject *const *subjects);
+size_t prelog_timestamp_serialize (char *buffer, size_t size, PrelogTime timestamp, const PrelogTime *previous);
+
+char *prelog_writer_scratch (void);
+void prelog_writer_append (PrelogLog *log, PrelogTime timestamp, const char *record, size_t len);
+void prelog_writer_shutdown (void);
+void prelog_writer_sync (PrelogLog *log);
+void prelog_writer_fork_prepare (void);
+void prelog_writer_fork_parent (void);
+void prelog_writer_reset_after_fork (void);
 
 
 #define CREAT_SCI          "creat"
@@ -107,6 +169,16 @@ void prelog_log_insert_event (PrelogLog *log, PrelogEvent *event);
 #define FCLOSE_SCI         "fclose"
 #define PCLOSE_SCI         "pclose"
 #define FORK_SCI             "fork"
+#define EXECVE_SCI           "execve"
+#define EXECV_SCI            "execv"
+#define EXECVP_SCI           "execvp"
+#define EXECVPE_SCI          "execvpe"
+#define EXECL_SCI            "execl"
+#define EXECLP_SCI           "execlp"
+#define EXECLE_SCI           "execle"
+#define FEXECVE_SCI          "fexecve"
+#define POSIX_SPAWN_SCI      "posix_spawn"
+#define POSIX_SPAWNP_SCI     "posix_spawnp"
 #define DUP_SCI              "dup"
 #define DUP2_SCI             "dup2"
 #define DUP3_SCI             "dup3"
@@ -133,5 +205,7 @@ void prelog_log_insert_event (PrelogLog *log, PrelogEvent *event);
 #define RENAMEAT2_SCI        "renameat2"
 #define SHM_OPEN_SCI         "shm_open"
 #define SHM_UNLINK_SCI       "shm_unlink"
+#define FSYNC_SCI            "fsync"
+#define FDATASYNC_SCI        "fdatasync"
 
 #endif /* LOGGER.h  */
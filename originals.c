@@ -0,0 +1,81 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "originals.h"
+
+PrelogOriginals prelog_originals;
+
+static pthread_once_t _prelog_originals_once = PTHREAD_ONCE_INIT;
+
+#define PRELOG_ORIGINALS_RESOLVE(name) \
+  prelog_originals.name = dlsym (RTLD_NEXT, #name);
+
+static void prelog_originals_resolve (void)
+{
+  PRELOG_ORIGINALS_FOREACH(PRELOG_ORIGINALS_RESOLVE)
+
+  // Only try RTLD_NEXT here, the librt fallback is left to first use
+  prelog_originals.shm_open = dlsym (RTLD_NEXT, "shm_open");
+  prelog_originals.shm_unlink = dlsym (RTLD_NEXT, "shm_unlink");
+
+  __atomic_store_n (&prelog_originals.ready, 1, __ATOMIC_RELEASE);
+}
+
+__attribute__((constructor))
+void prelog_originals_init (void)
+{
+  pthread_once (&_prelog_originals_once, prelog_originals_resolve);
+}
+
+static void *prelog_original_from_librt (const char *name)
+{
+  void *handle = dlopen ("librt.so", RTLD_NOW);
+  if (!handle)
+    handle = dlopen ("librt.so.1", RTLD_NOW);
+
+  return handle ? dlsym (handle, name) : NULL;
+}
+
+typeof(shm_open) *prelog_original_shm_open (void)
+{
+  typeof(shm_open) *fn = PRELOG_ORIGINAL(shm_open);
+
+  if (!fn) {
+    fn = prelog_original_from_librt ("shm_open");
+    __atomic_store_n (&prelog_originals.shm_open, fn, __ATOMIC_RELEASE);
+  }
+
+  return fn;
+}
+
+typeof(shm_unlink) *prelog_original_shm_unlink (void)
+{
+  typeof(shm_unlink) *fn = PRELOG_ORIGINAL(shm_unlink);
+
+  if (!fn) {
+    fn = prelog_original_from_librt ("shm_unlink");
+    __atomic_store_n (&prelog_originals.shm_unlink, fn, __ATOMIC_RELEASE);
+  }
+
+  return fn;
+}
@@ -0,0 +1,76 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_ORIGINALS_H
+#define	_ORIGINALS_H	1
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Every libc function we wrap or call behind our own wrappers' back. The
+ * table is filled once by a constructor so that wrappers only pay for an
+ * indirect call instead of a dlsym (RTLD_NEXT, ...) lookup per invocation.
+ * shm_open and shm_unlink live in librt on older systems, so they are not
+ * part of this list and are resolved lazily, see prelog_original_shm_*. */
+#define PRELOG_ORIGINALS_FOREACH(X) \
+  X(open)        X(open64)      X(openat)      X(openat64)    X(creat)      \
+  X(close)       X(dup)         X(dup2)        X(dup3)                      \
+  X(link)        X(linkat)      X(symlink)     X(symlinkat)                 \
+  X(fopen)       X(freopen)     X(fdopen)      X(fclose)                    \
+  X(popen)       X(pclose)      X(mkfifo)      X(mkfifoat)                  \
+  X(pipe)        X(pipe2)       X(socket)      X(socketpair)  X(fork)      \
+  X(opendir)     X(fdopendir)   X(closedir)    X(mkdir)       X(mkdirat)    \
+  X(rename)      X(renameat)    X(renameat2)                                \
+  X(remove)      X(rmdir)       X(unlink)      X(access)                    \
+  X(chdir)       X(fchdir)                                                  \
+  X(read)        X(write)       X(pread)       X(pread64)     X(pwrite)     \
+  X(pwrite64)    X(readv)       X(writev)      X(fread)       X(fwrite)     \
+  X(fsync)       X(fdatasync)                                               \
+  X(execve)      X(execv)       X(execvp)      X(execvpe)     X(fexecve)    \
+  X(posix_spawn) X(posix_spawnp)
+
+#define PRELOG_ORIGINALS_DECLARE(name) typeof(name) *name;
+
+typedef struct _PrelogOriginals {
+  int                ready;
+  PRELOG_ORIGINALS_FOREACH(PRELOG_ORIGINALS_DECLARE)
+  typeof(shm_open)   *shm_open;
+  typeof(shm_unlink) *shm_unlink;
+} PrelogOriginals;
+
+extern PrelogOriginals prelog_originals;
+
+void prelog_originals_init (void);
+typeof(shm_open)   *prelog_original_shm_open (void);
+typeof(shm_unlink) *prelog_original_shm_unlink (void);
+
+/* Wrappers can be reached before our constructor ran, e.g. from another
+ * library's constructor, in which case the table is filled on first use. */
+#define PRELOG_ORIGINAL(name) \
+  ((__builtin_expect (__atomic_load_n (&prelog_originals.ready, __ATOMIC_ACQUIRE), 1) ? \
+    (void) 0 : prelog_originals_init ()), prelog_originals.name)
+
+#endif /* ORIGINALS.h  */
@@ -0,0 +1,341 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "pathfilter.h"
+
+/* Rules are turned into sequences of tokens, each accepting a set of bytes
+ * once or any number of times. A DFA state is a set of positions in those
+ * sequences, plus the flags of the rules already matched, which stick. Rules
+ * whose flag is already set are dropped from the state, so that the DFA
+ * stays small and walks end early. */
+
+typedef struct _PrelogPathToken {
+  unsigned char      set[32];
+  int                repeat;
+} PrelogPathToken;
+
+typedef struct _PrelogPathRule {
+  PrelogPathToken   *tokens;
+  size_t             n_tokens;
+  int                flag;
+} PrelogPathRule;
+
+typedef struct _PrelogPathState {
+  uint32_t          *positions; /* rule << 16 | token index, sorted */
+  size_t             n_positions;
+  int                flags;
+} PrelogPathState;
+
+typedef struct _PrelogPathFilter {
+  uint16_t         (*next)[256];
+  unsigned char     *flags;
+  unsigned char     *live;
+} PrelogPathFilter;
+
+static PrelogPathFilter _prelog_path_filter;
+static pthread_once_t _prelog_path_filter_once = PTHREAD_ONCE_INIT;
+
+static void prelog_path_set_add (unsigned char *set, unsigned char c)
+{
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+static int prelog_path_set_has (const unsigned char *set, unsigned char c)
+{
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+// Parses a bracket class starting after '[', returns the byte after ']'
+static const char *prelog_path_parse_class (const char *p, unsigned char *set)
+{
+  unsigned char class[32] = { 0 };
+  int negate = 0, i;
+
+  if (*p == '!' || *p == '^') {
+    negate = 1;
+    p++;
+  }
+
+  if (!*p)
+    return p;
+
+  // A ']' right after the opening bracket is a literal
+  do {
+    unsigned char lo = *p == '\\' && p[1] ? *++p : *p;
+    unsigned char hi = lo;
+    if (p[1] == '-' && p[2] && p[2] != ']') {
+      p += 2;
+      hi = *p == '\\' && p[1] ? *++p : *p;
+    }
+    for (i = lo; i <= hi; ++i)
+      prelog_path_set_add (class, i);
+    p++;
+  } while (*p && *p != ']');
+
+  for (i = 0; i < 32; ++i)
+    set[i] = negate ? ~class[i] : class[i];
+
+  return *p ? p + 1 : p;
+}
+
+static int prelog_path_rule_compile (PrelogPathRule *rule, const char *pattern, int flag)
+{
+  size_t len = strlen (pattern), n = 0;
+  const char *p = pattern;
+
+  rule->tokens = calloc (len ? len : 1, sizeof (PrelogPathToken));
+  if (!rule->tokens)
+    return 0;
+
+  while (*p) {
+    PrelogPathToken *t = &rule->tokens[n++];
+
+    if (p[0] == '*' && p[1] == '*') {
+      memset (t->set, 0xff, sizeof (t->set));
+      t->repeat = 1;
+      p += 2;
+    } else if (*p == '*' || *p == '?') {
+      memset (t->set, 0xff, sizeof (t->set));
+      t->set['/' >> 3] &= ~(1 << ('/' & 7));
+      t->repeat = *p == '*';
+      p++;
+    } else if (*p == '[') {
+      p = prelog_path_parse_class (p + 1, t->set);
+    } else {
+      if (*p == '\\' && p[1])
+        p++;
+      prelog_path_set_add (t->set, *p++);
+    }
+  }
+
+  rule->n_tokens = n;
+  rule->flag = flag;
+  return 1;
+}
+
+// Adds a position and whatever follows it through repeated tokens, which
+// can match nothing. Reaching the end of a rule latches its flag.
+static void prelog_path_state_add (PrelogPathState *s, const PrelogPathRule *rules, uint32_t rule, uint32_t index)
+{
+  for (;;) {
+    if (index == rules[rule].n_tokens) {
+      s->flags |= rules[rule].flag;
+      return;
+    }
+
+    uint32_t position = rule << 16 | index;
+    size_t i;
+    for (i = 0; i < s->n_positions && s->positions[i] != position; ++i);
+    if (i == s->n_positions)
+      s->positions[s->n_positions++] = position;
+
+    if (!rules[rule].tokens[index].repeat)
+      return;
+    index++;
+  }
+}
+
+static int prelog_path_position_compare (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Drops the rules that cannot change the outcome any more, and sorts the
+// positions so that equal states compare equal
+static void prelog_path_state_normalize (PrelogPathState *s, const PrelogPathRule *rules)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < s->n_positions; ++i)
+    if ((rules[s->positions[i] >> 16].flag & ~s->flags) != 0)
+      s->positions[n++] = s->positions[i];
+
+  s->n_positions = n;
+  qsort (s->positions, n, sizeof (uint32_t), prelog_path_position_compare);
+}
+
+static int prelog_path_filter_build (PrelogPathFilter *filter, const PrelogPathRule *rules, size_t n_rules)
+{
+  PrelogPathState *states = calloc (PRELOG_PATH_MAX_STATES, sizeof (PrelogPathState));
+  size_t n_states = 0, max_positions = 0, i, s;
+  uint32_t r;
+  int ok = 0;
+
+  for (r = 0; r < n_rules; ++r)
+    max_positions += rules[r].n_tokens;
+
+  filter->next = calloc (PRELOG_PATH_MAX_STATES, sizeof (*filter->next));
+  uint32_t *scratch = malloc ((max_positions + 1) * sizeof (uint32_t));
+  if (!states || !filter->next || !scratch)
+    goto out;
+
+  // The start state: every rule at its first token
+  states[0].positions = malloc ((max_positions + 1) * sizeof (uint32_t));
+  if (!states[0].positions)
+    goto out;
+  for (r = 0; r < n_rules; ++r)
+    prelog_path_state_add (&states[0], rules, r, 0);
+  prelog_path_state_normalize (&states[0], rules);
+  n_states = 1;
+
+  for (s = 0; s < n_states; ++s) {
+    int c;
+    for (c = 0; c < 256; ++c) {
+      PrelogPathState next = { scratch, 0, states[s].flags };
+
+      for (i = 0; i < states[s].n_positions; ++i) {
+        uint32_t rule = states[s].positions[i] >> 16, index = states[s].positions[i] & 0xffff;
+        const PrelogPathToken *t = &rules[rule].tokens[index];
+        if (prelog_path_set_has (t->set, c))
+          prelog_path_state_add (&next, rules, rule, t->repeat ? index : index + 1);
+      }
+      prelog_path_state_normalize (&next, rules);
+
+      size_t found;
+      for (found = 0; found < n_states; ++found)
+        if (states[found].flags == next.flags && states[found].n_positions == next.n_positions
+            && !memcmp (states[found].positions, next.positions, next.n_positions * sizeof (uint32_t)))
+          break;
+
+      if (found == n_states) {
+        if (n_states == PRELOG_PATH_MAX_STATES)
+          goto out;
+        states[n_states].positions = malloc ((next.n_positions + 1) * sizeof (uint32_t));
+        if (!states[n_states].positions)
+          goto out;
+        memcpy (states[n_states].positions, next.positions, next.n_positions * sizeof (uint32_t));
+        states[n_states].n_positions = next.n_positions;
+        states[n_states].flags = next.flags;
+        n_states++;
+      }
+
+      filter->next[s][c] = found;
+    }
+  }
+
+  filter->flags = malloc (n_states);
+  filter->live = malloc (n_states);
+  if (!filter->flags || !filter->live)
+    goto out;
+
+  for (s = 0; s < n_states; ++s) {
+    filter->flags[s] = states[s].flags;
+    filter->live[s] = states[s].n_positions != 0;
+  }
+  ok = 1;
+
+out:
+  if (!ok) {
+    free (filter->next);
+    free (filter->flags);
+    free (filter->live);
+    memset (filter, 0, sizeof (*filter));
+  }
+  for (s = 0; states && s < n_states; ++s)
+    free (states[s].positions);
+  free (states);
+  free (scratch);
+  return ok;
+}
+
+// Copies src into dst with glob characters escaped
+static void prelog_path_escape (char *dst, size_t len, const char *src)
+{
+  size_t n = 0;
+  for (; *src && n + 2 < len; ++src) {
+    if (strchr ("*?[\\", *src))
+      dst[n++] = '\\';
+    dst[n++] = *src;
+  }
+  dst[n] = '\0';
+}
+
+static void prelog_path_filter_init (void)
+{
+  PrelogPathRule rules[PRELOG_PATH_MAX_RULES];
+  size_t n_rules = 0, n_defaults, i;
+  char home[PATH_MAX], pattern[2 * PATH_MAX];
+
+  const char *env = getenv ("HOME");
+  prelog_path_escape (home, sizeof (home), env ? env : "/usr");
+
+  // Our log files in ~/.local/share/... are off-limits, and we don't care
+  // about /etc, /usr...
+  snprintf (pattern, sizeof (pattern), "%s/%s", home, PRELOG_TARGET_DIR);
+  n_rules += prelog_path_rule_compile (&rules[n_rules], pattern, PRELOG_PATH_EXCLUDED);
+  snprintf (pattern, sizeof (pattern), "%s/.cache/", home);
+  n_rules += prelog_path_rule_compile (&rules[n_rules], pattern, PRELOG_PATH_EXCLUDED);
+  n_rules += prelog_path_rule_compile (&rules[n_rules], "/home/", PRELOG_PATH_INCLUDED);
+  n_rules += prelog_path_rule_compile (&rules[n_rules], "/tmp/", PRELOG_PATH_INCLUDED);
+  n_rules += prelog_path_rule_compile (&rules[n_rules], "[!/]", PRELOG_PATH_INCLUDED);
+  n_defaults = n_rules;
+
+  const char *extra = getenv (PRELOG_PATH_RULES_ENV);
+  while (extra && *extra && n_rules < PRELOG_PATH_MAX_RULES) {
+    const char *end = strchrnul (extra, ':');
+    size_t len = end - extra;
+
+    if (len > 1 && len < sizeof (pattern) && (*extra == '+' || *extra == '-')) {
+      memcpy (pattern, extra + 1, len - 1);
+      pattern[len - 1] = '\0';
+      n_rules += prelog_path_rule_compile (&rules[n_rules], pattern,
+                                           *extra == '+' ? PRELOG_PATH_INCLUDED : PRELOG_PATH_EXCLUDED);
+    }
+
+    extra = *end ? end + 1 : end;
+  }
+
+  if (!prelog_path_filter_build (&_prelog_path_filter, rules, n_rules)) {
+    fprintf (stderr, "PreloadLogger Error: the rules in %s could not be compiled, using the default rules.\n", PRELOG_PATH_RULES_ENV);
+    prelog_path_filter_build (&_prelog_path_filter, rules, n_defaults);
+  }
+
+  for (i = 0; i < n_rules; ++i)
+    free (rules[i].tokens);
+}
+
+int prelog_path_classify (const char *path)
+{
+  // Whatever we cannot name must not be logged
+  if (!path)
+    return PRELOG_PATH_EXCLUDED;
+
+  pthread_once (&_prelog_path_filter_once, prelog_path_filter_init);
+
+  const PrelogPathFilter *filter = &_prelog_path_filter;
+  if (!filter->next)
+    return 0;
+
+  const unsigned char *p = (const unsigned char *) path;
+  unsigned int state = 0;
+  while (*p && filter->live[state])
+    state = filter->next[state][*p++];
+
+  return filter->flags[state];
+}
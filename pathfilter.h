@@ -0,0 +1,47 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_PATHFILTER_H
+#define	_PATHFILTER_H	1
+
+/* Decides which paths are worth logging. A rule set of include and exclude
+ * patterns is compiled once into a DFA, so that classifying a path is a
+ * single pass over its bytes, which stops as soon as no rule can change the
+ * outcome any more. Patterns match path prefixes and support globs:
+ *
+ *   *      any run of bytes but '/'
+ *   **     any run of bytes
+ *   ?      any byte but '/'
+ *   [a-z]  a byte from a class, negated with [!...]
+ *   \x     the byte x itself
+ *
+ * The default rules include /home/, /tmp/ and relative paths, and exclude
+ * our own log directory and the user's cache. More rules can be appended
+ * with PRELOG_PATH_RULES, a ':'-separated list of "+pattern" to include and
+ * "-pattern" to exclude. */
+
+#define PRELOG_PATH_INCLUDED   1 /* we care about this path */
+#define PRELOG_PATH_EXCLUDED   2 /* this path must never be logged */
+
+#define PRELOG_PATH_RULES_ENV  "PRELOG_PATH_RULES"
+#define PRELOG_PATH_MAX_RULES  64
+#define PRELOG_PATH_MAX_STATES 4096
+
+int prelog_path_classify (const char *path);
+
+#endif /* PATHFILTER.h  */
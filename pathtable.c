@@ -0,0 +1,228 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathtable.h"
+
+static uint32_t prelog_path_table_hash (const char *path, size_t len)
+{
+  uint32_t hash = 2166136261U; // FNV-1a
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    hash ^= (unsigned char) path[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static PrelogPathEntry *prelog_path_table_entry (const PrelogPathTable *table, uint32_t id)
+{
+  if (!id || id > table->n_entries || !table->entries[id - 1].path)
+    return NULL;
+  return &table->entries[id - 1];
+}
+
+// Index slot of path, or of the empty slot where it would go
+static uint32_t prelog_path_table_find (const PrelogPathTable *table, const char *path, size_t len,
+                                        uint32_t hash, uint32_t *slot)
+{
+  uint32_t mask = table->index_size - 1;
+  uint32_t i = hash & mask, id;
+
+  while ((id = table->index[i])) {
+    const PrelogPathEntry *e = &table->entries[id - 1];
+    if (e->hash == hash && e->len == len && !memcmp (e->path, path, len))
+      break;
+    i = (i + 1) & mask;
+  }
+
+  *slot = i;
+  return id;
+}
+
+static int prelog_path_table_resize (PrelogPathTable *table, uint32_t size)
+{
+  uint32_t *index = calloc (size, sizeof (uint32_t));
+  if (!index)
+    return 0;
+
+  uint32_t *old_index = table->index, old_size = table->index_size, i;
+  table->index = index;
+  table->index_size = size;
+
+  for (i = 0; i < old_size; ++i) {
+    if (old_index[i]) {
+      PrelogPathEntry *e = &table->entries[old_index[i] - 1];
+      uint32_t slot;
+      prelog_path_table_find (table, e->path, e->len, e->hash, &slot);
+      index[slot] = old_index[i];
+    }
+  }
+
+  free (old_index);
+  return 1;
+}
+
+// Takes the index slot of an entry out, shifting its cluster back
+static void prelog_path_table_unindex (PrelogPathTable *table, uint32_t hole)
+{
+  uint32_t mask = table->index_size - 1, next = hole, home;
+
+  for (;;) {
+    next = (next + 1) & mask;
+    if (!table->index[next])
+      break;
+
+    home = table->entries[table->index[next] - 1].hash & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      table->index[hole] = table->index[next];
+      hole = next;
+    }
+  }
+
+  table->index[hole] = 0;
+}
+
+static void prelog_path_table_unlink (PrelogPathTable *table, uint32_t id)
+{
+  PrelogPathEntry *e = &table->entries[id - 1];
+
+  if (e->prev)
+    table->entries[e->prev - 1].next = e->next;
+  else
+    table->oldest = e->next;
+  if (e->next)
+    table->entries[e->next - 1].prev = e->prev;
+  else
+    table->newest = e->prev;
+
+  e->prev = e->next = 0;
+  table->n_unused--;
+}
+
+static void prelog_path_table_evict (PrelogPathTable *table, uint32_t id)
+{
+  PrelogPathEntry *e = &table->entries[id - 1];
+  uint32_t slot;
+
+  prelog_path_table_unlink (table, id);
+  prelog_path_table_find (table, e->path, e->len, e->hash, &slot);
+  prelog_path_table_unindex (table, slot);
+
+  free (e->path);
+  e->path = NULL;
+  e->next = table->free;
+  table->free = id;
+  table->size--;
+}
+
+// Returns the id of path with a new reference to it, or 0 if out of memory
+uint32_t prelog_path_table_intern (PrelogPathTable *table, const char *path, size_t len)
+{
+  uint32_t hash, slot, id;
+
+  if (!path)
+    return 0;
+  hash = prelog_path_table_hash (path, len);
+
+  if ((table->size + 1) * 2 > table->index_size) {
+    uint32_t size = table->index_size ? table->index_size * 2 : PRELOG_PATH_TABLE_MIN_SIZE;
+    if (!prelog_path_table_resize (table, size))
+      return 0;
+  }
+
+  id = prelog_path_table_find (table, path, len, hash, &slot);
+  if (id) {
+    prelog_path_table_ref (table, id);
+    return id;
+  }
+
+  char *copy = malloc (len + 1);
+  if (!copy)
+    return 0;
+  memcpy (copy, path, len);
+  copy[len] = '\0';
+
+  if (table->free) {
+    id = table->free;
+    table->free = table->entries[id - 1].next;
+  } else {
+    if (table->n_entries == table->capacity) {
+      uint32_t capacity = table->capacity ? table->capacity * 2 : PRELOG_PATH_TABLE_MIN_SIZE;
+      PrelogPathEntry *entries = realloc (table->entries, capacity * sizeof (PrelogPathEntry));
+      if (!entries) {
+        free (copy);
+        return 0;
+      }
+      table->entries = entries;
+      table->capacity = capacity;
+    }
+    id = ++table->n_entries;
+  }
+
+  PrelogPathEntry *e = &table->entries[id - 1];
+  e->path = copy;
+  e->len = len;
+  e->hash = hash;
+  e->refs = 1;
+  e->prev = e->next = 0;
+  table->index[slot] = id;
+  table->size++;
+
+  return id;
+}
+
+void prelog_path_table_ref (PrelogPathTable *table, uint32_t id)
+{
+  PrelogPathEntry *e = prelog_path_table_entry (table, id);
+  if (!e)
+    return;
+
+  if (!e->refs++)
+    prelog_path_table_unlink (table, id);
+}
+
+void prelog_path_table_unref (PrelogPathTable *table, uint32_t id)
+{
+  PrelogPathEntry *e = prelog_path_table_entry (table, id);
+  if (!e || !e->refs || --e->refs)
+    return;
+
+  // Newest in the unused list
+  e->prev = table->newest;
+  e->next = 0;
+  if (table->newest)
+    table->entries[table->newest - 1].next = id;
+  else
+    table->oldest = id;
+  table->newest = id;
+  table->n_unused++;
+
+  if (table->n_unused > PRELOG_PATH_TABLE_UNUSED_MAX)
+    prelog_path_table_evict (table, table->oldest);
+}
+
+const char *prelog_path_table_get (const PrelogPathTable *table, uint32_t id)
+{
+  PrelogPathEntry *e = prelog_path_table_entry (table, id);
+  return e ? e->path : NULL;
+}
@@ -0,0 +1,66 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_PATHTABLE_H
+#define	_PATHTABLE_H	1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Interned paths of the fds and streams we track, so that their close, dup
+ * and fdopen events can name the file without a syscall. Each path gets a
+ * non-zero id, valid for as long as it holds references: one per fd slot or
+ * stream that refers to it. Paths left without references stay interned, up
+ * to PRELOG_PATH_TABLE_UNUSED_MAX of them and oldest out first, so that a
+ * file opened and closed over and over does not cost an allocation each
+ * time. Ids are looked up by path through an open-addressing index of their
+ * hashes. Callers serialise every call, lib.c with _prelog_fd_lock. */
+
+#define PRELOG_PATH_TABLE_UNUSED_MAX  256
+#define PRELOG_PATH_TABLE_MIN_SIZE    64
+
+typedef struct _PrelogPathEntry {
+  char              *path;         /* NULL when the id is free */
+  size_t             len;
+  uint32_t           hash;
+  uint32_t           refs;
+  uint32_t           prev;         /* unused list while refs is 0, else 0 */
+  uint32_t           next;         /* same, or the next free id */
+} PrelogPathEntry;
+
+typedef struct _PrelogPathTable {
+  PrelogPathEntry   *entries;      /* entries[id - 1] */
+  uint32_t           n_entries;    /* ids handed out so far */
+  uint32_t           capacity;
+  uint32_t          *index;        /* ids by hash, 0 for empty slots */
+  uint32_t           index_size;
+  uint32_t           size;         /* interned paths */
+  uint32_t           free;         /* first free id */
+  uint32_t           oldest;       /* unused list, oldest first */
+  uint32_t           newest;
+  uint32_t           n_unused;
+} PrelogPathTable;
+
+#define PRELOG_PATH_TABLE_INIT { NULL, 0, 0, NULL, 0, 0, 0, 0, 0, 0 }
+
+uint32_t    prelog_path_table_intern (PrelogPathTable *table, const char *path, size_t len);
+void        prelog_path_table_ref    (PrelogPathTable *table, uint32_t id);
+void        prelog_path_table_unref  (PrelogPathTable *table, uint32_t id);
+const char *prelog_path_table_get    (const PrelogPathTable *table, uint32_t id);
+
+#endif /* PATHTABLE.h  */
@@ -0,0 +1,164 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ptrset.h"
+
+// Pointers returned by malloc share their low bits, mix them all in
+static size_t prelog_ptr_set_hash (const void *ptr)
+{
+  uint64_t h = (uint64_t) (uintptr_t) ptr;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (size_t) h;
+}
+
+static int prelog_ptr_set_find (const PrelogPtrSet *set, const void *ptr, size_t *index)
+{
+  if (!set->slots)
+    return 0;
+
+  size_t mask = set->capacity - 1;
+  size_t i = prelog_ptr_set_hash (ptr) & mask;
+
+  while (set->slots[i]) {
+    if (set->slots[i] == ptr) {
+      *index = i;
+      return 1;
+    }
+    i = (i + 1) & mask;
+  }
+
+  *index = i;
+  return 0;
+}
+
+static int prelog_ptr_set_resize (PrelogPtrSet *set, size_t capacity)
+{
+  void **slots = calloc (capacity, sizeof (void *));
+  uint32_t *values = malloc (capacity * sizeof (uint32_t));
+  if (!slots || !values) {
+    free (slots);
+    free (values);
+    return 0;
+  }
+
+  void **old_slots = set->slots;
+  uint32_t *old_values = set->values;
+  size_t old_capacity = set->capacity, i;
+
+  set->slots = slots;
+  set->values = values;
+  set->capacity = capacity;
+
+  for (i = 0; i < old_capacity; ++i) {
+    if (old_slots[i]) {
+      size_t index;
+      prelog_ptr_set_find (set, old_slots[i], &index);
+      slots[index] = old_slots[i];
+      values[index] = old_values[i];
+    }
+  }
+
+  free (old_slots);
+  free (old_values);
+  return 1;
+}
+
+int prelog_ptr_set_add (PrelogPtrSet *set, const void *ptr, uint32_t value)
+{
+  size_t index;
+
+  if (!ptr)
+    return 0;
+
+  if ((set->size + 1) * 2 > set->capacity) {
+    size_t capacity = set->capacity ? set->capacity * 2 : PRELOG_PTR_SET_MIN_SIZE;
+    if (!prelog_ptr_set_resize (set, capacity))
+      return 0;
+  }
+
+  if (prelog_ptr_set_find (set, ptr, &index))
+    return 0;
+
+  set->slots[index] = (void *) ptr;
+  set->values[index] = value;
+  set->size++;
+  return 1;
+}
+
+// Gives the value ptr had back in value, unless it is NULL
+int prelog_ptr_set_remove (PrelogPtrSet *set, const void *ptr, uint32_t *value)
+{
+  size_t hole, next, home, mask;
+
+  if (!ptr || !prelog_ptr_set_find (set, ptr, &hole))
+    return 0;
+
+  if (value)
+    *value = set->values[hole];
+
+  // Shift back the rest of the cluster into the hole, for every entry that
+  // would no longer be reachable from its home slot otherwise
+  mask = set->capacity - 1;
+  next = hole;
+  for (;;) {
+    next = (next + 1) & mask;
+    if (!set->slots[next])
+      break;
+
+    home = prelog_ptr_set_hash (set->slots[next]) & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      set->slots[hole] = set->slots[next];
+      set->values[hole] = set->values[next];
+      hole = next;
+    }
+  }
+
+  set->slots[hole] = NULL;
+  set->size--;
+
+  if (set->capacity > PRELOG_PTR_SET_MIN_SIZE && set->size * 8 < set->capacity)
+    prelog_ptr_set_resize (set, set->capacity / 2);
+
+  return 1;
+}
+
+int prelog_ptr_set_contains (const PrelogPtrSet *set, const void *ptr)
+{
+  size_t index;
+
+  if (!ptr)
+    return 0;
+
+  return prelog_ptr_set_find (set, ptr, &index);
+}
+
+void prelog_ptr_set_clear (PrelogPtrSet *set)
+{
+  free (set->slots);
+  free (set->values);
+  set->slots = NULL;
+  set->values = NULL;
+  set->capacity = 0;
+  set->size = 0;
+}
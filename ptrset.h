@@ -0,0 +1,47 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef	_PTRSET_H
+#define	_PTRSET_H	1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Open-addressing set of non-NULL pointers, used to remember which FILE and
+ * DIR streams we logged, each with a value: the id of their path.
+ * Collisions are resolved by linear probing, and removals shift the
+ * following entries of the probe sequence back instead of leaving
+ * tombstones, so lookups never slow down as streams come and go. The table
+ * doubles when half full and halves when under an eighth full. */
+
+typedef struct _PrelogPtrSet {
+  void             **slots;
+  uint32_t          *values;
+  size_t             capacity;
+  size_t             size;
+} PrelogPtrSet;
+
+#define PRELOG_PTR_SET_INIT       { NULL, NULL, 0, 0 }
+#define PRELOG_PTR_SET_MIN_SIZE   16
+
+int    prelog_ptr_set_add      (PrelogPtrSet *set, const void *ptr, uint32_t value);
+int    prelog_ptr_set_remove   (PrelogPtrSet *set, const void *ptr, uint32_t *value);
+int    prelog_ptr_set_contains (const PrelogPtrSet *set, const void *ptr);
+void   prelog_ptr_set_clear    (PrelogPtrSet *set);
+
+#endif /* PTRSET.h  */
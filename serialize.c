@@ -0,0 +1,140 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+#include "logger.h"
+
+/* Single-pass text serializer for events. It writes straight into the
+ * caller's buffer and never allocates. Records read
+ *
+ *   <timestamp>|<interpretation>|<uri>|<text>|<origin>\n
+ *
+ * for events with a single subject, and
+ *
+ *   <timestamp>|<interpretation>\n
+ *    <uri>|<text>|<origin>\n
+ *    ...
+ *
+ * otherwise. Events are serialized without their timestamp, which the writer
+ * thread prepends when it drains them: "<seconds>.<nanoseconds>" for the
+ * first record of a thread in a drained batch, and "+<nanoseconds>" since the
+ * previous record for the following ones.
+ *
+ * Fields are cut at PRELOG_FIELD_MAX bytes like the event setters used to,
+ * and a NULL uri or text reads "(null)" as it did with glibc. Like snprintf,
+ * the length of the whole output is returned even when it did not fit. */
+
+typedef struct _PrelogBuffer {
+  char              *data;
+  size_t             size;
+  size_t             len;
+} PrelogBuffer;
+
+static void prelog_buffer_putn (PrelogBuffer *b, const char *str, size_t max)
+{
+  size_t len = strnlen (str, max);
+  size_t room = b->len < b->size ? b->size - b->len : 0;
+
+  memcpy (b->data + b->len, str, len < room ? len : room);
+  b->len += len;
+}
+
+static void prelog_buffer_putc (PrelogBuffer *b, char c)
+{
+  if (b->len < b->size)
+    b->data[b->len] = c;
+  b->len++;
+}
+
+// Writes at least min_digits digits, padding with zeroes
+static void prelog_buffer_putl (PrelogBuffer *b, long long value, int min_digits)
+{
+  char digits[24];
+  int i = sizeof (digits);
+  unsigned long long v = value < 0 ? -(unsigned long long) value : (unsigned long long) value;
+
+  do {
+    digits[--i] = '0' + v % 10;
+    v /= 10;
+  } while (v || (int) sizeof (digits) - i < min_digits);
+
+  if (value < 0)
+    digits[--i] = '-';
+
+  prelog_buffer_putn (b, digits + i, sizeof (digits) - i);
+}
+
+static void prelog_buffer_put_field (PrelogBuffer *b, const char *str, const char *fallback)
+{
+  prelog_buffer_putn (b, str ? str : fallback, PRELOG_FIELD_MAX);
+}
+
+size_t prelog_timestamp_serialize (char *buffer, size_t size,
+                                   PrelogTime timestamp,
+                                   const PrelogTime *previous)
+{
+  PrelogBuffer b = { buffer, size, 0 };
+
+  // Deltas only go forward, a clock that stepped back gets a fresh base
+  if (previous && timestamp >= *previous) {
+    prelog_buffer_putc (&b, '+');
+    prelog_buffer_putl (&b, timestamp - *previous, 1);
+    return b.len;
+  }
+
+  long long seconds = timestamp / PRELOG_NSEC_PER_SEC;
+  long long nanoseconds = timestamp % PRELOG_NSEC_PER_SEC;
+  if (nanoseconds < 0) {
+    nanoseconds += PRELOG_NSEC_PER_SEC;
+    seconds--;
+  }
+
+  prelog_buffer_putl (&b, seconds, 1);
+  prelog_buffer_putc (&b, '.');
+  prelog_buffer_putl (&b, nanoseconds, 9);
+
+  return b.len;
+}
+
+size_t prelog_event_serialize (char *buffer, size_t size,
+                               const char *interpretation,
+                               PrelogSubject *const *subjects)
+{
+  PrelogBuffer b = { buffer, size, 0 };
+  size_t i, n_subjects = 0;
+
+  while (subjects && subjects[n_subjects])
+    n_subjects++;
+
+  prelog_buffer_put_field (&b, interpretation, "(null)");
+  prelog_buffer_putc (&b, n_subjects == 1 ? '|' : '\n');
+
+  for (i = 0; i < n_subjects; ++i) {
+    if (n_subjects != 1)
+      prelog_buffer_putc (&b, ' ');
+    prelog_buffer_put_field (&b, subjects[i]->uri, "(null)");
+    prelog_buffer_putc (&b, '|');
+    prelog_buffer_put_field (&b, subjects[i]->text, "(null)");
+    prelog_buffer_putc (&b, '|');
+    prelog_buffer_put_field (&b, subjects[i]->origin, "");
+    prelog_buffer_putc (&b, '\n');
+  }
+
+  return b.len;
+}
@@ -0,0 +1,342 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "shmring.h"
+
+/* Records sit in the ring as two 64-bit words followed by the record, padded
+ * to 8 bytes. The first word holds the record length and the producer's pid.
+ * Producers claim it, with PRELOG_SHM_SLOT_RESERVED set, before they move the
+ * head past their record, and clear that bit to publish it. The consumer
+ * zeroes records before handing their room back, so a fresh reservation
+ * always starts from a zero word. Words are 8-byte aligned and never
+ * straddle the ring's end. */
+
+#define PRELOG_SHM_RING_DATA   4096 /* the header page comes first */
+#define PRELOG_SHM_SLOT_HEADER (2 * sizeof (uint64_t))
+#define PRELOG_SHM_SLOT_SIZE(len) (PRELOG_SHM_SLOT_HEADER + (((len) + 7) & ~(size_t) 7))
+#define PRELOG_SHM_SLOT_WORD(len, pid) (((uint64_t) (len) << 32) | (pid))
+
+struct _PrelogShmRingHeader {
+  uint32_t           magic;
+  uint32_t           closed;    /* set when the collector goes away */
+  uint64_t           size;
+  uint32_t           sleeping;  /* the collector waits on wake */
+  uint32_t           wake;      /* futex word */
+  uint64_t           overflows; /* records rejected by a full ring */
+  uint64_t           lost;      /* reservations never published */
+  uint64_t           head __attribute__ ((aligned (64))); /* reserved by producers */
+  uint64_t           tail __attribute__ ((aligned (64))); /* released by the collector */
+};
+
+static void prelog_shm_ring_copy_in (PrelogShmRing *ring, uint64_t pos, const void *data, size_t len)
+{
+  size_t start = pos & (ring->size - 1);
+  if (start + len > ring->size) {
+    size_t first = ring->size - start;
+    memcpy (ring->data + start, data, first);
+    memcpy (ring->data, (const char *) data + first, len - first);
+  } else {
+    memcpy (ring->data + start, data, len);
+  }
+}
+
+static void prelog_shm_ring_copy_out (PrelogShmRing *ring, uint64_t pos, void *data, size_t len)
+{
+  size_t start = pos & (ring->size - 1);
+  if (start + len > ring->size) {
+    size_t first = ring->size - start;
+    memcpy (data, ring->data + start, first);
+    memcpy ((char *) data + first, ring->data, len - first);
+  } else {
+    memcpy (data, ring->data + start, len);
+  }
+}
+
+static void prelog_shm_ring_clear (PrelogShmRing *ring, uint64_t pos, size_t len)
+{
+  size_t start = pos & (ring->size - 1);
+  if (start + len > ring->size) {
+    memset (ring->data + start, 0, ring->size - start);
+    memset (ring->data, 0, len - (ring->size - start));
+  } else {
+    memset (ring->data + start, 0, len);
+  }
+}
+
+static uint64_t *prelog_shm_ring_word (PrelogShmRing *ring, uint64_t pos)
+{
+  return (uint64_t *) (ring->data + (pos & (ring->size - 1)));
+}
+
+static PrelogShmRing *prelog_shm_ring_map (int fd, size_t mapped)
+{
+  PrelogShmRing *ring = malloc (sizeof (PrelogShmRing));
+  if (!ring)
+    return NULL;
+
+  void *addr = mmap (NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    free (ring);
+    return NULL;
+  }
+
+  ring->header = addr;
+  ring->data = (char *) addr + PRELOG_SHM_RING_DATA;
+  ring->size = mapped - PRELOG_SHM_RING_DATA;
+  ring->mapped = mapped;
+  ring->pid = 0;
+  ring->stalled = 0;
+  ring->stalled_since = 0;
+  return ring;
+}
+
+// Sizes the file behind fd for a ring of size bytes, a power of two
+PrelogShmRing *prelog_shm_ring_create (int fd, size_t size)
+{
+  if (size < 2 * PRELOG_SHM_SLOT_SIZE (PRELOG_RECORD_MAX) || (size & (size - 1)))
+    return NULL;
+  if (ftruncate (fd, PRELOG_SHM_RING_DATA + size) < 0)
+    return NULL;
+
+  PrelogShmRing *ring = prelog_shm_ring_map (fd, PRELOG_SHM_RING_DATA + size);
+  if (!ring)
+    return NULL;
+
+  ring->header->size = size;
+  __atomic_store_n (&ring->header->magic, PRELOG_SHM_RING_MAGIC, __ATOMIC_RELEASE);
+  return ring;
+}
+
+PrelogShmRing *prelog_shm_ring_attach (int fd, pid_t pid)
+{
+  struct stat st;
+  if (fstat (fd, &st) < 0 || st.st_size <= PRELOG_SHM_RING_DATA)
+    return NULL;
+
+  PrelogShmRing *ring = prelog_shm_ring_map (fd, st.st_size);
+  if (!ring)
+    return NULL;
+
+  if (__atomic_load_n (&ring->header->magic, __ATOMIC_ACQUIRE) != PRELOG_SHM_RING_MAGIC ||
+      ring->header->size != ring->size || (ring->size & (ring->size - 1))) {
+    prelog_shm_ring_detach (ring);
+    return NULL;
+  }
+
+  ring->pid = pid;
+  return ring;
+}
+
+void prelog_shm_ring_detach (PrelogShmRing *ring)
+{
+  if (!ring)
+    return;
+
+  munmap (ring->header, ring->mapped);
+  free (ring);
+}
+
+// Turns producers away, for good
+void prelog_shm_ring_close (PrelogShmRing *ring)
+{
+  if (!ring)
+    return;
+
+  __atomic_store_n (&ring->header->closed, 1, __ATOMIC_RELEASE);
+  prelog_shm_ring_detach (ring);
+}
+
+static uint64_t prelog_shm_ring_now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int prelog_shm_ring_producer_gone (uint64_t word)
+{
+  return kill ((pid_t) (uint32_t) word, 0) < 0 && errno == ESRCH;
+}
+
+// Returns -1 if the ring is closed or full, or if the collector dropped our
+// reservation, in which case the record must be sent some other way
+int prelog_shm_ring_append (PrelogShmRing *ring, PrelogTime timestamp, const char *record, size_t len)
+{
+  PrelogShmRingHeader *h = ring->header;
+
+  if (!len || len > PRELOG_RECORD_MAX || __atomic_load_n (&h->closed, __ATOMIC_ACQUIRE))
+    return -1;
+
+  uint64_t total = PRELOG_SHM_SLOT_SIZE (len);
+  uint64_t reserved = PRELOG_SHM_SLOT_WORD (len, ring->pid) | PRELOG_SHM_SLOT_RESERVED;
+  uint64_t head = __atomic_load_n (&h->head, __ATOMIC_RELAXED);
+  uint64_t tail, word;
+  int saved_errno = errno;
+
+  for (;;) {
+    tail = __atomic_load_n (&h->tail, __ATOMIC_ACQUIRE);
+    if (head + total - tail > ring->size) {
+      // Our head predates the tail, look again
+      if ((int64_t) (head - tail) < 0) {
+        head = __atomic_load_n (&h->head, __ATOMIC_RELAXED);
+        continue;
+      }
+      __atomic_add_fetch (&h->overflows, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+
+    // Claim the first word, so that the slot says how long it is as soon as
+    // the head moves past it
+    uint64_t *slot = prelog_shm_ring_word (ring, head);
+    word = 0;
+    if (!__atomic_compare_exchange_n (slot, &word, reserved, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      uint64_t current = __atomic_load_n (&h->head, __ATOMIC_RELAXED);
+      // A producer killed right after claiming the word at the head
+      if (current == head && (word & PRELOG_SHM_SLOT_RESERVED) && prelog_shm_ring_producer_gone (word))
+        __atomic_compare_exchange_n (slot, &word, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+      head = current;
+      continue;
+    }
+    if (__atomic_compare_exchange_n (&h->head, &head, head + total, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+
+    // Our head was stale, hand the word back unless a record was copied over it
+    word = reserved;
+    __atomic_compare_exchange_n (slot, &word, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+  errno = saved_errno;
+
+  prelog_shm_ring_copy_in (ring, head + sizeof (uint64_t), &timestamp, sizeof (timestamp));
+  prelog_shm_ring_copy_in (ring, head + PRELOG_SHM_SLOT_HEADER, record, len);
+
+  // The collector gave up on us if we took too long, fall back on the socket
+  word = reserved;
+  if (!__atomic_compare_exchange_n (prelog_shm_ring_word (ring, head), &word, PRELOG_SHM_SLOT_WORD (len, ring->pid),
+                                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    return -1;
+
+  // Wake the collector up as the ring goes past a quarter full
+  if (head + total - tail >= ring->size / 4 &&
+      __atomic_load_n (&h->sleeping, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n (&h->sleeping, 0, __ATOMIC_ACQ_REL)) {
+    __atomic_add_fetch (&h->wake, 1, __ATOMIC_RELEASE);
+    syscall (SYS_futex, &h->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+
+  return 0;
+}
+
+// Tells whether the reservation at tail is never going to be published
+static int prelog_shm_ring_abandoned (PrelogShmRing *ring, uint64_t tail, uint64_t word)
+{
+  uint64_t now = prelog_shm_ring_now_ms ();
+
+  if (prelog_shm_ring_producer_gone (word))
+    return 1;
+
+  if (ring->stalled != tail || !ring->stalled_since) {
+    ring->stalled = tail;
+    ring->stalled_since = now;
+    return 0;
+  }
+
+  return now - ring->stalled_since >= PRELOG_SHM_RING_STALL_MS;
+}
+
+// Hands published records to func in order, through buffer which must hold
+// PRELOG_RECORD_MAX bytes, and returns how many there were. Reservations
+// whose producer died, or that stay unpublished for PRELOG_SHM_RING_STALL_MS,
+// are dropped and counted as lost
+size_t prelog_shm_ring_consume (PrelogShmRing *ring, char *buffer, PrelogShmRingFunc func, void *data)
+{
+  PrelogShmRingHeader *h = ring->header;
+  uint64_t tail = __atomic_load_n (&h->tail, __ATOMIC_RELAXED);
+  size_t count = 0;
+
+  for (;;) {
+    uint64_t word = __atomic_load_n (prelog_shm_ring_word (ring, tail), __ATOMIC_ACQUIRE);
+    if (!word)
+      break;
+
+    size_t len = (word & ~PRELOG_SHM_SLOT_RESERVED) >> 32;
+    uint64_t total = PRELOG_SHM_SLOT_SIZE (len);
+    PrelogTime timestamp;
+
+    if (word & PRELOG_SHM_SLOT_RESERVED) {
+      // Claimed words at the head are not reservations yet
+      if (__atomic_load_n (&h->head, __ATOMIC_ACQUIRE) - tail < total ||
+          !prelog_shm_ring_abandoned (ring, tail, word))
+        break;
+
+      __atomic_add_fetch (&h->lost, 1, __ATOMIC_RELAXED);
+      prelog_shm_ring_clear (ring, tail, total < ring->size ? total : ring->size);
+      tail += total;
+      __atomic_store_n (&h->tail, tail, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    prelog_shm_ring_copy_out (ring, tail + sizeof (uint64_t), &timestamp, sizeof (timestamp));
+    prelog_shm_ring_copy_out (ring, tail + PRELOG_SHM_SLOT_HEADER, buffer, len < PRELOG_RECORD_MAX ? len : PRELOG_RECORD_MAX);
+    func ((uint32_t) word, timestamp, buffer, len < PRELOG_RECORD_MAX ? len : PRELOG_RECORD_MAX, data);
+
+    prelog_shm_ring_clear (ring, tail, total < ring->size ? total : ring->size);
+    tail += total;
+    __atomic_store_n (&h->tail, tail, __ATOMIC_RELEASE);
+    count++;
+  }
+
+  return count;
+}
+
+// Sleeps until the ring fills up to a quarter or timeout_ms pass
+void prelog_shm_ring_wait (PrelogShmRing *ring, int timeout_ms)
+{
+  PrelogShmRingHeader *h = ring->header;
+  uint32_t seq = __atomic_load_n (&h->wake, __ATOMIC_ACQUIRE);
+
+  __atomic_store_n (&h->sleeping, 1, __ATOMIC_SEQ_CST);
+  uint64_t used = __atomic_load_n (&h->head, __ATOMIC_SEQ_CST) - __atomic_load_n (&h->tail, __ATOMIC_RELAXED);
+  if (used < ring->size / 4) {
+    struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    syscall (SYS_futex, &h->wake, FUTEX_WAIT, seq, &timeout, NULL, 0);
+  }
+  __atomic_store_n (&h->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+uint64_t prelog_shm_ring_overflows (PrelogShmRing *ring)
+{
+  return __atomic_load_n (&ring->header->overflows, __ATOMIC_RELAXED);
+}
+
+uint64_t prelog_shm_ring_lost (PrelogShmRing *ring)
+{
+  return __atomic_load_n (&ring->header->lost, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,75 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef	_SHMRING_H
+#define	_SHMRING_H	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "logger.h"
+
+/* A ring of records in memory shared by the collector and every process that
+ * talks to it. Processes reserve room with a compare-and-swap on the head,
+ * copy their record in and then publish its first word, so appending takes
+ * no lock and no system call. The collector is the only consumer: it reads
+ * published records in order, clears them and moves the tail. It sleeps on a
+ * futex in the ring, which producers only wake once the ring is a quarter
+ * full, and otherwise wakes up every PRELOG_SHM_RING_WAIT_MS.
+ *
+ * A full ring rejects records and counts them, and producers then fall back
+ * to sending records over their socket. Reservations carry the record's
+ * length and the producer's pid, so a record whose producer was killed
+ * before publishing it is skipped and counted as lost, once its pid is gone
+ * or after PRELOG_SHM_RING_STALL_MS, rather than stalling the ring. */
+
+#define PRELOG_SHM_RING_MAGIC   0x50524c52 /* "PRLR" */
+#define PRELOG_SHM_RING_SIZE    (8 * 1024 * 1024)
+#define PRELOG_SHM_RING_WAIT_MS 100
+#define PRELOG_SHM_RING_STALL_MS 1000
+#define PRELOG_SHM_SLOT_RESERVED (1ULL << 63) /* in the first word of unpublished records */
+
+typedef struct _PrelogShmRingHeader PrelogShmRingHeader;
+
+typedef struct _PrelogShmRing {
+  PrelogShmRingHeader *header;
+  char                *data;
+  size_t               size;     /* bytes of data, a power of two */
+  size_t               mapped;   /* bytes of the mapping */
+  uint32_t             pid;      /* stamped on the records we append */
+  uint64_t             stalled;  /* unpublished record the consumer waits on */
+  uint64_t             stalled_since; /* in monotonic ms */
+} PrelogShmRing;
+
+typedef void (*PrelogShmRingFunc) (uint32_t pid, PrelogTime timestamp,
+                                   const char *record, size_t len, void *data);
+
+PrelogShmRing *prelog_shm_ring_create (int fd, size_t size);
+PrelogShmRing *prelog_shm_ring_attach (int fd, pid_t pid);
+void prelog_shm_ring_detach (PrelogShmRing *ring);
+void prelog_shm_ring_close (PrelogShmRing *ring);
+
+int prelog_shm_ring_append (PrelogShmRing *ring, PrelogTime timestamp, const char *record, size_t len);
+
+size_t prelog_shm_ring_consume (PrelogShmRing *ring, char *buffer, PrelogShmRingFunc func, void *data);
+void prelog_shm_ring_wait (PrelogShmRing *ring, int timeout_ms);
+uint64_t prelog_shm_ring_overflows (PrelogShmRing *ring);
+uint64_t prelog_shm_ring_lost (PrelogShmRing *ring);
+
+#endif /* SHMRING.h  */
@@ -0,0 +1,179 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Checks that intercepted calls do not allocate once the log is up. Run it
+ * from a scratch directory with HOME pointing to it, and with both
+ * test-malloc-shim.so and libPreloadLogger.so in LD_PRELOAD. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WARMUP_ITERATIONS 500
+// Long enough for the cached permission checks to expire at least once
+#define MEASURE_SECONDS   2
+
+static long (*allocations) (void);
+static char dir[4096], file[4200], other[4200], sub[4200], missing[4200];
+
+// Every call whose logging must not allocate, with files under HOME
+static void run_calls (void)
+{
+  char buf[16] = "0123456789abcdef";
+  struct iovec iov = { buf, sizeof (buf) };
+  int fd, fds[2];
+
+  fd = open (file, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  write (fd, buf, sizeof (buf));
+  pwrite (fd, buf, sizeof (buf), 0);
+  writev (fd, &iov, 1);
+  read (fd, buf, sizeof (buf));
+  pread (fd, buf, sizeof (buf), 0);
+  readv (fd, &iov, 1);
+  close (dup (fd));
+  dup2 (fd, fd + 10);
+  close (fd + 10);
+  dup3 (fd, fd + 11, O_CLOEXEC);
+  close (fd + 11);
+  close (fd);
+
+  fd = openat (AT_FDCWD, "relative", O_CREAT | O_RDWR, 0600);
+  close (fd);
+  unlink ("relative");
+
+  fd = creat (other, 0600);
+  close (fd);
+
+  link (file, sub);
+  unlink (sub);
+  symlink (file, sub);
+  unlink (sub);
+  rename (other, sub);
+  remove (sub);
+
+  mkdir (sub, 0700);
+  rmdir (sub);
+
+  pipe (fds);
+  close (fds[0]);
+  close (fds[1]);
+
+  close (socket (AF_UNIX, SOCK_STREAM, 0));
+  socketpair (AF_UNIX, SOCK_STREAM, 0, fds);
+  close (fds[0]);
+  close (fds[1]);
+
+  // Failing calls used to allocate their error text
+  open (missing, O_CREAT | O_WRONLY, 0600);
+  unlink (other);
+  close (-1);
+}
+
+// libc allocates FILE and DIR streams itself, so only count what logging adds
+// on top of the same calls on files we do not log
+static void read_close (FILE *fp)
+{
+  char buf[16];
+
+  if (fp) {
+    fread (buf, 1, sizeof (buf), fp);
+    fclose (fp);
+  }
+}
+
+static long run_streams (const char *logged_file, const char *logged_dir)
+{
+  long before = allocations ();
+  read_close (fopen (logged_file, "r"));
+  closedir (opendir (logged_dir));
+  long logged = allocations () - before;
+
+  before = allocations ();
+  read_close (fopen ("/etc/passwd", "r"));
+  closedir (opendir ("/etc"));
+
+  return logged - (allocations () - before);
+}
+
+int main(void)
+{
+  int i;
+  long iterations = 0, leaked = 0, stream_leaked = 0;
+
+  printf ("PreloadLogger allocation test\n");
+
+  allocations = dlsym (RTLD_DEFAULT, "prelog_test_allocations");
+  if (!allocations) {
+    printf ("test-malloc-shim.so is not preloaded\nFAILED\n");
+    return 1;
+  }
+
+  // Events are only logged for user processes
+  if (geteuid () == 0 && (setgid (65534) || setuid (65534))) {
+    printf ("could not drop privileges\nFAILED\n");
+    return 1;
+  }
+  if (geteuid () < 1000) {
+    printf ("skipped, events are not logged for uid %d\n", geteuid ());
+    return 0;
+  }
+
+  if (!getcwd (dir, sizeof (dir))) {
+    printf ("could not get the current directory\nFAILED\n");
+    return 1;
+  }
+  snprintf (file, sizeof (file), "%s/file", dir);
+  snprintf (other, sizeof (other), "%s/other", dir);
+  snprintf (sub, sizeof (sub), "%s/sub", dir);
+  snprintf (missing, sizeof (missing), "%s/missing/file", dir);
+
+  // Let the log, the thread buffers, caches and zlib set themselves up
+  for (i = 0; i < WARMUP_ITERATIONS; ++i) {
+    run_calls ();
+    run_streams (file, dir);
+  }
+
+  time_t end = time (NULL) + MEASURE_SECONDS;
+  while (time (NULL) <= end) {
+    long before = allocations ();
+    run_calls ();
+    leaked += allocations () - before;
+    stream_leaked += run_streams (file, dir);
+    iterations++;
+  }
+
+  unlink (file);
+  printf ("%ld iterations, %ld allocations in calls, %ld in streams\n",
+          iterations, leaked, stream_leaked);
+
+  if (leaked || stream_leaked) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
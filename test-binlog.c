@@ -0,0 +1,236 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Round trip test for the binary log format: records serialized like the
+ * library does, odd ones included, must convert back to exactly the text the
+ * text format has for them, also when the decoder gets its input a byte at a
+ * time and once the dictionary evicts strings, by count or by size. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binlog.h"
+
+#define RECORDS       40000
+#define STREAM_SIZE   (64 * 1024 * 1024)
+
+static char *stream, *expected;
+static size_t stream_len = 0, expected_len = 0, text_len = 0;
+static PrelogTime previous;
+static int has_previous = 0;
+
+static void add_header (PrelogBinlog *b, pid_t pid, const char *actor, const char *cmdline)
+{
+  stream_len += prelog_binlog_encode_header (b, stream + stream_len, STREAM_SIZE - stream_len, pid, actor, cmdline);
+  expected_len += sprintf (expected + expected_len, "@%s|%d|%s\n", actor, pid, cmdline);
+  has_previous = 0;
+}
+
+static void add_body (PrelogBinlog *b, PrelogTime timestamp, const char *body, size_t len)
+{
+  stream_len += prelog_binlog_encode_record (b, stream + stream_len, STREAM_SIZE - stream_len, timestamp, body, len);
+
+  expected_len += prelog_timestamp_serialize (expected + expected_len, PRELOG_STAMP_MAX, timestamp,
+                                              has_previous ? &previous : NULL);
+  expected[expected_len++] = '|';
+  memcpy (expected + expected_len, body, len);
+  expected_len += len;
+  text_len += len;
+
+  previous = timestamp;
+  has_previous = 1;
+}
+
+static void add_event (PrelogBinlog *b, PrelogTime timestamp, const char *interpretation, PrelogSubject **subjects)
+{
+  static char body[PRELOG_RECORD_MAX];
+  size_t len = prelog_event_serialize (body, sizeof (body), interpretation, subjects);
+  add_body (b, timestamp, body, len);
+}
+
+static int check (const char *name, int bytewise)
+{
+  static char text[2 * PRELOG_MESSAGE_MAX];
+  char *output = malloc (expected_len + 1);
+  PrelogBinlog *b = prelog_binlog_new ();
+  size_t pos = 0, output_len = 0, text_len;
+  int failed = 0;
+
+  while (pos < stream_len) {
+    size_t available = bytewise ? 1 : stream_len - pos;
+    ssize_t used;
+
+    while ((used = prelog_binlog_decode_record (b, stream + pos, available, text, sizeof (text), &text_len)) == 0 &&
+           pos + available < stream_len)
+      available++;
+
+    if (used <= 0 || output_len + text_len > expected_len) {
+      printf ("%s: decoding failed at byte %zu\n", name, pos);
+      failed = 1;
+      break;
+    }
+    memcpy (output + output_len, text, text_len);
+    output_len += text_len;
+    pos += used;
+  }
+
+  if (!failed && (output_len != expected_len || memcmp (output, expected, expected_len))) {
+    size_t i = 0;
+    while (i < output_len && i < expected_len && output[i] == expected[i])
+      i++;
+    printf ("%s: text differs at byte %zu: expected \"%.40s\", got \"%.40s\"\n", name, i,
+            expected + i, output + (i < output_len ? i : output_len));
+    failed = 1;
+  }
+
+  free (output);
+  prelog_binlog_free (b);
+  return failed;
+}
+
+static void reset (void)
+{
+  stream_len = expected_len = text_len = 0;
+  has_previous = 0;
+}
+
+int main(void)
+{
+  char uri[64], text[64];
+  int failed = 0, i;
+
+  printf ("PreloadLogger binary log tests\n");
+
+  stream = malloc (STREAM_SIZE);
+  expected = malloc (STREAM_SIZE);
+
+  // Odd records, one of each
+  PrelogBinlog *b = prelog_binlog_new ();
+  PrelogSubject plain = { "/home/study/file.txt", NULL, "fd 3: with flag 524288, e0" };
+  PrelogSubject relative = { "lib.c", "/home/study/Preload", "New file: with flags 0, e0" };
+  PrelogSubject bars = { "/tmp/a|b\nc", "/tmp|x", "007 and 12345678901234567890 and -1|2" };
+  PrelogSubject marker = { "/tmp/x", "", "contains \001 a marker" };
+  PrelogSubject empty = { "", "", "" };
+  PrelogSubject *one[] = { &plain, NULL };
+  PrelogSubject *two[] = { &plain, &relative, NULL };
+  PrelogSubject *odd[] = { &bars, NULL };
+  PrelogSubject *odd_two[] = { &bars, &empty, NULL };
+  PrelogSubject *marked[] = { &marker, NULL };
+  PrelogSubject *many[] = { &empty, &empty, &empty, &empty, &empty, &empty, &empty, &empty, &empty, &empty, NULL };
+
+  PrelogTime t = 1444000000LL * PRELOG_NSEC_PER_SEC;
+  add_header (b, 1234, "test", "test --flag ");
+  add_event (b, t, OPEN_SCI, one);
+  add_event (b, t, OPEN_SCI, one);
+  add_event (b, t + 5, RENAME_SCI, two);
+  add_event (b, t + 6, FORK_SCI, NULL);
+  add_event (b, t + 7, "frobnicate", one);
+  add_event (b, t + 8, LINK_SCI, odd);
+  add_event (b, t + 9, LINK_SCI, odd_two);
+  add_event (b, t - PRELOG_NSEC_PER_SEC, CLOSE_SCI, marked);
+  add_event (b, t, CLOSE_SCI, many);
+  add_body (b, t + 10, "open|cut sho", 12);
+  add_body (b, t + 11, "open\n /a|b\n", 11);
+  add_body (b, t + 12, "open\nnot a subject\n", 19);
+  add_header (b, 1235, "child", "test ");
+  add_event (b, -5, OPEN_SCI, two);
+  prelog_binlog_free (b);
+
+  failed |= check ("odd records", 0);
+  failed |= check ("odd records, byte by byte", 1);
+
+  // Many records, mostly on the same few files
+  reset ();
+  b = prelog_binlog_new ();
+  add_header (b, 4321, "busy", "busy ");
+  for (i = 0; i < RECORDS; ++i) {
+    snprintf (uri, sizeof (uri), "/home/study/.config/app/file-%d", i % 20 ? i % 50 : i);
+    snprintf (text, sizeof (text), "fd %d: with flag %d, e%d", 3 + i % 7, i % 3 ? 524288 : 524289, i % 5 ? 0 : 2);
+    PrelogSubject s = { uri, "/home/study", text };
+    PrelogSubject *subjects[] = { &s, NULL };
+    add_event (b, t + i * 1000LL, i % 2 ? OPEN_SCI : CLOSE_SCI, subjects);
+  }
+  prelog_binlog_free (b);
+
+  failed |= check ("many records", 0);
+  printf ("%zu bytes of records in text, %zu in binary\n", text_len, stream_len);
+  if (stream_len * 2 > text_len) {
+    printf ("binary records are not even half the size of text ones\n");
+    failed = 1;
+  }
+
+  // More distinct paths than the dictionary holds, around a few hot ones
+  reset ();
+  b = prelog_binlog_new ();
+  add_header (b, 4322, "find", "find / ");
+  for (i = 0; i < RECORDS; ++i) {
+    if (i % 3)
+      snprintf (uri, sizeof (uri), "/home/study/file-%d", i);
+    else
+      snprintf (uri, sizeof (uri), "/home/study/hot-%d", i % 4);
+    PrelogSubject s = { uri, NULL, "e0" };
+    PrelogSubject *subjects[] = { &s, NULL };
+    add_event (b, t + i, UNLINK_SCI, subjects);
+  }
+  prelog_binlog_free (b);
+
+  failed |= check ("evicting by count", 0);
+
+  // Paths in use must stay in the dictionary, and be written out once
+  int hot = 0;
+  const char *p = stream;
+  while ((p = memmem (p, stream + stream_len - p, "/home/study/hot-", 16))) {
+    hot++;
+    p++;
+  }
+  if (hot != 4) {
+    printf ("hot paths written out %d times instead of 4\n", hot);
+    failed = 1;
+  }
+  failed |= check ("evicting by count, byte by byte", 1);
+
+  // Paths long enough for the dictionary to run out of bytes first
+  reset ();
+  b = prelog_binlog_new ();
+  add_header (b, 4323, "deep", "deep ");
+  char *deep = malloc (PRELOG_BINLOG_INTERN_MAX);
+  memset (deep, 'd', PRELOG_BINLOG_INTERN_MAX - 32);
+  for (i = 0; i < 4 * PRELOG_BINLOG_BYTES_MAX / PRELOG_BINLOG_INTERN_MAX; ++i) {
+    snprintf (deep + PRELOG_BINLOG_INTERN_MAX - 32, 32, "/%d", i % 7 ? i : 0);
+    PrelogSubject s = { deep, NULL, "e0" };
+    PrelogSubject *subjects[] = { &s, NULL };
+    add_event (b, t + i, UNLINK_SCI, subjects);
+  }
+  prelog_binlog_free (b);
+  free (deep);
+
+  failed |= check ("evicting by size", 0);
+
+  free (stream);
+  free (expected);
+
+  if (failed) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,180 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* cwd test. The process changes directories in every way we track, and
+ * some we do not, and opens files relative to its cwd and to directory fds.
+ * Each file must be logged with the directory it was really opened in as
+ * its origin. Run it from a scratch directory with HOME pointing to it and
+ * libPreloadLogger.so in LD_PRELOAD, then run it again with --check and
+ * without LD_PRELOAD to read the logs back. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cwd.h"
+#include "logger.h"
+#include "test-logs.h"
+
+typedef struct _CwdCase {
+  const char        *name;
+  const char        *origin;   /* relative to HOME */
+  long               found;
+  long               wrong;
+} CwdCase;
+
+static CwdCase cases[] = {
+  { "relative-chdir",  "/a" },
+  { "absolute-chdir",  "/a/b" },
+  { "dotdot-chdir",    "/a" },
+  { "fchdir",          "/a/b" },
+  { "opendir-fd",      "" },
+  { "directory-fd",    "/a/b" },
+  { "dup-fd",          "/a/b" },
+  { "raw-chdir",       "" },
+  { NULL, NULL }
+};
+
+static int touch_at (int dirfd, const char *name)
+{
+  int fd = openat (dirfd, name, O_CREAT | O_WRONLY, 0600);
+  if (fd < 0) {
+    printf ("could not create %s\n", name);
+    return 1;
+  }
+  close (fd);
+  return 0;
+}
+
+static int run (const char *home)
+{
+  char path[4200];
+  int failed = 0;
+
+  if (mkdir ("a", 0700) || mkdir ("a/b", 0700)) {
+    printf ("could not create directories\n");
+    return 1;
+  }
+
+  failed |= chdir ("a") || touch_at (AT_FDCWD, "relative-chdir");
+
+  snprintf (path, sizeof (path), "%s/a/b/", home);
+  failed |= chdir (path) || touch_at (AT_FDCWD, "absolute-chdir");
+
+  failed |= chdir ("..") || touch_at (AT_FDCWD, "dotdot-chdir");
+
+  int b = open ("b", O_RDONLY | O_DIRECTORY);
+  failed |= b < 0 || fchdir (b) || touch_at (AT_FDCWD, "fchdir");
+
+  DIR *d = opendir (home);
+  failed |= !d || touch_at (dirfd (d), "opendir-fd");
+  if (d)
+    closedir (d);
+
+  failed |= touch_at (b, "directory-fd");
+
+  int copy = dup (b);
+  close (b);
+  failed |= copy < 0 || touch_at (copy, "dup-fd");
+  close (copy);
+
+  // Not seen by the library, until the cached cwd gets checked again
+  failed |= syscall (SYS_chdir, home) != 0;
+  usleep ((PRELOG_CWD_TTL_MS + 100) * 1000);
+  failed |= touch_at (AT_FDCWD, "raw-chdir");
+
+  return failed;
+}
+
+static void check_event (char *line, void *data)
+{
+  const char *home = data;
+  char needle[256], expected[4200];
+  CwdCase *c;
+
+  for (c = cases; c->name; ++c) {
+    snprintf (needle, sizeof (needle), "|%s|", c->name);
+    if (!strstr (line, needle))
+      continue;
+    snprintf (expected, sizeof (expected), "|%s%s\n", home, c->origin);
+    size_t len = strlen (line), elen = strlen (expected);
+    if (len >= elen && !strcmp (line + len - elen, expected))
+      c->found++;
+    else {
+      printf ("%s: unexpected record %s", c->name, line);
+      c->wrong++;
+    }
+  }
+}
+
+static int check (const char *home)
+{
+  CwdCase *c;
+  int failed = 0;
+
+  if (test_logs_foreach (check_event, (void *) home) < 0)
+    return test_logs_result (1);
+
+  for (c = cases; c->name; ++c) {
+    if (c->found != 1 || c->wrong) {
+      printf ("%s: %ld records with origin %s%s, %ld others\n", c->name, c->found, home, c->origin, c->wrong);
+      failed = 1;
+    }
+  }
+
+  return test_logs_result (failed);
+}
+
+int main(int argc, char **argv)
+{
+  const char *home = getenv ("HOME");
+
+  if (!home) {
+    printf ("HOME is not set\nFAILED\n");
+    return 1;
+  }
+
+  if (argc > 1 && !strcmp (argv[1], "--check"))
+    return check (home);
+
+  printf ("PreloadLogger cwd test\n");
+  fflush (stdout);
+
+  // Events are only logged for user processes
+  if (geteuid () == 0 && (setgid (65534) || setuid (65534))) {
+    printf ("could not drop privileges\nFAILED\n");
+    return 1;
+  }
+  if (geteuid () < 1000) {
+    printf ("skipped, events are not logged for uid %d\n", geteuid ());
+    return 0;
+  }
+
+  if (run (home)) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
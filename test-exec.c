@@ -0,0 +1,188 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* exec test. The process opens files, fails to run a missing command,
+ * spawns another and execs itself right away, before the writer thread had
+ * a chance to drain its ring. Every event of the first image must be in the
+ * logs, along with a lineage record whose argv digest matches the second
+ * image, which logs events of its own under the same pid, in a file of its
+ * own. The spawned command must be counted as a process that never logged.
+ * Run it from a scratch directory with HOME pointing to it and
+ * libPreloadLogger.so in LD_PRELOAD, then run it again with --check and
+ * without LD_PRELOAD to read the logs back. Both have to be readable by the
+ * user it runs as. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "test-logs.h"
+
+#define BEFORE_EVENTS  1000
+#define AFTER_EVENTS   10
+#define MISSING        "prelog-no-such-command"
+
+extern char **environ;
+
+static void touch (const char *name, int times)
+{
+  int i;
+  for (i = 0; i < times; ++i)
+    close (open (name, O_CREAT | O_WRONLY, 0600));
+}
+
+static int run (char *self)
+{
+  char *spawned[] = { "true", NULL };
+  char *next[] = { self, "--after", NULL };
+  pid_t pid;
+  int status;
+
+  touch ("before", BEFORE_EVENTS);
+
+  if (execlp (MISSING, MISSING, NULL) == 0) {
+    printf ("%s ran\n", MISSING);
+    return 1;
+  }
+
+  if (posix_spawnp (&pid, "true", NULL, NULL, spawned, environ) ||
+      waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status)) {
+    printf ("could not spawn true\n");
+    return 1;
+  }
+
+  execv (self, next);
+  printf ("could not exec %s\n", self);
+  return 1;
+}
+
+// Same as the one the library uses, over argv as laid out in /proc/<pid>/cmdline
+static uint64_t digest (char *const argv[])
+{
+  uint64_t hash = 14695981039346656037ULL;
+  int i;
+
+  for (i = 0; argv[i]; ++i) {
+    const unsigned char *p = (const unsigned char *) argv[i];
+    do {
+      hash ^= *p;
+      hash *= 1099511628211ULL;
+    } while (*p++);
+  }
+
+  return hash;
+}
+
+typedef struct _ExecCounts {
+  const char        *lineage;
+  long               before;
+  long               after;
+  long               headers;
+  long               lineage_records;
+  long               failed;
+  long               spawned;
+} ExecCounts;
+
+static void count_event (char *line, void *data)
+{
+  ExecCounts *counts = data;
+
+  if (line[0] == '@')
+    counts->headers++;
+  else if (strstr (line, "|" OPEN_SCI "|") && strstr (line, "|before|"))
+    counts->before++;
+  else if (strstr (line, "|" OPEN_SCI "|") && strstr (line, "|after|"))
+    counts->after++;
+  else if (strstr (line, counts->lineage))
+    counts->lineage_records++;
+  else if (strstr (line, "|" EXECLP_SCI "|" MISSING "|e") && strstr (line, "|\n"))
+    counts->failed++;
+  else if (strstr (line, "|" POSIX_SPAWNP_SCI "|true|pid ") && strstr (line, ", 1 args, e0|"))
+    counts->spawned++;
+}
+
+static int check (char *self)
+{
+  char path[4200], lineage[64];
+  char *next[] = { self, "--after", NULL };
+  ExecCounts counts = { lineage };
+
+  snprintf (lineage, sizeof (lineage), "|argv %016llx, 2 args|", (unsigned long long) digest (next));
+
+  int files = test_logs_foreach (count_event, &counts);
+  if (files < 0)
+    return test_logs_result (1);
+
+  // Both images logged, the spawned true only exited
+  PrelogStats stats = { 0 };
+  snprintf (path, sizeof (path), "%s/%s/%s", getenv ("HOME"), PRELOG_TARGET_DIR, PRELOG_STATS_FILE);
+  FILE *f = fopen (path, "r");
+  if (f) {
+    if (fread (&stats, sizeof (stats), 1, f) != 1)
+      stats.processes = 0;
+    fclose (f);
+  }
+
+  printf ("%ld before and %ld after exec, %ld headers, %ld lineage, %ld failed exec, %ld spawn\n",
+          counts.before, counts.after, counts.headers, counts.lineage_records, counts.failed, counts.spawned);
+  printf ("%d files, %llu processes, %llu logging\n", files, (unsigned long long) stats.processes,
+          (unsigned long long) stats.logging);
+
+  return test_logs_result (counts.before != BEFORE_EVENTS || counts.after != AFTER_EVENTS ||
+                           counts.headers != 2 || counts.lineage_records != 1 || counts.failed != 1 ||
+                           counts.spawned != 1 || files != 2 || stats.processes != 3 ||
+                           stats.logging != 2);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--check"))
+    return check (argv[0]);
+
+  if (argc > 1 && !strcmp (argv[1], "--after")) {
+    touch ("after", AFTER_EVENTS);
+    return 0;
+  }
+
+  printf ("PreloadLogger exec test\n");
+  fflush (stdout);
+
+  // Events are only logged for user processes
+  if (geteuid () == 0 && (setgid (65534) || setuid (65534))) {
+    printf ("could not drop privileges\nFAILED\n");
+    return 1;
+  }
+  if (geteuid () < 1000) {
+    printf ("skipped, events are not logged for uid %d\n", geteuid ());
+    return 0;
+  }
+
+  if (run (argv[0])) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,163 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Stress test for the fd table, following the same protocol as lib.c:
+ * fds get inserted under a lock after open() returns, and close() checks
+ * membership without the lock, then untracks the fd before really closing
+ * it. Every thread keeps opening tracked and untracked fds so that fd
+ * numbers get recycled between threads all the time. A tracked close that
+ * finds its fd untracked is a lost close event, an untracked fd found in the
+ * table is a spurious one. Then every thread counts I/O on the same tracked
+ * fd, and on an untracked one, without locking, and no count may be lost. */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fdtable.h"
+
+#define THREADS    32
+#define ITERATIONS 20000
+#define COUNTED_FD 7
+#define IGNORED_FD 8
+
+static PrelogFdTable fds = PRELOG_FD_TABLE_INIT;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long opened = 0, closed = 0, lost = 0, spurious = 0;
+
+static int tracked_close (int fd)
+{
+  int tracked = 0;
+
+  if (prelog_fd_table_contains (&fds, fd)) {
+    pthread_mutex_lock (&fd_lock);
+    tracked = prelog_fd_table_remove (&fds, fd);
+    pthread_mutex_unlock (&fd_lock);
+  }
+
+  close (fd);
+  return tracked;
+}
+
+static void *worker (void *data)
+{
+  long my_opened = 0, my_closed = 0, my_lost = 0, my_spurious = 0;
+  int i;
+
+  for (i = 0; i < ITERATIONS; ++i) {
+    int fd = open ("/dev/null", O_RDONLY);
+    if (fd < 0)
+      continue;
+
+    if (i % 3) {
+      pthread_mutex_lock (&fd_lock);
+      prelog_fd_table_insert (&fds, fd, O_RDONLY, 0);
+      pthread_mutex_unlock (&fd_lock);
+      ++my_opened;
+
+      if (tracked_close (fd))
+        ++my_closed;
+      else
+        ++my_lost;
+    } else {
+      if (tracked_close (fd))
+        ++my_spurious;
+    }
+  }
+
+  __atomic_fetch_add (&opened, my_opened, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&closed, my_closed, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&lost, my_lost, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&spurious, my_spurious, __ATOMIC_RELAXED);
+
+  return NULL;
+}
+
+static void *counter (void *data)
+{
+  int i;
+
+  for (i = 0; i < ITERATIONS; ++i) {
+    prelog_fd_table_count (&fds, COUNTED_FD, i % 2 ? PRELOG_FD_IO_WRITE : PRELOG_FD_IO_READ, 3);
+    prelog_fd_table_count (&fds, COUNTED_FD, PRELOG_FD_IO_READ, -1);
+    prelog_fd_table_count (&fds, IGNORED_FD, PRELOG_FD_IO_WRITE, 5);
+  }
+
+  return NULL;
+}
+
+static int check_counts (void)
+{
+  pthread_t threads[THREADS];
+  PrelogFdIo io = { { 0 } };
+  int i, failed = 0;
+
+  // A fresh slot starts from zero, whatever its fd did before
+  prelog_fd_table_insert (&fds, COUNTED_FD, O_RDWR, 0);
+  prelog_fd_table_count (&fds, COUNTED_FD, PRELOG_FD_IO_WRITE, 100);
+  prelog_fd_table_remove (&fds, COUNTED_FD);
+  prelog_fd_table_insert (&fds, COUNTED_FD, O_RDWR, 0);
+
+  for (i = 0; i < THREADS; ++i)
+    pthread_create (&threads[i], NULL, counter, NULL);
+  for (i = 0; i < THREADS; ++i)
+    pthread_join (threads[i], NULL);
+
+  prelog_fd_io_add (&io, prelog_fd_table_lookup (&fds, COUNTED_FD));
+  printf ("counted %llu reads of %llu bytes, %llu writes of %llu bytes\n",
+          (unsigned long long) io.calls[PRELOG_FD_IO_READ], (unsigned long long) io.bytes[PRELOG_FD_IO_READ],
+          (unsigned long long) io.calls[PRELOG_FD_IO_WRITE], (unsigned long long) io.bytes[PRELOG_FD_IO_WRITE]);
+
+  if (io.calls[PRELOG_FD_IO_READ] != THREADS * ITERATIONS * 3 / 2
+      || io.bytes[PRELOG_FD_IO_READ] != THREADS * ITERATIONS / 2 * 3
+      || io.calls[PRELOG_FD_IO_WRITE] != THREADS * ITERATIONS / 2
+      || io.bytes[PRELOG_FD_IO_WRITE] != THREADS * ITERATIONS / 2 * 3)
+    failed = 1;
+
+  if (prelog_fd_table_lookup (&fds, IGNORED_FD)) {
+    printf ("untracked fd counted\n");
+    failed = 1;
+  }
+
+  return failed;
+}
+
+int main(void)
+{
+  pthread_t threads[THREADS];
+  int i;
+
+  printf ("PreloadLogger fd table stress test - %d threads, %d iterations\n", THREADS, ITERATIONS);
+
+  for (i = 0; i < THREADS; ++i)
+    pthread_create (&threads[i], NULL, worker, NULL);
+  for (i = 0; i < THREADS; ++i)
+    pthread_join (threads[i], NULL);
+
+  printf ("opened %ld, closed %ld, lost %ld, spurious %ld\n", opened, closed, lost, spurious);
+
+  if (opened != closed || lost || spurious || check_counts ()) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,240 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Fork stress test. Threads keep opening files and directories while the
+ * main thread forks children that log events of their own and exit. Nothing
+ * may deadlock, the parent's log must hold every one of its threads' events
+ * once, and each child's log exactly its own events. Run it from a scratch
+ * directory with HOME pointing to it and libPreloadLogger.so in LD_PRELOAD,
+ * then run it again with --check and without LD_PRELOAD to read the logs
+ * back. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "test-logs.h"
+
+#define THREADS        8
+#define FORKS          500
+#define CHILD_EVENTS   20
+#define TIMEOUT        120 /* seconds before we call it a deadlock */
+
+static char dir[4096];
+static int stopping = 0;
+static long counts[THREADS];
+
+static void touch (const char *name)
+{
+  char path[4200];
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  close (open (path, O_CREAT | O_WRONLY, 0600));
+}
+
+// Opens its file until the forks are over, and counts how many times
+static void *run_thread (void *data)
+{
+  long t = (long) data;
+  char name[32];
+
+  snprintf (name, sizeof (name), "thread-%ld", t);
+  while (!__atomic_load_n (&stopping, __ATOMIC_RELAXED)) {
+    touch (name);
+    counts[t]++;
+    // closedir logs with _prelog_fd_lock held
+    closedir (opendir (dir));
+  }
+
+  return NULL;
+}
+
+static int run (void)
+{
+  pthread_t threads[THREADS];
+  long t;
+  int i, status, failed = 0;
+
+  alarm (TIMEOUT);
+  for (t = 0; t < THREADS; ++t)
+    pthread_create (&threads[t], NULL, run_thread, (void *) t);
+
+  for (i = 0; i < FORKS; ++i) {
+    pid_t pid = fork ();
+    if (pid == 0) {
+      int j;
+      alarm (TIMEOUT);
+      for (j = 0; j < CHILD_EVENTS; ++j)
+        touch ("child");
+      exit (0);
+    }
+    if (pid < 0 || waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status)) {
+      printf ("child %d did not exit cleanly\n", i);
+      failed = 1;
+    }
+  }
+
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELAXED);
+  for (t = 0; t < THREADS; ++t)
+    pthread_join (threads[t], NULL);
+
+  // For --check, in a file we do not log
+  FILE *out = fopen ("/dev/shm/prelog-test-fork", "w");
+  if (!out)
+    return 1;
+  for (t = 0; t < THREADS; ++t)
+    fprintf (out, "%ld\n", counts[t]);
+  fclose (out);
+
+  return failed;
+}
+
+typedef struct _ForkCounts {
+  long               threads[THREADS];
+  long               child;
+  long               pid;
+} ForkCounts;
+
+typedef struct _ForkLogs {
+  int                parents;
+  int                children;
+  int                failed;
+} ForkLogs;
+
+// Counts the open events of each file in a log, and finds its pid
+static void count_event (char *line, void *data)
+{
+  ForkCounts *counts = data;
+
+  if (line[0] == '@') {
+    char *bar = strchr (line, '|');
+    counts->pid = bar ? atol (bar + 1) : -1;
+    return;
+  }
+
+  char *interpretation = strchr (line, '|');
+  if (!interpretation || strncmp (interpretation, "|" OPEN_SCI "|", 6))
+    return;
+
+  char *uri = interpretation + 6, *end = strchr (uri, '|'), *name;
+  if (!end)
+    return;
+  *end = '\0';
+  name = strrchr (uri, '/');
+  name = name ? name + 1 : uri;
+
+  if (!strcmp (name, "child"))
+    counts->child++;
+  else if (!strncmp (name, "thread-", 7) && atoi (name + 7) < THREADS)
+    counts->threads[atoi (name + 7)]++;
+}
+
+static void check_log (const char *name, const char *path, void *data)
+{
+  ForkLogs *logs = data;
+  ForkCounts found = { { 0 }, 0, -1 };
+  long total = 0;
+  int t;
+
+  if (test_logs_foreach_line (path, count_event, &found) < 0 || found.pid < 0) {
+    printf ("%s: no header\n", name);
+    logs->failed = 1;
+    return;
+  }
+
+  for (t = 0; t < THREADS; ++t)
+    total += found.threads[t];
+
+  if (found.child) {
+    logs->children++;
+    if (found.child != CHILD_EVENTS || total) {
+      printf ("%s: %ld child events and %ld parent events\n", name, found.child, total);
+      logs->failed = 1;
+    }
+    return;
+  }
+
+  logs->parents++;
+  for (t = 0; t < THREADS; ++t) {
+    if (found.threads[t] != counts[t]) {
+      printf ("%s: %ld events for thread %d instead of %ld\n", name, found.threads[t], t, counts[t]);
+      logs->failed = 1;
+    }
+  }
+}
+
+static int check (void)
+{
+  ForkLogs logs = { 0, 0, 0 };
+  int t;
+
+  FILE *in = fopen ("/dev/shm/prelog-test-fork", "r");
+  for (t = 0; t < THREADS; ++t) {
+    if (!in || fscanf (in, "%ld", &counts[t]) != 1) {
+      printf ("no event counts\n");
+      return test_logs_result (1);
+    }
+  }
+  fclose (in);
+  unlink ("/dev/shm/prelog-test-fork");
+
+  if (test_logs_foreach_file (check_log, &logs) < 0)
+    return test_logs_result (1);
+
+  printf ("%d parent log, %d child logs\n", logs.parents, logs.children);
+  return test_logs_result (logs.failed || logs.parents != 1 || logs.children != FORKS);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--check"))
+    return check ();
+
+  printf ("PreloadLogger fork stress test - %d threads, %d forks\n", THREADS, FORKS);
+  fflush (stdout);
+
+  // Events are only logged for user processes
+  if (geteuid () == 0 && (setgid (65534) || setuid (65534))) {
+    printf ("could not drop privileges\nFAILED\n");
+    return 1;
+  }
+  if (geteuid () < 1000) {
+    printf ("skipped, events are not logged for uid %d\n", geteuid ());
+    return 0;
+  }
+
+  if (!getcwd (dir, sizeof (dir))) {
+    printf ("could not get the current directory\nFAILED\n");
+    return 1;
+  }
+
+  if (run ()) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
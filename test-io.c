@@ -0,0 +1,151 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* I/O accounting test. The process reads and writes tracked files through
+ * every call we count, with fds and FILE streams, and the close event of
+ * each must sum up exactly what it did. Run it from a scratch directory with
+ * HOME pointing to it and libPreloadLogger.so in LD_PRELOAD, then run it
+ * again with --check and without LD_PRELOAD to read the logs back. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "test-logs.h"
+
+typedef struct _IoCase {
+  const char        *interpretation;
+  const char        *name;
+  const char        *summary;   /* end of the close event's text */
+  long               found;
+} IoCase;
+
+static IoCase cases[] = {
+  { CLOSE_SCI,  "fds",    ": e0, read 210 B in 3 calls, wrote 300 B in 3 calls|" },
+  { FCLOSE_SCI, "stream", ": e0, read 70 B in 1 calls, wrote 70 B in 1 calls|" },
+  { FCLOSE_SCI, "mixed",  ": e0, read 0 B in 0 calls, wrote 11 B in 2 calls|" },
+  { CLOSE_SCI,  "quiet",  ": e0|" },
+  { NULL, NULL, NULL }
+};
+
+static int run (void)
+{
+  char buf[1000] = { 0 };
+  struct iovec iov[2] = { { buf, 50 }, { buf + 50, 50 } };
+
+  int fd = open ("fds", O_CREAT | O_RDWR, 0600);
+  if (fd < 0
+      || write (fd, buf, 100) != 100
+      || pwrite (fd, buf, 100, 100) != 100
+      || writev (fd, iov, 2) != 100
+      || lseek (fd, 0, SEEK_SET) != 0
+      || read (fd, buf, sizeof (buf)) != 200
+      || pread (fd, buf, 10, 0) != 10
+      || readv (fd, iov, 2) != 0
+      || close (fd))
+    return 1;
+
+  FILE *fp = fopen ("stream", "w+");
+  if (!fp
+      || fwrite (buf, 7, 10, fp) != 10
+      || fseek (fp, 0, SEEK_SET)
+      || fread (buf, 7, 20, fp) != 10
+      || fclose (fp))
+    return 1;
+
+  fd = open ("mixed", O_CREAT | O_RDWR, 0600);
+  if (fd < 0 || write (fd, buf, 5) != 5 || !(fp = fdopen (fd, "r+"))
+      || fwrite (buf, 1, 6, fp) != 6 || fclose (fp))
+    return 1;
+
+  fd = open ("quiet", O_CREAT | O_RDWR, 0600);
+  if (fd < 0 || close (fd))
+    return 1;
+
+  return 0;
+}
+
+static void check_event (char *line, void *data)
+{
+  char subject[256];
+  IoCase *c;
+
+  for (c = cases; c->name; ++c) {
+    snprintf (subject, sizeof (subject), "|%s|%s/%s|", c->interpretation, getenv ("HOME"), c->name);
+    if (!strstr (line, subject))
+      continue;
+    if (strstr (line, c->summary))
+      c->found++;
+    else
+      printf ("%s: unexpected record %s", c->name, line);
+  }
+}
+
+static int check (void)
+{
+  IoCase *c;
+  int failed = 0;
+
+  if (test_logs_foreach (check_event, NULL) < 0)
+    return test_logs_result (1);
+
+  for (c = cases; c->name; ++c) {
+    if (c->found != 1) {
+      printf ("%s: %ld close events ending with %s\n", c->name, c->found, c->summary);
+      failed = 1;
+    }
+  }
+
+  return test_logs_result (failed);
+}
+
+int main(int argc, char **argv)
+{
+  if (!getenv ("HOME")) {
+    printf ("HOME is not set\nFAILED\n");
+    return 1;
+  }
+
+  if (argc > 1 && !strcmp (argv[1], "--check"))
+    return check ();
+
+  printf ("PreloadLogger I/O accounting test\n");
+  fflush (stdout);
+
+  // Events are only logged for user processes
+  if (geteuid () == 0 && (setgid (65534) || setuid (65534))) {
+    printf ("could not drop privileges\nFAILED\n");
+    return 1;
+  }
+  if (geteuid () < 1000) {
+    printf ("skipped, events are not logged for uid %d\n", geteuid ());
+    return 0;
+  }
+
+  if (run ()) {
+    printf ("I/O failed\nFAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
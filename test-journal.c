@@ -0,0 +1,244 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Tests for the journal: threads append numbered records of varying lengths
+ * across many small segments, and a child process that gets SIGKILLed right
+ * after appending must not lose a single record, nor one killed while its
+ * threads append. Every record must come out once, intact, and in order for
+ * its thread, and closing the journal must give back the room past its last
+ * record. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+#define THREADS      8
+#define RECORDS      20000
+#define SEGMENT_SIZE (256 * 1024)
+
+static PrelogJournal *journal;
+static long expected[THREADS + 1];
+static long received, broken, headers;
+
+typedef struct _Appender {
+  pthread_t thread;
+  int       id;
+} Appender;
+
+static size_t make_record (char *buffer, int thread, long seq)
+{
+  size_t len = sprintf (buffer, "%d %ld ", thread, seq);
+  size_t pad = seq % 300;
+  memset (buffer + len, 'a' + seq % 26, pad);
+  return len + pad;
+}
+
+static void *append_forever (void *data)
+{
+  Appender *a = data;
+  char buffer[512];
+  long seq;
+
+  for (seq = 0; ; ++seq) {
+    size_t len = make_record (buffer, a->id, seq % RECORDS);
+    prelog_journal_append (journal, PRELOG_JOURNAL_EVENT, seq % RECORDS, buffer, len);
+  }
+
+  return NULL;
+}
+
+static void *append (void *data)
+{
+  Appender *a = data;
+  char buffer[512];
+  long seq;
+
+  for (seq = 0; seq < RECORDS; ++seq) {
+    size_t len = make_record (buffer, a->id, seq);
+    if (prelog_journal_append (journal, PRELOG_JOURNAL_EVENT, seq, buffer, len) < 0)
+      __atomic_add_fetch (&broken, 1, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+static void check_record (int kind, PrelogTime timestamp, const char *record, size_t len, void *data)
+{
+  char buffer[512];
+  int thread;
+  long seq;
+
+  if (kind == PRELOG_JOURNAL_HEADER) {
+    headers++;
+    return;
+  }
+
+  if (kind != PRELOG_JOURNAL_EVENT || sscanf (record, "%d %ld ", &thread, &seq) != 2 ||
+      thread < 0 || thread > THREADS || seq != expected[thread] % RECORDS || timestamp != seq ||
+      make_record (buffer, thread, seq) != len || memcmp (buffer, record, len)) {
+    broken++;
+    return;
+  }
+
+  expected[thread]++;
+  received++;
+}
+
+static int read_back (int fd, const char *name, long records)
+{
+  struct stat st;
+
+  received = broken = headers = 0;
+  memset (expected, 0, sizeof (expected));
+
+  if (fstat (fd, &st) < 0) {
+    printf ("%s: cannot stat the journal\n", name);
+    return 1;
+  }
+  char *data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED || prelog_journal_read (data, st.st_size, check_record, NULL) < 0) {
+    printf ("%s: cannot read the journal\n", name);
+    return 1;
+  }
+  munmap (data, st.st_size);
+
+  // Any number of records will do when records is negative
+  if ((records < 0 ? !received : received != records) || broken || headers != 1) {
+    printf ("%s: %ld records out of %ld, %ld broken, %ld headers\n", name, received, records, broken, headers);
+    return 1;
+  }
+
+  return 0;
+}
+
+int main(void)
+{
+  Appender appenders[THREADS];
+  struct stat st;
+  int failed = 0, i, status;
+
+  printf ("PreloadLogger journal tests\n");
+
+  // Threads filling many segments
+  int fd = memfd_create ("prelog-test-journal", MFD_CLOEXEC);
+  journal = prelog_journal_create (fd, SEGMENT_SIZE);
+  if (!journal) {
+    printf ("cannot create a journal\nFAILED\n");
+    return 1;
+  }
+
+  prelog_journal_append (journal, PRELOG_JOURNAL_HEADER, 0, "@test|1|test\n", 13);
+  for (i = 0; i < THREADS; ++i) {
+    appenders[i].id = i;
+    pthread_create (&appenders[i].thread, NULL, append, &appenders[i]);
+  }
+  for (i = 0; i < THREADS; ++i)
+    pthread_join (appenders[i].thread, NULL);
+
+  if (broken) {
+    printf ("threads: %ld appends failed\n", broken);
+    failed = 1;
+  }
+  printf ("%u segments for %d records\n", journal->n_segments, THREADS * RECORDS);
+
+  // A new segment with a single record in it
+  char buffer[512];
+  size_t len = make_record (buffer, THREADS, 0);
+  journal->head += SEGMENT_SIZE - journal->head % SEGMENT_SIZE;
+  prelog_journal_append (journal, PRELOG_JOURNAL_EVENT, 0, buffer, len);
+  fstat (fd, &st);
+  blkcnt_t blocks = st.st_blocks;
+  prelog_journal_close (journal);
+  fstat (fd, &st);
+  if (st.st_blocks >= blocks) {
+    printf ("closing: %ld blocks before, %ld after\n", (long) blocks, (long) st.st_blocks);
+    failed = 1;
+  }
+  if (prelog_journal_append (journal, PRELOG_JOURNAL_EVENT, 0, buffer, len) == 0) {
+    printf ("closing: appended to a closed journal\n");
+    failed = 1;
+  }
+
+  failed |= read_back (fd, "threads", THREADS * RECORDS + 1);
+  prelog_journal_detach (journal);
+  close (fd);
+
+  // A process killed with records nobody flushed
+  fd = memfd_create ("prelog-test-journal", MFD_CLOEXEC);
+  pid_t pid = fork ();
+  if (pid == 0) {
+    Appender appender = { 0, 0 };
+    journal = prelog_journal_create (fd, SEGMENT_SIZE);
+    if (!journal)
+      _exit (1);
+    prelog_journal_append (journal, PRELOG_JOURNAL_HEADER, 0, "@test|2|test\n", 13);
+    append (&appender);
+    raise (SIGKILL);
+  }
+
+  if (waitpid (pid, &status, 0) != pid || !WIFSIGNALED (status)) {
+    printf ("killed: the child was not killed\n");
+    failed = 1;
+  } else {
+    failed |= read_back (fd, "killed", RECORDS);
+  }
+  close (fd);
+
+  // A process killed while its threads append: only the records they were
+  // copying may be missing, and nothing after them
+  fd = memfd_create ("prelog-test-journal", MFD_CLOEXEC);
+  pid = fork ();
+  if (pid == 0) {
+    journal = prelog_journal_create (fd, SEGMENT_SIZE);
+    if (!journal)
+      _exit (1);
+    prelog_journal_append (journal, PRELOG_JOURNAL_HEADER, 0, "@test|3|test\n", 13);
+    for (i = 0; i < THREADS; ++i) {
+      appenders[i].id = i;
+      pthread_create (&appenders[i].thread, NULL, append_forever, &appenders[i]);
+    }
+    pause ();
+  }
+
+  usleep (50000);
+  kill (pid, SIGKILL);
+  if (waitpid (pid, &status, 0) != pid || !WIFSIGNALED (status)) {
+    printf ("killed while appending: the child was not killed\n");
+    failed = 1;
+  } else {
+    failed |= read_back (fd, "killed while appending", -1);
+  }
+  close (fd);
+
+  if (failed) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,262 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Latency test. With PRELOG_LATENCY=1, the process opens files, syncs
+ * some, forks a child that opens files of its own and execs itself. Every
+ * logged open must carry its duration, and each process image must write
+ * histograms of exactly its own calls: before exec, at the child's exit
+ * and at the exit of the second image. Closes of fds that were never open
+ * are timed too. Run it from a scratch directory with
+ * HOME pointing to it, PRELOG_LATENCY=1 and libPreloadLogger.so in
+ * LD_PRELOAD, then run it again with --check and without LD_PRELOAD to read
+ * the logs back. Both have to be readable by the user it runs as.
+ *
+ * With --slow, and PRELOG_SLOW set to SLOW_CONFIG instead of PRELOG_LATENCY,
+ * the process opens files quickly and makes a directory: only the mkdir
+ * must be logged, and the opens and closes counted. Check with
+ * --check-slow. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "logger.h"
+#include "test-logs.h"
+
+#define PARENT_OPENS  50
+#define PARENT_SYNCS  5
+#define PARENT_BAD_CLOSES 4
+#define CHILD_OPENS   3
+#define AFTER_OPENS   7
+#define SLOW_CONFIG   "1000000000000,mkdir=0"
+
+typedef struct _LatencyCounts {
+  long               timed;
+  long               untimed;
+  long               opens[3];   /* calls of the open histograms, in any order */
+  long               n_opens;
+  long               syncs;
+  long               closes;     /* calls of the largest close histogram */
+  long               broken;
+} LatencyCounts;
+
+static void touch (const char *name, int times, int syncs)
+{
+  int i;
+  for (i = 0; i < times; ++i) {
+    int fd = open (name, O_CREAT | O_WRONLY, 0600);
+    if (i < syncs)
+      fsync (fd);
+    close (fd);
+  }
+}
+
+static int run (char *self)
+{
+  char *next[] = { self, "--after", NULL };
+  int status, i;
+
+  touch ("timed", PARENT_OPENS, PARENT_SYNCS);
+  for (i = 0; i < PARENT_BAD_CLOSES; ++i)
+    close (-1);
+
+  pid_t pid = fork ();
+  if (pid == 0) {
+    touch ("child", CHILD_OPENS, 0);
+    exit (0);
+  }
+  if (pid < 0 || waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status)) {
+    printf ("child failed\n");
+    return 1;
+  }
+
+  execv (self, next);
+  printf ("could not exec %s\n", self);
+  return 1;
+}
+
+// Checks the text of a histogram record and returns its number of calls
+static long parse_histogram (const char *text)
+{
+  unsigned long long calls, total, max, low, count, sum = 0, previous = 0;
+  int n, first = 1;
+
+  if (sscanf (text, "%llu calls, total %llu ns, max %llu ns:%n", &calls, &total, &max, &n) != 3)
+    return -1;
+  text += n;
+
+  while (*text == ' ' && sscanf (text, " %llu %llu%n", &low, &count, &n) == 2) {
+    if ((!first && low <= previous) || !count || low > max)
+      return -1;
+    previous = low;
+    sum += count;
+    first = 0;
+    text += n;
+    if (*text == ',')
+      ++text;
+  }
+
+  if (*text != '|' || sum != calls || max > total)
+    return -1;
+
+  return calls;
+}
+
+static void count_event (char *line, void *data)
+{
+  LatencyCounts *counts = data;
+  const char *p;
+
+  if (strstr (line, "|" OPEN_SCI "|timed|")) {
+    p = strstr (line, " ns|");
+    while (p && p > line && p[-1] >= '0' && p[-1] <= '9')
+      --p;
+    if (p && p > line + 2 && !strncmp (p - 2, ", ", 2))
+      counts->timed++;
+    else
+      counts->untimed++;
+  } else if ((p = strstr (line, "|" PRELOG_LATENCY_SCI "|" OPEN_SCI "|"))) {
+    long calls = parse_histogram (p + strlen ("|" PRELOG_LATENCY_SCI "|" OPEN_SCI "|"));
+    if (calls < 0 || counts->n_opens == 3)
+      counts->broken++;
+    else
+      counts->opens[counts->n_opens++] = calls;
+  } else if ((p = strstr (line, "|" PRELOG_LATENCY_SCI "|" FSYNC_SCI "|"))) {
+    long calls = parse_histogram (p + strlen ("|" PRELOG_LATENCY_SCI "|" FSYNC_SCI "|"));
+    if (calls < 0)
+      counts->broken++;
+    else
+      counts->syncs += calls;
+  } else if ((p = strstr (line, "|" PRELOG_LATENCY_SCI "|" CLOSE_SCI "|"))) {
+    long calls = parse_histogram (p + strlen ("|" PRELOG_LATENCY_SCI "|" CLOSE_SCI "|"));
+    if (calls < 0)
+      counts->broken++;
+    else if (calls > counts->closes)
+      counts->closes = calls;
+  }
+}
+
+static int has_opens (const LatencyCounts *counts, long calls)
+{
+  int i;
+  for (i = 0; i < counts->n_opens; ++i)
+    if (counts->opens[i] == calls)
+      return 1;
+  return 0;
+}
+
+static int check (void)
+{
+  LatencyCounts counts = { 0 };
+
+  if (test_logs_foreach (count_event, &counts) < 0)
+    return test_logs_result (1);
+
+  printf ("%ld timed and %ld untimed opens, %ld open histograms, %ld syncs, %ld closes, %ld broken\n",
+          counts.timed, counts.untimed, counts.n_opens, counts.syncs, counts.closes, counts.broken);
+
+  return test_logs_result (counts.timed != PARENT_OPENS || counts.untimed || counts.n_opens != 3 || counts.broken
+                           || !has_opens (&counts, PARENT_OPENS) || !has_opens (&counts, CHILD_OPENS)
+                           || !has_opens (&counts, AFTER_OPENS) || counts.syncs != PARENT_SYNCS
+                           || counts.closes < PARENT_OPENS + PARENT_BAD_CLOSES);
+}
+
+typedef struct _SlowCounts {
+  long               opens;
+  long               mkdirs;
+  long               skipped_opens;
+  long               skipped_closes;
+} SlowCounts;
+
+static void count_slow_event (char *line, void *data)
+{
+  SlowCounts *counts = data;
+  const char *p;
+  long n;
+
+  if (strstr (line, "|" OPEN_SCI "|timed|"))
+    counts->opens++;
+  else if (strstr (line, "|" MKDIR_SCI "|kept|") && strstr (line, ", e0, ") && strstr (line, " ns|"))
+    counts->mkdirs++;
+  else if ((p = strstr (line, "|" PRELOG_SLOW_SCI "|" OPEN_SCI "|")) && sscanf (strchr (p + 1, '|') + 6, "%ld events", &n) == 1)
+    counts->skipped_opens += n;
+  else if ((p = strstr (line, "|" PRELOG_SLOW_SCI "|" CLOSE_SCI "|")) && sscanf (strchr (p + 1, '|') + 7, "%ld events", &n) == 1)
+    counts->skipped_closes += n;
+}
+
+static int check_slow (void)
+{
+  SlowCounts counts = { 0 };
+
+  if (test_logs_foreach (count_slow_event, &counts) < 0)
+    return test_logs_result (1);
+
+  printf ("%ld opens and %ld mkdir logged, %ld opens and %ld closes skipped\n",
+          counts.opens, counts.mkdirs, counts.skipped_opens, counts.skipped_closes);
+
+  return test_logs_result (counts.opens || counts.mkdirs != 1 || counts.skipped_opens != PARENT_OPENS
+                           || counts.skipped_closes != PARENT_OPENS);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--check"))
+    return check ();
+  if (argc > 1 && !strcmp (argv[1], "--check-slow"))
+    return check_slow ();
+
+  if (argc > 1 && !strcmp (argv[1], "--after")) {
+    touch ("after", AFTER_OPENS, 0);
+    return 0;
+  }
+
+  printf ("PreloadLogger latency test\n");
+  fflush (stdout);
+
+  // Events are only logged for user processes
+  if (geteuid () == 0 && (setgid (65534) || setuid (65534))) {
+    printf ("could not drop privileges\nFAILED\n");
+    return 1;
+  }
+  if (geteuid () < 1000) {
+    printf ("skipped, events are not logged for uid %d\n", geteuid ());
+    return 0;
+  }
+
+  if (argc > 1 && !strcmp (argv[1], "--slow")) {
+    touch ("timed", PARENT_OPENS, 0);
+    if (mkdir ("kept", 0700)) {
+      printf ("could not create a directory\nFAILED\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (run (argv[0])) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,97 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "test-logs.h"
+
+#define TEST_LOGS_LINE_MAX 8192
+
+typedef struct _TestLogsLines {
+  TestLogsLineFunc   func;
+  void              *data;
+} TestLogsLines;
+
+// Hands the name and path of every log file to func, and returns how many
+// there were, or -1 if there is no log directory
+int test_logs_foreach_file (TestLogsFileFunc func, void *data)
+{
+  char logs[4200], path[8400];
+  struct dirent *entry;
+  int files = 0;
+
+  snprintf (logs, sizeof (logs), "%s/%s", getenv ("HOME"), PRELOG_TARGET_DIR);
+
+  DIR *d = opendir (logs);
+  if (!d) {
+    printf ("no log directory\n");
+    return -1;
+  }
+  while ((entry = readdir (d))) {
+    if (!strstr (entry->d_name, ".log.gz"))
+      continue;
+    snprintf (path, sizeof (path), "%s/%s", logs, entry->d_name);
+    func (entry->d_name, path, data);
+    files++;
+  }
+  closedir (d);
+
+  return files;
+}
+
+// Hands every line of a log to func, newline included, which may modify it
+int test_logs_foreach_line (const char *path, TestLogsLineFunc func, void *data)
+{
+  char line[TEST_LOGS_LINE_MAX];
+
+  gzFile in = prelog_gzopen (path, "r");
+  if (!in)
+    return -1;
+
+  while (gzgets (in, line, sizeof (line)))
+    func (line, data);
+
+  gzclose (in);
+  return 0;
+}
+
+static void test_logs_lines (const char *name, const char *path, void *data)
+{
+  TestLogsLines *lines = data;
+  test_logs_foreach_line (path, lines->func, lines->data);
+}
+
+// Hands every line of every log to func, see test_logs_foreach_file
+int test_logs_foreach (TestLogsLineFunc func, void *data)
+{
+  TestLogsLines lines = { func, data };
+  return test_logs_foreach_file (test_logs_lines, &lines);
+}
+
+int test_logs_result (int failed)
+{
+  if (failed)
+    printf ("FAILED\n");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef	_TEST_LOGS_H
+#define	_TEST_LOGS_H	1
+
+/* Reads back the text logs that the tests running under libPreloadLogger.so
+ * leave in $HOME/PRELOG_TARGET_DIR, for their --check runs. */
+
+typedef void (*TestLogsFileFunc) (const char *name, const char *path, void *data);
+typedef void (*TestLogsLineFunc) (char *line, void *data);
+
+int test_logs_foreach_file (TestLogsFileFunc func, void *data);
+int test_logs_foreach_line (const char *path, TestLogsLineFunc func, void *data);
+int test_logs_foreach (TestLogsLineFunc func, void *data);
+
+int test_logs_result (int failed);
+
+#endif /* TEST_LOGS.h  */
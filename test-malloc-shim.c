@@ -0,0 +1,69 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Preloaded next to libPreloadLogger.so by test-alloc.c. Counts the heap
+ * allocations made by each thread, so that allocations made by the writer
+ * thread do not get blamed on the intercepted calls. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+// Initial-exec so that reading it can never call back into malloc
+static __thread long allocations __attribute__ ((tls_model ("initial-exec"))) = 0;
+
+long prelog_test_allocations (void)
+{
+  return allocations;
+}
+
+void *malloc (size_t size)
+{
+  allocations++;
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+  allocations++;
+  return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc (ptr, size);
+}
+
+void *memalign (size_t alignment, size_t size)
+{
+  allocations++;
+  return __libc_memalign (alignment, size);
+}
+
+int posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+  allocations++;
+  *memptr = __libc_memalign (alignment, size);
+  return *memptr ? 0 : ENOMEM;
+}
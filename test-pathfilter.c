@@ -0,0 +1,103 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Checks that the compiled path filter takes the same decisions as the
+ * prefix checks it replaced, and that extra rules and globs work. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "pathfilter.h"
+
+#define HOME "/home/st*dy"
+
+// The historical checks, minus their allocations
+static int reference (const char *file)
+{
+  int classes = 0;
+
+  if (!file)
+    return PRELOG_PATH_EXCLUDED;
+
+  if ((file[0]=='/' && file[1]=='h' && file[2]=='o' && file[3]=='m' && file[4]=='e' && file[5]=='/')
+      || (file[0]=='/' && file[1]=='t' && file[2]=='m' && file[3]=='p' && file[4]=='/')
+      || (file[0] != '\0' && file[0] != '/'))
+    classes |= PRELOG_PATH_INCLUDED;
+
+  if (!strncmp (file, HOME "/" PRELOG_TARGET_DIR, strlen (HOME "/" PRELOG_TARGET_DIR))
+      || !strncmp (file, HOME "/.cache/", strlen (HOME "/.cache/")))
+    classes |= PRELOG_PATH_EXCLUDED;
+
+  return classes;
+}
+
+static int check (const char *path, int expected)
+{
+  int classes = prelog_path_classify (path);
+  if (classes != expected) {
+    printf ("%s: expected %d, got %d\n", path ? path : "(null)", expected, classes);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void)
+{
+  const char *paths[] = {
+    "", "/", "/h", "/home", "/home/", "/home/study/file.txt", "/homework/x",
+    "/tmp", "/tmp/", "/tmp/x", "/tmpfoo", "/etc/passwd", "/usr/lib/libc.so.6",
+    "lib.c", "./lib.c", "../x", ".", "a/b/c",
+    HOME, HOME "/", HOME "/.local", HOME "/.local/share/zeitgeist",
+    HOME "/.local/share/zeitgeist/2015.log.gz", HOME "/.local/share/zeitgeist-other",
+    HOME "/.local/share/zeitgeis", HOME "/.cache", HOME "/.cache/", HOME "/.cache/x/y",
+    "/home/study/.cache/x", "/home/stxdy/.cache/x", ".cache/x",
+    NULL
+  };
+  int failed = 0, i;
+
+  // HOME holds a glob character, which must be matched literally
+  setenv ("HOME", HOME, 1);
+  setenv (PRELOG_PATH_RULES_ENV, "-/home/*/secret/:+/srv/[a-c]?/**.txt:-**.swp:bogus::+", 1);
+
+  printf ("PreloadLogger path filter tests\n");
+
+  for (i = 0; paths[i]; ++i)
+    failed |= check (paths[i], reference (paths[i]));
+  failed |= check (NULL, PRELOG_PATH_EXCLUDED);
+
+  failed |= check ("/home/bob/secret/key", PRELOG_PATH_INCLUDED | PRELOG_PATH_EXCLUDED);
+  failed |= check ("/home/bob/alice/secret/key", PRELOG_PATH_INCLUDED);
+  failed |= check ("/srv/b1/x/y/z.txt", PRELOG_PATH_INCLUDED);
+  failed |= check ("/srv/b1/z.txt", PRELOG_PATH_INCLUDED);
+  failed |= check ("/srv/d1/z.txt", 0);
+  failed |= check ("/srv/b/z.txt", 0);
+  failed |= check ("/srv/b1/z.tx", 0);
+  failed |= check ("/var/x.swp", PRELOG_PATH_EXCLUDED);
+  failed |= check ("bogus", PRELOG_PATH_INCLUDED);
+
+  if (failed) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Checks the interned path table against a simple model: ids stay valid
+ * while referenced, paths come back the same, unused paths stay cached up to
+ * PRELOG_PATH_TABLE_UNUSED_MAX and go oldest first, and interning a cached
+ * path does not allocate. A random walk of interns, refs and unrefs then
+ * checks every live id after each step. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathtable.h"
+
+#define PATHS   2000
+#define STEPS   200000
+
+extern void *__libc_malloc (size_t size);
+
+static int counting = 0;
+static long allocations = 0;
+
+void *malloc (size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_malloc (size);
+}
+
+static void path_name (char *buf, size_t len, int i)
+{
+  snprintf (buf, len, "/home/study/dir-%d/file-%d.txt", i % 37, i);
+}
+
+static int check_basics (void)
+{
+  PrelogPathTable table = PRELOG_PATH_TABLE_INIT;
+  char name[64];
+  uint32_t ids[PRELOG_PATH_TABLE_UNUSED_MAX + 1];
+  int i, failed = 0;
+
+  uint32_t a = prelog_path_table_intern (&table, "/a", 2);
+  uint32_t b = prelog_path_table_intern (&table, "/b", 2);
+  if (!a || !b || a == b || prelog_path_table_intern (&table, "/a", 2) != a) {
+    printf ("basics: ids %u, %u are not distinct or not shared\n", a, b);
+    return 1;
+  }
+
+  // Two references to /a, so it survives one unref
+  prelog_path_table_unref (&table, a);
+  if (!prelog_path_table_get (&table, a) || strcmp (prelog_path_table_get (&table, a), "/a")) {
+    printf ("basics: /a lost while still referenced\n");
+    failed = 1;
+  }
+
+  // Unreferenced, /a and /b stay cached and cost nothing to get back
+  prelog_path_table_unref (&table, a);
+  prelog_path_table_unref (&table, b);
+  counting = 1;
+  allocations = 0;
+  uint32_t again = prelog_path_table_intern (&table, "/a", 2);
+  counting = 0;
+  if (again != a || allocations) {
+    printf ("basics: cached /a came back as %u instead of %u, with %ld allocations\n", again, a, allocations);
+    failed = 1;
+  }
+  prelog_path_table_unref (&table, a);
+
+  // Past the limit, the oldest unused paths go: /b first, then /a
+  for (i = 0; i < PRELOG_PATH_TABLE_UNUSED_MAX - 1; ++i) {
+    path_name (name, sizeof (name), i);
+    ids[i] = prelog_path_table_intern (&table, name, strlen (name));
+    prelog_path_table_unref (&table, ids[i]);
+  }
+  if (prelog_path_table_get (&table, b) || !prelog_path_table_get (&table, a)) {
+    printf ("basics: /b should be evicted and /a kept\n");
+    failed = 1;
+  }
+
+  path_name (name, sizeof (name), i);
+  ids[i] = prelog_path_table_intern (&table, name, strlen (name));
+  prelog_path_table_unref (&table, ids[i]);
+  if (prelog_path_table_get (&table, a)) {
+    printf ("basics: /a should be evicted\n");
+    failed = 1;
+  }
+
+  return failed;
+}
+
+static int check_random (void)
+{
+  PrelogPathTable table = PRELOG_PATH_TABLE_INIT;
+  static uint32_t ids[PATHS];
+  static int refs[PATHS];
+  char name[64];
+  long step;
+  int i, failed = 0;
+
+  srand (42);
+  for (step = 0; step < STEPS && !failed; ++step) {
+    i = rand () % PATHS;
+    path_name (name, sizeof (name), i);
+
+    // As many unrefs as refs, so that paths keep falling out of use
+    int op = refs[i] ? rand () % 4 : 0;
+    if (op == 0) {
+      uint32_t id = prelog_path_table_intern (&table, name, strlen (name));
+      if (refs[i] && id != ids[i]) {
+        printf ("random: %s moved from id %u to %u while referenced\n", name, ids[i], id);
+        failed = 1;
+      }
+      ids[i] = id;
+      refs[i]++;
+    } else if (op == 1) {
+      prelog_path_table_ref (&table, ids[i]);
+      refs[i]++;
+    } else {
+      prelog_path_table_unref (&table, ids[i]);
+      refs[i]--;
+    }
+
+    // Every referenced path must read back the same
+    if (step % 1000 == 0 || failed) {
+      int j;
+      for (j = 0; j < PATHS; ++j) {
+        const char *path;
+        if (!refs[j])
+          continue;
+        path_name (name, sizeof (name), j);
+        path = prelog_path_table_get (&table, ids[j]);
+        if (!path || strcmp (path, name)) {
+          printf ("random: id %u reads %s instead of %s\n", ids[j], path ? path : "nothing", name);
+          failed = 1;
+          break;
+        }
+      }
+    }
+  }
+
+  uint32_t referenced = 0;
+  for (i = 0; i < PATHS; ++i)
+    referenced += refs[i] > 0;
+  if (!failed && (table.size != referenced + table.n_unused || table.n_unused > PRELOG_PATH_TABLE_UNUSED_MAX)) {
+    printf ("random: %u paths interned for %u referenced and %u unused\n", table.size, referenced, table.n_unused);
+    failed = 1;
+  }
+
+  return failed;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  printf ("PreloadLogger path table tests\n");
+
+  failed |= check_basics ();
+  failed |= check_random ();
+
+  if (failed) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
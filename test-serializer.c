@@ -0,0 +1,180 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Checks that prelog_event_serialize produces the same bytes as the
+ * snprintf/realloc code it replaced, past the timestamp which is now written
+ * by prelog_timestamp_serialize, and that neither of them allocates. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static int counting = 0;
+static long allocations = 0;
+
+void *malloc (size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_realloc (ptr, size);
+}
+
+// The historical implementation of prelog_log_insert_event
+static char *reference (time_t timestamp, const char *interpretation, PrelogSubject **subjects)
+{
+  size_t msg_len = strlen(interpretation) + 24 + 200;
+  char *msg = malloc(sizeof (char) * msg_len);
+  snprintf(msg, msg_len, "%li|%s%s", timestamp, interpretation,
+           (subjects && !subjects[1] ? "|":"\n"));
+
+  int i=0;
+  while (subjects && subjects[i]) {
+    PrelogSubject *s = subjects[i];
+
+    char *old = strdup(msg);
+    size_t slen = strlen(s->uri) + (s->origin ? strlen(s->origin):0) + (s->text ? strlen(s->text):0) + 200;
+    msg = realloc (msg, strlen(old) + slen);
+    snprintf(msg, strlen(old) + slen, "%s%s%s|%s|%s\n", old,
+             (subjects && !subjects[1] ? "":" "), s->uri, s->text, s->origin? s->origin:"");
+    free (old);
+    ++i;
+  }
+
+  return msg;
+}
+
+static int check (const char *name, time_t timestamp, const char *interpretation, PrelogSubject **subjects)
+{
+  static char buffer[PRELOG_RECORD_MAX];
+  PrelogSubject copies[2], *truncated[3] = { NULL, NULL, NULL };
+  int i, failed = 0;
+
+  // The event setters used to truncate every field
+  for (i = 0; subjects && subjects[i]; ++i) {
+    copies[i].uri = strndup (subjects[i]->uri, PRELOG_FIELD_MAX);
+    copies[i].text = subjects[i]->text ? strndup (subjects[i]->text, PRELOG_FIELD_MAX) : NULL;
+    copies[i].origin = subjects[i]->origin ? strndup (subjects[i]->origin, PRELOG_FIELD_MAX) : NULL;
+    truncated[i] = &copies[i];
+  }
+  char *record = reference (timestamp, interpretation, subjects ? truncated : NULL);
+  char *expected = strchr (record, '|') + 1;
+
+  counting = 1;
+  allocations = 0;
+  size_t len = prelog_event_serialize (buffer, sizeof (buffer), interpretation, subjects);
+  counting = 0;
+
+  if (allocations) {
+    printf ("%s: %ld allocations\n", name, allocations);
+    failed = 1;
+  }
+  if (len != strlen (expected) || memcmp (buffer, expected, len)) {
+    printf ("%s: output differs, expected:\n%s\ngot:\n%.*s\n", name, expected, (int) len, buffer);
+    failed = 1;
+  }
+
+  for (i = 0; truncated[i]; ++i) {
+    free (copies[i].uri);
+    free (copies[i].text);
+    free (copies[i].origin);
+  }
+  free (record);
+
+  return failed;
+}
+
+static int check_timestamp (const char *name, PrelogTime timestamp, const PrelogTime *previous, const char *expected)
+{
+  char buffer[48];
+
+  counting = 1;
+  allocations = 0;
+  size_t len = prelog_timestamp_serialize (buffer, sizeof (buffer), timestamp, previous);
+  counting = 0;
+
+  if (allocations || len != strlen (expected) || memcmp (buffer, expected, len)) {
+    printf ("%s: expected %s, got %.*s with %ld allocations\n", name, expected, (int) len, buffer, allocations);
+    return 1;
+  }
+
+  return 0;
+}
+
+int main(void)
+{
+  int failed = 0;
+  char *huge = malloc (3 * PRELOG_FIELD_MAX);
+  memset (huge, 'x', 3 * PRELOG_FIELD_MAX - 1);
+  huge[3 * PRELOG_FIELD_MAX - 1] = '\0';
+
+  PrelogSubject a = { "/home/study/file.txt", NULL, "fd 3: with flag 524288, e0" };
+  PrelogSubject b = { "lib.c", "/home/study/Preload", "New file: with flags 0, e0" };
+  PrelogSubject c = { huge, huge, huge };
+
+  PrelogSubject *one[] = { &a, NULL };
+  PrelogSubject *relative[] = { &b, NULL };
+  PrelogSubject *two[] = { &a, &b, NULL };
+  PrelogSubject *truncated[] = { &c, &b, NULL };
+
+  printf ("PreloadLogger serializer tests\n");
+
+  failed |= check ("one subject", 1444000000, "open", one);
+  failed |= check ("relative path", 1444000000, "fopen", relative);
+  failed |= check ("two subjects", 1444000000, "rename", two);
+  failed |= check ("no subject", 0, "fork", NULL);
+  failed |= check ("negative timestamp", -1, "close", one);
+  failed |= check ("truncated fields", 1444000000, "link", truncated);
+
+  PrelogTime base = 1444000000LL * PRELOG_NSEC_PER_SEC + 12345;
+  PrelogTime later = base + 2 * PRELOG_NSEC_PER_SEC;
+  failed |= check_timestamp ("absolute timestamp", base, NULL, "1444000000.000012345");
+  failed |= check_timestamp ("epoch", 0, NULL, "0.000000000");
+  failed |= check_timestamp ("delta", later, &base, "+2000000000");
+  failed |= check_timestamp ("same time", base, &base, "+0");
+  failed |= check_timestamp ("clock stepped back", base, &later, "1444000000.000012345");
+
+  free (huge);
+
+  if (failed) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
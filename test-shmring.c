@@ -0,0 +1,238 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Stress test for the shared ring: several processes with several threads
+ * each append numbered records of varying lengths to a small ring, and retry
+ * when it is full, while the parent consumes. Every record must come out
+ * once, intact, and in order for its thread, and the ring must count exactly
+ * the appends it turned away. Then records left reserved by producers that
+ * died or stalled must be skipped and counted as lost. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+#define PROCESSES  4
+#define THREADS    4
+#define RECORDS    20000
+#define RING_SIZE  (256 * 1024)
+
+static PrelogShmRing *ring;
+static uint64_t *rejected; /* shared with the producers */
+
+static long expected[PROCESSES][THREADS];
+static pid_t pids[PROCESSES];
+static long received = 0, broken = 0;
+
+typedef struct _Producer {
+  pthread_t thread;
+  int       process;
+  int       id;
+} Producer;
+
+static size_t make_record (char *buffer, int process, int thread, long seq)
+{
+  size_t len = sprintf (buffer, "%d %d %ld ", process, thread, seq);
+  size_t pad = seq % 300;
+  memset (buffer + len, 'a' + seq % 26, pad);
+  return len + pad;
+}
+
+static void *produce (void *data)
+{
+  Producer *p = data;
+  char buffer[512];
+  long seq;
+
+  for (seq = 0; seq < RECORDS; ++seq) {
+    size_t len = make_record (buffer, p->process, p->id, seq);
+    while (prelog_shm_ring_append (ring, seq, buffer, len) < 0) {
+      __atomic_add_fetch (rejected, 1, __ATOMIC_RELAXED);
+      sched_yield ();
+    }
+  }
+
+  return NULL;
+}
+
+static void check_record (uint32_t pid, PrelogTime timestamp, const char *record, size_t len, void *data)
+{
+  char copy[512], expected_record[512];
+  int process, thread;
+  long seq;
+
+  received++;
+  if (len >= sizeof (copy) || (memcpy (copy, record, len), copy[len] = '\0',
+      sscanf (copy, "%d %d %ld ", &process, &thread, &seq) != 3) ||
+      process < 0 || process >= PROCESSES || thread < 0 || thread >= THREADS) {
+    broken++;
+    return;
+  }
+
+  if (pid != (uint32_t) pids[process] || timestamp != seq || seq != expected[process][thread] ||
+      make_record (expected_record, process, thread, seq) != len || memcmp (record, expected_record, len)) {
+    printf ("process %d thread %d: bad record %ld, expected %ld\n", process, thread, seq, expected[process][thread]);
+    broken++;
+  }
+  expected[process][thread] = seq + 1;
+}
+
+static void count_record (uint32_t pid, PrelogTime timestamp, const char *record, size_t len, void *data)
+{
+  if (len == 4 && !memcmp (record, "kept", 4))
+    ++*(int *) data;
+}
+
+// Turns a published record back into a reservation, as if its producer had
+// been killed before publishing it
+static int unpublish (PrelogShmRing *r, size_t len, pid_t pid)
+{
+  uint64_t word = ((uint64_t) len << 32) | (uint32_t) pid;
+  size_t i;
+
+  for (i = 0; i < r->size; i += sizeof (uint64_t)) {
+    uint64_t *p = (uint64_t *) (r->data + i);
+    if (*p == word) {
+      *p |= PRELOG_SHM_SLOT_RESERVED;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static int check_abandoned (char *buffer)
+{
+  struct timespec stall = { 0, (PRELOG_SHM_RING_STALL_MS % 1000 + 100) * 1000000L };
+  int fd = memfd_create ("test-shmring-abandoned", MFD_CLOEXEC);
+  int kept = 0, first, second;
+
+  stall.tv_sec = PRELOG_SHM_RING_STALL_MS / 1000;
+
+  pid_t dead = fork ();
+  if (dead == 0)
+    _exit (0);
+  waitpid (dead, NULL, 0);
+
+  PrelogShmRing *r = fd < 0 ? NULL : prelog_shm_ring_create (fd, RING_SIZE);
+  PrelogShmRing *gone = r ? prelog_shm_ring_attach (fd, dead) : NULL;
+  PrelogShmRing *alive = r ? prelog_shm_ring_attach (fd, getpid ()) : NULL;
+  if (!gone || !alive ||
+      prelog_shm_ring_append (gone, 1, "dead producer", 13) < 0 ||
+      prelog_shm_ring_append (alive, 2, "stalled producer", 16) < 0 ||
+      prelog_shm_ring_append (alive, 3, "kept", 4) < 0 ||
+      unpublish (r, 13, dead) < 0 || unpublish (r, 16, getpid ()) < 0) {
+    printf ("could not set the abandoned records up\n");
+    return 1;
+  }
+
+  first = prelog_shm_ring_consume (r, buffer, count_record, &kept);
+  uint64_t lost_first = prelog_shm_ring_lost (r);
+  nanosleep (&stall, NULL);
+  second = prelog_shm_ring_consume (r, buffer, count_record, &kept);
+
+  printf ("%d then %d records, %d kept, %llu then %llu lost\n", first, second, kept,
+          (unsigned long long) lost_first, (unsigned long long) prelog_shm_ring_lost (r));
+
+  int failed = first != 0 || lost_first != 1 || second != 1 || kept != 1 || prelog_shm_ring_lost (r) != 2;
+
+  prelog_shm_ring_detach (gone);
+  prelog_shm_ring_detach (alive);
+  prelog_shm_ring_close (r);
+  close (fd);
+  return failed;
+}
+
+int main(void)
+{
+  char *buffer = malloc (PRELOG_RECORD_MAX);
+  int i, t, running = PROCESSES, failed = 0;
+
+  printf ("PreloadLogger shared ring stress test\n");
+
+  int fd = memfd_create ("test-shmring", MFD_CLOEXEC);
+  rejected = mmap (NULL, sizeof (uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (fd < 0 || rejected == MAP_FAILED || !buffer || !(ring = prelog_shm_ring_create (fd, RING_SIZE))) {
+    printf ("could not set the ring up\nFAILED\n");
+    return 1;
+  }
+
+  for (i = 0; i < PROCESSES; ++i) {
+    pids[i] = fork ();
+    if (pids[i] == 0) {
+      PrelogShmRing *mine = prelog_shm_ring_attach (fd, getpid ());
+      Producer producers[THREADS];
+      if (!mine)
+        _exit (1);
+      ring = mine;
+      for (t = 0; t < THREADS; ++t) {
+        producers[t].process = i;
+        producers[t].id = t;
+        pthread_create (&producers[t].thread, NULL, produce, &producers[t]);
+      }
+      for (t = 0; t < THREADS; ++t)
+        pthread_join (producers[t].thread, NULL);
+      _exit (0);
+    }
+  }
+
+  while (running) {
+    if (!prelog_shm_ring_consume (ring, buffer, check_record, NULL))
+      prelog_shm_ring_wait (ring, 10);
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+      running--;
+      if (!WIFEXITED (status) || WEXITSTATUS (status)) {
+        printf ("producer %d failed\n", pid);
+        failed = 1;
+      }
+    }
+  }
+  prelog_shm_ring_consume (ring, buffer, check_record, NULL);
+
+  printf ("%ld records, %ld broken, %llu appends turned away\n",
+          received, broken, (unsigned long long) *rejected);
+
+  if (received != (long) PROCESSES * THREADS * RECORDS || broken ||
+      prelog_shm_ring_overflows (ring) != *rejected)
+    failed = 1;
+
+  failed |= check_abandoned (buffer);
+
+  prelog_shm_ring_close (ring);
+  free (buffer);
+
+  if (failed) {
+    printf ("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
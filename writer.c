@@ -0,0 +1,404 @@
+/*
+    2015 (c) Steve Dodier-Lazaro <sidnioulz@gmail.com>
+    This file is part of PreloadLogger.
+
+    PreloadLogger is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    PreloadLogger is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with PreloadLogger.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "logger.h"
+
+/* Each thread appends its records to its own ring buffer, without locking.
+ * A single writer thread per process drains all rings into the gzip stream,
+ * so compression never happens on the calling thread unless its ring is
+ * full. The owner thread is the only one to move a ring's head, and tails
+ * only move with _prelog_writer_lock held, by the writer thread or by the
+ * owner when it needs room. Rings are drained when their thread exits and
+ * when the process shuts down.
+ *
+ * Records sit in the rings as a PrelogRecordHeader followed by the serialized
+ * event. The writer hands them to prelog_log_format_record as it drains them,
+ * which prepends their timestamp in text logs, absolute for the first record
+ * of each chunk and as a delta from the previous record otherwise, and which
+ * encodes them in binary logs. A batch only ever holds records from one
+ * thread, and is written to the log in chunks of at most PRELOG_MESSAGE_MAX
+ * bytes of text. */
+
+typedef struct _PrelogRecordHeader {
+  PrelogTime                   timestamp;
+  uint32_t                     len;
+} PrelogRecordHeader;
+
+typedef struct _PrelogThreadBuffer {
+  char                        *data;
+  char                        *scratch;
+  size_t                       head;
+  size_t                       tail;
+  struct _PrelogThreadBuffer  *next;
+} PrelogThreadBuffer;
+
+static PrelogThreadBuffer *_prelog_buffers = NULL;
+static __thread PrelogThreadBuffer *_prelog_buffer = NULL;
+
+static pthread_mutex_t _prelog_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  _prelog_writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       _prelog_writer_thread;
+static int             _prelog_writer_running = 0;
+static int             _prelog_writer_stopping = 0;
+static PrelogLog      *_prelog_writer_log = NULL;
+
+static pthread_key_t   _prelog_buffer_key;
+static pthread_once_t  _prelog_buffer_key_once = PTHREAD_ONCE_INIT;
+
+// Output is staged here so that zlib and the collector get large writes. Each
+// flush starts with an absolute timestamp so that it can be read on its own,
+// and text flushes fit in PRELOG_MESSAGE_MAX bytes. Binary records take up to
+// twice as much room.
+static char   _prelog_writer_out[2 * PRELOG_MESSAGE_MAX];
+static size_t _prelog_writer_out_len = 0;
+
+// Records that wrap around the end of their ring get copied here
+static char   _prelog_writer_record[PRELOG_RECORD_MAX];
+
+// Call with _prelog_writer_lock held
+static void prelog_writer_flush (void)
+{
+  if (_prelog_writer_log && _prelog_writer_out_len)
+    prelog_log_write (_prelog_writer_log, _prelog_writer_out, _prelog_writer_out_len);
+  _prelog_writer_out_len = 0;
+}
+
+// Call with _prelog_writer_lock held, after making room for the record
+static void prelog_writer_write (PrelogTime timestamp, const PrelogTime *previous, const char *record, size_t len)
+{
+  _prelog_writer_out_len += prelog_log_format_record (_prelog_writer_log,
+                                                      _prelog_writer_out + _prelog_writer_out_len,
+                                                      sizeof (_prelog_writer_out) - _prelog_writer_out_len,
+                                                      timestamp, previous, record, len);
+}
+
+// Copies len bytes at position pos of the ring, which may wrap around
+static void prelog_ring_read (const PrelogThreadBuffer *buf, size_t pos, void *data, size_t len)
+{
+  size_t start = pos % PRELOG_BUFFER_SIZE;
+  if (start + len > PRELOG_BUFFER_SIZE) {
+    size_t first = PRELOG_BUFFER_SIZE - start;
+    memcpy (data, buf->data + start, first);
+    memcpy ((char *) data + first, buf->data, len - first);
+  } else {
+    memcpy (data, buf->data + start, len);
+  }
+}
+
+static void prelog_ring_write (PrelogThreadBuffer *buf, size_t pos, const void *data, size_t len)
+{
+  size_t start = pos % PRELOG_BUFFER_SIZE;
+  if (start + len > PRELOG_BUFFER_SIZE) {
+    size_t first = PRELOG_BUFFER_SIZE - start;
+    memcpy (buf->data + start, data, first);
+    memcpy (buf->data, (const char *) data + first, len - first);
+  } else {
+    memcpy (buf->data + start, data, len);
+  }
+}
+
+// Call with _prelog_writer_lock held
+static void prelog_writer_drain (PrelogThreadBuffer *buf)
+{
+  size_t head = __atomic_load_n (&buf->head, __ATOMIC_ACQUIRE);
+  size_t tail = buf->tail;
+  PrelogTime previous = 0;
+  int first = 1;
+
+  if (head == tail)
+    return;
+
+  while (tail != head) {
+    PrelogRecordHeader header;
+    prelog_ring_read (buf, tail, &header, sizeof (header));
+    tail += sizeof (header);
+
+    if (_prelog_writer_out_len + PRELOG_STAMP_MAX + header.len > PRELOG_MESSAGE_MAX) {
+      prelog_writer_flush ();
+      first = 1;
+    }
+
+    const char *record = buf->data + tail % PRELOG_BUFFER_SIZE;
+    if (tail % PRELOG_BUFFER_SIZE + header.len > PRELOG_BUFFER_SIZE) {
+      prelog_ring_read (buf, tail, _prelog_writer_record, header.len);
+      record = _prelog_writer_record;
+    }
+
+    prelog_writer_write (header.timestamp, first ? NULL : &previous, record, header.len);
+    previous = header.timestamp;
+    first = 0;
+    tail += header.len;
+  }
+
+  prelog_writer_flush ();
+  __atomic_store_n (&buf->tail, head, __ATOMIC_RELEASE);
+}
+
+// Call with _prelog_writer_lock held
+static void prelog_writer_drain_all (void)
+{
+  PrelogThreadBuffer *buf;
+  for (buf = _prelog_buffers; buf; buf = buf->next)
+    prelog_writer_drain (buf);
+}
+
+static void prelog_writer_buffer_destroy (void *data)
+{
+  PrelogThreadBuffer *buf = data, **iter;
+
+  pthread_mutex_lock (&_prelog_writer_lock);
+  prelog_writer_drain (buf);
+  for (iter = &_prelog_buffers; *iter; iter = &(*iter)->next) {
+    if (*iter == buf) {
+      *iter = buf->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&_prelog_writer_lock);
+
+  _prelog_buffer = NULL;
+  free (buf->data);
+  free (buf->scratch);
+  free (buf);
+}
+
+static void prelog_writer_key_create (void)
+{
+  pthread_key_create (&_prelog_buffer_key, prelog_writer_buffer_destroy);
+}
+
+static PrelogThreadBuffer *prelog_writer_get_buffer (void)
+{
+  if (_prelog_buffer)
+    return _prelog_buffer;
+
+  PrelogThreadBuffer *buf = calloc (1, sizeof (PrelogThreadBuffer));
+  if (!buf)
+    return NULL;
+
+  buf->data = malloc (PRELOG_BUFFER_SIZE);
+  buf->scratch = malloc (PRELOG_RECORD_MAX);
+  if (!buf->data || !buf->scratch) {
+    free (buf->data);
+    free (buf->scratch);
+    free (buf);
+    return NULL;
+  }
+
+  pthread_once (&_prelog_buffer_key_once, prelog_writer_key_create);
+  pthread_setspecific (_prelog_buffer_key, buf);
+
+  pthread_mutex_lock (&_prelog_writer_lock);
+  buf->next = _prelog_buffers;
+  _prelog_buffers = buf;
+  pthread_mutex_unlock (&_prelog_writer_lock);
+
+  _prelog_buffer = buf;
+  return buf;
+}
+
+// Per-thread room for serializing one record before appending it
+char *prelog_writer_scratch (void)
+{
+  PrelogThreadBuffer *buf = prelog_writer_get_buffer ();
+  return buf ? buf->scratch : NULL;
+}
+
+static void *prelog_writer_main (void *data)
+{
+  pthread_mutex_lock (&_prelog_writer_lock);
+  while (!_prelog_writer_stopping) {
+    struct timespec deadline;
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PRELOG_WRITER_INTERVAL;
+
+    pthread_cond_timedwait (&_prelog_writer_cond, &_prelog_writer_lock, &deadline);
+    prelog_writer_drain_all ();
+  }
+  pthread_mutex_unlock (&_prelog_writer_lock);
+
+  return NULL;
+}
+
+static void prelog_writer_start (PrelogLog *log)
+{
+  pthread_mutex_lock (&_prelog_writer_lock);
+  if (!_prelog_writer_stopping)
+    _prelog_writer_log = log;
+
+  if (!_prelog_writer_running && !_prelog_writer_stopping) {
+    // The writer must not run the application's signal handlers
+    sigset_t all, old;
+    sigfillset (&all);
+    pthread_sigmask (SIG_SETMASK, &all, &old);
+    if (pthread_create (&_prelog_writer_thread, NULL, prelog_writer_main, NULL) == 0)
+      __atomic_store_n (&_prelog_writer_running, 1, __ATOMIC_RELEASE);
+    pthread_sigmask (SIG_SETMASK, &old, NULL);
+  }
+  pthread_mutex_unlock (&_prelog_writer_lock);
+}
+
+void prelog_writer_append (PrelogLog *log, PrelogTime timestamp, const char *record, size_t len)
+{
+  if (!log || !record || !len)
+    return;
+  if (len > PRELOG_RECORD_MAX)
+    len = PRELOG_RECORD_MAX;
+
+  if (!__atomic_load_n (&_prelog_writer_running, __ATOMIC_ACQUIRE) || _prelog_writer_log != log)
+    prelog_writer_start (log);
+
+  PrelogThreadBuffer *buf = prelog_writer_get_buffer ();
+  PrelogRecordHeader header = { timestamp, (uint32_t) len };
+  size_t total = sizeof (header) + len;
+
+  // No ring to write to, or the record could never fit in one: write it
+  // ourselves, after whatever this thread had pending
+  if (!buf || total > PRELOG_BUFFER_SIZE) {
+    pthread_mutex_lock (&_prelog_writer_lock);
+    if (buf)
+      prelog_writer_drain (buf);
+    prelog_writer_write (timestamp, NULL, record, len);
+    prelog_writer_flush ();
+    pthread_mutex_unlock (&_prelog_writer_lock);
+    return;
+  }
+
+  size_t head = buf->head;
+  size_t tail = __atomic_load_n (&buf->tail, __ATOMIC_ACQUIRE);
+
+  if (PRELOG_BUFFER_SIZE - (head - tail) < total) {
+    pthread_mutex_lock (&_prelog_writer_lock);
+    prelog_writer_drain (buf);
+    pthread_mutex_unlock (&_prelog_writer_lock);
+    tail = head;
+  }
+
+  prelog_ring_write (buf, head, &header, sizeof (header));
+  prelog_ring_write (buf, head + sizeof (header), record, len);
+
+  __atomic_store_n (&buf->head, head + total, __ATOMIC_RELEASE);
+
+  // Wake the writer up as the ring goes past a quarter full
+  if (head - tail < PRELOG_BUFFER_SIZE / 4 && head + total - tail >= PRELOG_BUFFER_SIZE / 4)
+    pthread_cond_signal (&_prelog_writer_cond);
+}
+
+void prelog_writer_shutdown (void)
+{
+  int saved_errno = errno;
+
+  pthread_mutex_lock (&_prelog_writer_lock);
+  int running = _prelog_writer_running;
+  _prelog_writer_stopping = 1;
+  pthread_cond_signal (&_prelog_writer_cond);
+  pthread_mutex_unlock (&_prelog_writer_lock);
+
+  if (running && !pthread_equal (pthread_self (), _prelog_writer_thread))
+    pthread_join (_prelog_writer_thread, NULL);
+
+  pthread_mutex_lock (&_prelog_writer_lock);
+  prelog_writer_drain_all ();
+  _prelog_writer_running = 0;
+  _prelog_writer_log = NULL;
+  pthread_mutex_unlock (&_prelog_writer_lock);
+
+  errno = saved_errno;
+}
+
+/* exec does not run atexit handlers, so what the rings hold gets written
+ * before it. The calling thread's ring goes first, others follow for as long
+ * as PRELOG_EXEC_FLUSH_MS allows, waiting on a busy writer included, and the
+ * log then ends its gzip member. Records left over are lost, as they were.
+ * A member left open only spoils the end of its own file, as the next image
+ * opens another one, see prelog_log_open_file. */
+void prelog_writer_sync (PrelogLog *log)
+{
+  int saved_errno = errno;
+  struct timespec now, deadline;
+  PrelogThreadBuffer *buf;
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += PRELOG_EXEC_FLUSH_MS * 1000000L;
+  if (deadline.tv_nsec >= PRELOG_NSEC_PER_SEC) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= PRELOG_NSEC_PER_SEC;
+  }
+
+  if (pthread_mutex_timedlock (&_prelog_writer_lock, &deadline)) {
+    errno = saved_errno;
+    return;
+  }
+
+  if (_prelog_writer_log == log) {
+    if (_prelog_buffer)
+      prelog_writer_drain (_prelog_buffer);
+    for (buf = _prelog_buffers; buf; buf = buf->next) {
+      clock_gettime (CLOCK_REALTIME, &now);
+      if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        break;
+      prelog_writer_drain (buf);
+    }
+  }
+  prelog_log_finish (log);
+  pthread_mutex_unlock (&_prelog_writer_lock);
+
+  errno = saved_errno;
+}
+
+// Keeps the writer thread and the other threads' drains out of the way of a
+// fork, so that the child inherits rings and output in a consistent state
+void prelog_writer_fork_prepare (void)
+{
+  pthread_mutex_lock (&_prelog_writer_lock);
+}
+
+void prelog_writer_fork_parent (void)
+{
+  pthread_mutex_unlock (&_prelog_writer_lock);
+}
+
+void prelog_writer_reset_after_fork (void)
+{
+  PrelogThreadBuffer *buf = _prelog_buffer;
+
+  // Only the forking thread survived, and it held the lock across fork
+  pthread_mutex_init (&_prelog_writer_lock, NULL);
+  pthread_cond_init (&_prelog_writer_cond, NULL);
+  _prelog_writer_running = 0;
+  _prelog_writer_stopping = 0;
+  _prelog_writer_log = NULL;
+  _prelog_writer_out_len = 0;
+
+  // Pending records belong to the parent, which will write them. Rings of
+  // the threads that did not survive are abandoned as they may be in use.
+  _prelog_buffers = buf;
+  if (buf) {
+    buf->tail = buf->head;
+    buf->next = NULL;
+  }
+}
@@ -1534,11 +1534,12 @@ ZEXTERN int ZEXPORT prelog_gzclose_w OF((gzFile file));
    zlib library.
 */
 
-ZEXTERN int ZEXPORT prelog_gzclose_no_flush OF((gzFile file));
+ZEXTERN int ZEXPORT prelog_gzabandon OF((gzFile file));
 /*
-     Same as prelog_gzclose_w(), except that the remaining uncompressed data will not
-   be flushed to the file. Useful for when you need to close a gzFile handle
-   after a fork in only one of the resulting processes.
+     Returns the file descriptor of a gzFile handle inherited through a fork,
+   for the caller to close, and leaves the rest of it alone: its memory and
+   the compressor state in it are the parent's, copy-on-write, and may be
+   used again by the parent only. Returns -1 if file is NULL.
 */
 
 ZEXTERN const char * ZEXPORT gzerror OF((gzFile file, int *errnum));